@@ -1,6 +1,6 @@
 //
 // Matrix Factorization
-//  1) gradient discent
+//  1) gradient discent (fixed steps, Nesterov momentum or L-BFGS)
 //  2) stochastic grandient discent
 //  3) stochastic gradient descent with biases
 //
@@ -12,10 +12,24 @@
 //    http://www.grouplens.org/node/73
 //
 // Build:
-//   % g++ -Wall -O3 factorize_sgd.cc -o factorize_sgd
+//   % g++ -Wall -O3 -fopenmp factorize_sgd.cc -o factorize_sgd
+//
+// Usage:
+//   % factorize_sgd dir ncluster niter eta lambda [gd|nesterov|lbfgs]
+//   Without an optimizer, stochastic gradient descent with biases runs.
+//   With one, full-batch gradient descent runs for at most niter
+//   iterations (Nesterov and L-BFGS stop when the loss stops
+//   decreasing), and passes over the ratings and time are reported.
 //
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -29,56 +43,140 @@ using namespace Eigen;
 typedef MatrixXf Mat;
 typedef SparseMatrix<int, RowMajor> SMat;
 
+double clock_seconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* optimizers of full-batch gradient descent */
+enum Optimizer {
+  OPT_FIXED    = 0,  // fixed-size steps
+  OPT_NESTEROV = 1,  // Nesterov momentum with backtracking
+  OPT_LBFGS    = 2   // L-BFGS with backtracking
+};
+
+/* constants */
+const int LBFGS_HISTORY = 5;         // correction pairs kept by L-BFGS
+const double GD_TOLERANCE = 1e-6;    // minimum relative decrease of loss
+const double ARMIJO_SLOPE = 1e-4;    // sufficient decrease of line search
+const double STEP_GROWTH = 1.25;     // growth of Nesterov steps
+const double MIN_STEP = 1e-20;       // smallest step of line search
+
 /* virtual class of Matrix Factorization */
 class MF {
  protected:
   SMat mtrain_;
   Mat U_;
   Mat V_;
+  size_t npass_;  // passes over the training matrix in factorize()
+
+  struct Rating {
+    int user;
+    int item;
+    int rate;
+    bool operator<(const Rating &r) const {
+      return user < r.user || (user == r.user && item < r.item);
+    }
+  };
+
+  static const char *parse_uint(const char *p, const char *end,
+                                size_t &value) {
+    value = 0;
+    const char *q = p;
+    for (; q < end && *q >= '0' && *q <= '9'; ++q) {
+      value = value * 10 + (*q - '0');
+    }
+    return q;
+  }
 
-  size_t split(std::string s, const std::string &delimiter,
-               std::vector<std::string> &splited) const {
-    size_t cnt = 0;
-    for (size_t p = 0; (p = s.find(delimiter)) != s.npos; ) {
-      splited.push_back(s.substr(0, p));
-      ++cnt;
-      s = s.substr(p + delimiter.size());
+  static void parse_chunk(const char *p, const char *end,
+                          std::vector<Rating> &ratings) {
+    while (p < end) {
+      const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+      if (eol == NULL) eol = end;
+      size_t userid, itemid, rate;
+      const char *q = parse_uint(p, eol, userid);
+      if (q != p && q < eol && *q == '\t') {
+        const char *r = parse_uint(q + 1, eol, itemid);
+        if (r != q + 1 && r < eol && *r == '\t'
+            && parse_uint(r + 1, eol, rate) != r + 1) {
+          Rating rating = { static_cast<int>(userid),
+                            static_cast<int>(itemid),
+                            static_cast<int>(rate) };
+          ratings.push_back(rating);
+        }
+      }
+      p = eol + 1;
     }
-    splited.push_back(s);
-    ++cnt;
-    return cnt;
   }
 
   void read_file(const char *filename, SMat &mat) const {
-    std::ifstream ifs(filename);
-    if (!ifs) {
+    double start = clock_seconds();
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
       fprintf(stderr, "cannot open %s\n", filename);
       exit(1);
     }
-    size_t max_userid = 0;
-    size_t max_itemid = 0;
-    std::string line;
-    std::vector<std::string> splited;
-    while (getline(ifs, line)) {
-      split(line, "\t", splited);
-      size_t userid = atoi(splited[0].c_str());
-      size_t itemid = atoi(splited[1].c_str());
-      if (max_userid < userid) max_userid = userid;
-      if (max_itemid < itemid) max_itemid = itemid;
-      splited.clear();
+    size_t size = st.st_size;
+    const char *data = NULL;
+    if (size > 0) {
+      void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr == MAP_FAILED) {
+        fprintf(stderr, "cannot mmap %s\n", filename);
+        exit(1);
+      }
+      data = static_cast<const char *>(addr);
     }
-    mat.resize(max_userid+1, max_itemid+1);
+    close(fd);
+
+    // parse newline-aligned chunks in parallel
+    const size_t chunk_size = 4 * 1024 * 1024;
+    size_t nchunk = (size + chunk_size - 1) / chunk_size;
+    std::vector<const char *> bounds(nchunk + 1, data + size);
+    if (nchunk > 0) bounds[0] = data;
+    for (size_t i = 1; i < nchunk; i++) {
+      const char *p = data + i * chunk_size - 1;
+      if (p < bounds[i-1]) p = bounds[i-1];
+      const char *eol =
+        static_cast<const char *>(memchr(p, '\n', data + size - p));
+      bounds[i] = eol ? eol + 1 : data + size;
+    }
+    std::vector<std::vector<Rating> > chunks(nchunk);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < static_cast<int>(nchunk); i++) {
+      parse_chunk(bounds[i], bounds[i+1], chunks[i]);
+    }
+    if (data) munmap(const_cast<char *>(data), size);
+
+    std::vector<Rating> ratings;
+    int max_userid = 0;
+    int max_itemid = 0;
+    for (size_t i = 0; i < nchunk; i++) {
+      for (size_t j = 0; j < chunks[i].size(); j++) {
+        if (max_userid < chunks[i][j].user) max_userid = chunks[i][j].user;
+        if (max_itemid < chunks[i][j].item) max_itemid = chunks[i][j].item;
+      }
+      ratings.insert(ratings.end(), chunks[i].begin(), chunks[i].end());
+      std::vector<Rating>().swap(chunks[i]);
+    }
+    std::stable_sort(ratings.begin(), ratings.end());
 
-    ifs.clear();
-    ifs.seekg(0, std::ios_base::beg);
-    while (getline(ifs, line)) {
-      split(line, "\t", splited);
-      size_t userid = atoi(splited[0].c_str());
-      size_t itemid = atoi(splited[1].c_str());
-      int rate = atoi(splited[2].c_str());
-      mat.fill(userid, itemid) = rate;
-      splited.clear();
+    // fill the matrix at once in sorted order
+    mat.resize(max_userid+1, max_itemid+1);
+    mat.startFill(ratings.size());
+    for (size_t i = 0; i < ratings.size(); i++) {
+      if (i + 1 < ratings.size() && ratings[i].user == ratings[i+1].user
+          && ratings[i].item == ratings[i+1].item) continue;
+      mat.fill(ratings[i].user, ratings[i].item) = ratings[i].rate;
     }
+    mat.endFill();
+
+    double elapsed = clock_seconds() - start;
+    fprintf(stderr, "Read %ld ratings from %s in %.3f sec (%.1f MB/s)\n",
+            static_cast<long>(ratings.size()), filename, elapsed,
+            size / 1048576.0 / (elapsed > 0 ? elapsed : 1e-9));
   }
 
   void set_random(Mat &mat) const {
@@ -104,13 +202,20 @@ class MF {
   virtual double predict_rate(int user, int item) const = 0;
 
  public:
+  MF() : npass_(0) { }
+  virtual ~MF() { }
+
   virtual void factorize(size_t ncluster, size_t niter,
                          double eta, double lambda) = 0;
 
-  void train(const char *filename) {
+  virtual void train(const char *filename) {
     read_file(filename, mtrain_);
   }
 
+  size_t num_passes() const {
+    return npass_;
+  }
+
   double test(const char *filename) const {
     SMat mtest;
     read_file(filename, mtest);
@@ -130,8 +235,282 @@ class MF {
   }
 };
 
-/* Matrix factorization using gradient descent. */
+/* Matrix factorization using gradient descent.
+ * A full gradient is a sampled dense-dense product at the nonzeros
+ * (residuals) followed by two sparse x dense products, each of which
+ * runs in parallel over rows of the training matrix or of its
+ * transposed copy. Parameters are kept in one matrix P of
+ * ncluster x (users + items), users first, so that every product reads
+ * contiguous vectors and optimizers treat P as one vector.
+ * Loss: 1/2 sum (rate - u.v)^2 + lambda/2 |P|^2 */
 class MFGD : public MF {
+ private:
+  int optimizer_;               // Optimizer
+  std::vector<int> row_ptr_;    // compressed rows of the training matrix
+  std::vector<int> col_idx_;    // item of each rating
+  std::vector<float> values_;   // rate of each rating
+  std::vector<int> col_ptr_;    // compressed rows of the transposed copy
+  std::vector<int> row_idx_;    // user of each rating of the copy
+  std::vector<int> pos_;        // position of each rating of the copy
+
+  void build_index() {
+    int nrow = mtrain_.rows();
+    int ncol = mtrain_.cols();
+    row_ptr_.assign(nrow + 1, 0);
+    col_ptr_.assign(ncol + 1, 0);
+    col_idx_.clear();
+    values_.clear();
+    for (int j = 0; j < mtrain_.outerSize(); j++) {
+      for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
+        col_idx_.push_back(it.col());
+        values_.push_back(it.value());
+        row_ptr_[it.row() + 1]++;
+        col_ptr_[it.col() + 1]++;
+      }
+    }
+    for (int i = 0; i < nrow; i++) row_ptr_[i+1] += row_ptr_[i];
+    for (int i = 0; i < ncol; i++) col_ptr_[i+1] += col_ptr_[i];
+    std::vector<int> next(col_ptr_.begin(), col_ptr_.end() - 1);
+    row_idx_.resize(col_idx_.size());
+    pos_.resize(col_idx_.size());
+    for (int i = 0; i < nrow; i++) {
+      for (int k = row_ptr_[i]; k < row_ptr_[i+1]; k++) {
+        int n = next[col_idx_[k]]++;
+        row_idx_[n] = i;
+        pos_[n] = k;
+      }
+    }
+  }
+
+  int num_users() const {
+    return static_cast<int>(row_ptr_.size()) - 1;
+  }
+
+  int num_items() const {
+    return static_cast<int>(col_ptr_.size()) - 1;
+  }
+
+  static float dot(const float *x, const float *y, int n) {
+    float sum = 0.0;
+    for (int i = 0; i < n; i++) sum += x[i] * y[i];
+    return sum;
+  }
+
+  static void axpy(float a, const float *x, float *y, int n) {
+    for (int i = 0; i < n; i++) y[i] += a * x[i];
+  }
+
+  // inner product of two parameter matrices
+  static double inner(const Mat &x, const Mat &y) {
+    const float *p = x.data();
+    const float *q = y.data();
+    long n = static_cast<long>(x.rows()) * x.cols();
+    double sum = 0.0;
+    #pragma omp parallel for schedule(static) reduction(+:sum)
+    for (long i = 0; i < n; i++) sum += p[i] * q[i];
+    return sum;
+  }
+
+  // residuals at the nonzeros: rate - u.v (SDDMM)
+  double residuals(const Mat &P, std::vector<float> &r) {
+    int k = P.rows();
+    const float *u = P.data();
+    const float *v = u + static_cast<long>(num_users()) * k;
+    int nrow = num_users();
+    r.resize(values_.size());
+    double sum = 0.0;
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+:sum)
+    for (int i = 0; i < nrow; i++) {
+      for (int n = row_ptr_[i]; n < row_ptr_[i+1]; n++) {
+        r[n] = values_[n] - dot(u + static_cast<long>(i) * k,
+                                v + static_cast<long>(col_idx_[n]) * k, k);
+        sum += r[n] * r[n];
+      }
+    }
+    npass_++;
+    return sum;
+  }
+
+  double loss(const Mat &P, double lambda, std::vector<float> &r) {
+    return 0.5 * residuals(P, r) + 0.5 * lambda * inner(P, P);
+  }
+
+  // loss and its gradient G = lambda P - [R V, R^T U]
+  double gradient(const Mat &P, double lambda, std::vector<float> &r,
+                  Mat &G) {
+    double f = loss(P, lambda, r);
+    int k = P.rows();
+    int nrow = num_users();
+    int ncol = num_items();
+    const float *u = P.data();
+    const float *v = u + static_cast<long>(nrow) * k;
+    float *gu = G.data();
+    float *gv = gu + static_cast<long>(nrow) * k;
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < nrow; i++) {
+      float *g = gu + static_cast<long>(i) * k;
+      std::fill(g, g + k, 0.0f);
+      for (int n = row_ptr_[i]; n < row_ptr_[i+1]; n++) {
+        axpy(r[n], v + static_cast<long>(col_idx_[n]) * k, g, k);
+      }
+    }
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int j = 0; j < ncol; j++) {
+      float *g = gv + static_cast<long>(j) * k;
+      std::fill(g, g + k, 0.0f);
+      for (int n = col_ptr_[j]; n < col_ptr_[j+1]; n++) {
+        axpy(r[pos_[n]], u + static_cast<long>(row_idx_[n]) * k, g, k);
+      }
+    }
+    G = lambda * P - G;
+    return f;
+  }
+
+  // one fixed-size step: G_V = R^T U on the transposed copy, then
+  // G_U = R V and the user step in the same pass over users
+  void gradient_step(Mat &P, const std::vector<float> &r,
+                     double eta, double lambda, Mat &Gv) {
+    int k = P.rows();
+    int nrow = num_users();
+    int ncol = num_items();
+    float *u = P.data();
+    float *v = u + static_cast<long>(nrow) * k;
+    float *gv = Gv.data();
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int j = 0; j < ncol; j++) {
+      float *g = gv + static_cast<long>(j) * k;
+      std::fill(g, g + k, 0.0f);
+      for (int n = col_ptr_[j]; n < col_ptr_[j+1]; n++) {
+        axpy(r[pos_[n]], u + static_cast<long>(row_idx_[n]) * k, g, k);
+      }
+    }
+    #pragma omp parallel
+    {
+      std::vector<float> g(k);
+      #pragma omp for schedule(dynamic, 64)
+      for (int i = 0; i < nrow; i++) {
+        std::fill(g.begin(), g.end(), 0.0f);
+        for (int n = row_ptr_[i]; n < row_ptr_[i+1]; n++) {
+          axpy(r[n], v + static_cast<long>(col_idx_[n]) * k, &g[0], k);
+        }
+        float *ui = u + static_cast<long>(i) * k;
+        for (int c = 0; c < k; c++) ui[c] += eta * (g[c] - lambda * ui[c]);
+      }
+    }
+    #pragma omp parallel for schedule(static)
+    for (int j = 0; j < ncol; j++) {
+      float *vj = v + static_cast<long>(j) * k;
+      const float *g = gv + static_cast<long>(j) * k;
+      for (int c = 0; c < k; c++) vj[c] += eta * (g[c] - lambda * vj[c]);
+    }
+  }
+
+  double run_fixed(Mat &P, size_t niter, double eta, double lambda) {
+    Mat Gv(P.rows(), num_items());
+    std::vector<float> r;
+    for (size_t i = 0; i < niter; i++) {
+      residuals(P, r);
+      gradient_step(P, r, eta, lambda, Gv);
+    }
+    return loss(P, lambda, r);
+  }
+
+  // Nesterov momentum with a backtracking step (from eta, allowed to
+  // grow), restarting the momentum when the loss increases
+  double run_nesterov(Mat &P, size_t niter, double eta, double lambda) {
+    Mat prev = P;
+    Mat Y, G(P.rows(), P.cols()), next;
+    std::vector<float> r;
+    double f = loss(P, lambda, r);
+    double step = eta;
+    double t = 1.0;
+    for (size_t i = 0; i < niter; i++) {
+      double t_next = (1.0 + sqrt(1.0 + 4.0 * t * t)) / 2.0;
+      Y = P + ((t - 1.0) / t_next) * (P - prev);
+      double fy = gradient(Y, lambda, r, G);
+      double gg = inner(G, G);
+      double f_next;
+      step *= STEP_GROWTH;
+      for (;;) {
+        next = Y - step * G;
+        f_next = loss(next, lambda, r);
+        if (f_next <= fy - 0.5 * step * gg || step < MIN_STEP) break;
+        step *= 0.5;
+      }
+      prev = P;
+      P = next;
+      if (f_next > f) {
+        t_next = 1.0;
+        prev = P;
+      }
+      bool converged = f_next <= f && f - f_next < GD_TOLERANCE * f;
+      f = f_next;
+      t = t_next;
+      if (converged) break;
+    }
+    return f;
+  }
+
+  // limited-memory BFGS with a backtracking (Armijo) line search
+  double run_lbfgs(Mat &P, size_t niter, double eta, double lambda) {
+    std::vector<Mat> S, Yh;
+    std::vector<double> rho;
+    std::vector<double> alpha(LBFGS_HISTORY);
+    Mat G(P.rows(), P.cols()), G_next(P.rows(), P.cols()), D, next;
+    std::vector<float> r;
+    double f = gradient(P, lambda, r, G);
+    for (size_t i = 0; i < niter; i++) {
+      // two-loop recursion: D = -H G
+      D = G;
+      int m = S.size();
+      for (int j = m - 1; j >= 0; j--) {
+        alpha[j] = rho[j] * inner(S[j], D);
+        D -= alpha[j] * Yh[j];
+      }
+      D *= m > 0 ? inner(S[m-1], Yh[m-1]) / inner(Yh[m-1], Yh[m-1]) : eta;
+      for (int j = 0; j < m; j++) {
+        double beta = rho[j] * inner(Yh[j], D);
+        D += (alpha[j] - beta) * S[j];
+      }
+      D = -D;
+      double slope = inner(G, D);
+      if (slope >= 0) {
+        S.clear();
+        Yh.clear();
+        rho.clear();
+        D = -eta * G;
+        slope = inner(G, D);
+      }
+      double a = 1.0;
+      double f_next;
+      for (;;) {
+        next = P + a * D;
+        f_next = gradient(next, lambda, r, G_next);
+        if (f_next <= f + ARMIJO_SLOPE * a * slope || a < MIN_STEP) break;
+        a *= 0.5;
+      }
+      Mat s = next - P;
+      Mat y = G_next - G;
+      double sy = inner(s, y);
+      if (sy > 0) {
+        if (static_cast<int>(S.size()) == LBFGS_HISTORY) {
+          S.erase(S.begin());
+          Yh.erase(Yh.begin());
+          rho.erase(rho.begin());
+        }
+        S.push_back(s);
+        Yh.push_back(y);
+        rho.push_back(1.0 / sy);
+      }
+      bool converged = f - f_next < GD_TOLERANCE * f;
+      P = next;
+      G = G_next;
+      f = f_next;
+      if (converged) break;
+    }
+    return f;
+  }
+
  protected:
   double predict_rate(int user, int item) const {
     assert(user < U_.rows() && item < V_.cols());
@@ -139,26 +518,39 @@ class MFGD : public MF {
   }
 
  public:
-  MFGD() { }
+  MFGD(int optimizer = OPT_FIXED) : optimizer_(optimizer) { }
 
   void factorize(size_t ncluster, size_t niter, double eta, double lambda) {
     U_.resize(mtrain_.rows(), ncluster);
     V_.resize(ncluster, mtrain_.cols());
     set_random(U_);
     set_random(V_);
-    for (size_t i = 0; i < niter; i++) {
-      Mat Utmp = Mat::Zero(U_.rows(), U_.cols());
-      Mat Vtmp = Mat::Zero(V_.rows(), V_.cols());
-      for (int j = 0; j < mtrain_.outerSize(); j++) {
-        for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
-          double val = it.value() - predict_rate(it.row(), it.col());
-          Utmp.row(it.row()) += val * V_.col(it.col()).transpose();
-          Vtmp.col(it.col()) += val * U_.row(it.row()).transpose();
-        }
-      }
-      U_ += eta * (Utmp - lambda * U_);
-      V_ += eta * (Vtmp - lambda * V_);
+    build_index();
+    double start = clock_seconds();
+    int nrow = num_users();
+    int ncol = num_items();
+    Mat P(ncluster, nrow + ncol);
+    P.block(0, 0, ncluster, nrow) = U_.transpose();
+    P.block(0, nrow, ncluster, ncol) = V_;
+    npass_ = 0;
+    double f;
+    const char *name;
+    if (optimizer_ == OPT_NESTEROV) {
+      name = "Nesterov";
+      f = run_nesterov(P, niter, eta, lambda);
+    } else if (optimizer_ == OPT_LBFGS) {
+      name = "L-BFGS";
+      f = run_lbfgs(P, niter, eta, lambda);
+    } else {
+      name = "Gradient descent";
+      f = run_fixed(P, niter, eta, lambda);
     }
+    U_ = P.block(0, 0, ncluster, nrow).transpose();
+    V_ = P.block(0, nrow, ncluster, ncol);
+    double elapsed = clock_seconds() - start;
+    fprintf(stderr, "%s: %ld passes in %.3f sec (%.0f ratings/sec), "
+            "loss=%.1f\n", name, static_cast<long>(npass_), elapsed,
+            values_.size() * npass_ / (elapsed > 0 ? elapsed : 1e-9), f);
   }
 };
 
@@ -180,6 +572,7 @@ class MFSGD : public MF {
     V_.resize(ncluster, mtrain_.cols());
     set_random(U_);
     set_random(V_);
+    npass_ = niter;
     for (size_t i = 0; i < niter; i++) {
       for (int j = 0; j < mtrain_.outerSize(); j++) {
         for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
@@ -297,6 +690,7 @@ class MFSGDBiasOptimize : public MFSGD {
     set_random(U_);
     set_random(V_);
     set_random_biases();
+    npass_ = niter;
     for (size_t i = 0; i < niter; i++) {
       for (int j = 0; j < mtrain_.outerSize(); j++) {
         for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
@@ -318,39 +712,66 @@ class MFSGDBiasOptimize : public MFSGD {
   }
 };
 
-void cross_validation(const char *dir, size_t ncluster,
-                      size_t niter, double eta, double lambda) {
+// optimizer < 0: stochastic gradient descent with biases,
+// otherwise full-batch gradient descent with the Optimizer
+void cross_validation(const char *dir, size_t ncluster, size_t niter,
+                      double eta, double lambda, int optimizer) {
   size_t ntest = 5;
   double sum = 0.0;
+  size_t npass = 0;
+  double elapsed = 0.0;
   for (size_t i = 1; i <= ntest; i++) {
     char trainfn[128], testfn[128];
     sprintf(trainfn, "%s/u%ld.base", dir, i);
     sprintf(testfn, "%s/u%ld.test", dir, i);
     printf("Training data: %s\n", trainfn);
     printf("Test data:     %s\n", testfn);
-    //MFGD mf;
-    //MFSGD mf;
-    //MFSGDBiasFixed mf;
-    MFSGDBiasOptimize mf;
-    mf.train(trainfn);
+    MF *mf;
+    if (optimizer >= 0) {
+      mf = new MFGD(optimizer);
+    } else {
+      //mf = new MFSGD;
+      //mf = new MFSGDBiasFixed;
+      mf = new MFSGDBiasOptimize;
+    }
+    mf->train(trainfn);
 
     printf("Factorizing input matrix ...\n");
-    mf.factorize(ncluster, niter, eta, lambda);
-    double rmse = mf.test(testfn);
+    double start = clock_seconds();
+    mf->factorize(ncluster, niter, eta, lambda);
+    elapsed += clock_seconds() - start;
+    npass += mf->num_passes();
+    double rmse = mf->test(testfn);
     printf("RMSE=%0.3f\n\n", rmse);
     sum += rmse;
+    delete mf;
   }
-  printf("Result of cross validation: RMSE=%.3f\n", sum / ntest);
+  printf("Result of cross validation: RMSE=%.3f (%ld passes, %.3f sec)\n",
+         sum / ntest, static_cast<long>(npass), elapsed);
 }
 
 int main(int argc, char **argv) {
-  if (argc != 6) {
-    fprintf(stderr, "Usage: %s dir ncluster niter eta lambda\n",
-            argv[0]);
+  if (argc != 6 && argc != 7) {
+    fprintf(stderr, "Usage: %s dir ncluster niter eta lambda "
+            "[gd|nesterov|lbfgs]\n", argv[0]);
     exit(1);
   }
+  int optimizer = -1;
+  if (argc == 7) {
+    std::string name(argv[6]);
+    if (name == "gd") {
+      optimizer = OPT_FIXED;
+    } else if (name == "nesterov") {
+      optimizer = OPT_NESTEROV;
+    } else if (name == "lbfgs") {
+      optimizer = OPT_LBFGS;
+    } else {
+      fprintf(stderr, "unknown optimizer: %s\n", argv[6]);
+      exit(1);
+    }
+  }
   srand(time(NULL));
   cross_validation(argv[1], atoi(argv[2]), atoi(argv[3]),
-                   atof(argv[4]), atof(argv[5]));
+                   atof(argv[4]), atof(argv[5]), optimizer);
   return 0;
 }
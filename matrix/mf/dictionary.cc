@@ -0,0 +1,157 @@
+//
+// Dictionary of external user and item IDs
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include "dictionary.h"
+
+namespace mf {
+
+/* constants */
+const size_t DICTIONARY_MIN_SLOTS = 16;  ///< initial size of hash tables
+
+/**
+ * Get the hash value of an ID (FNV-1a).
+ */
+uint64_t IdDictionary::hash(const char *p, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= static_cast<unsigned char>(p[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/**
+ * Find the slot of an ID with linear probing.
+ */
+size_t IdDictionary::find_slot(const char *p, size_t len) const {
+  size_t mask = table_.size() - 1;
+  size_t slot = hash(p, len) & mask;
+  while (table_[slot] >= 0) {
+    int index = table_[slot];
+    size_t begin = offsets_[index];
+    if (offsets_[index+1] - begin == len
+        && memcmp(chars_.data() + begin, p, len) == 0) {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/**
+ * Rebuild the hash table.
+ */
+void IdDictionary::rehash(size_t nslot) {
+  table_.assign(nslot, -1);
+  for (int i = 1; i < size(); i++) {
+    table_[find_slot(chars_.data() + offsets_[i],
+                     offsets_[i+1] - offsets_[i])] = i;
+  }
+}
+
+/**
+ * Remove all IDs.
+ */
+void IdDictionary::clear() {
+  chars_.clear();
+  offsets_.assign(2, 0);
+  table_.assign(DICTIONARY_MIN_SLOTS, -1);
+}
+
+/**
+ * Get the index of an ID, adding it if it is new.
+ * The hash table is kept at most half full.
+ */
+int IdDictionary::add(const char *p, size_t len) {
+  size_t slot = find_slot(p, len);
+  if (table_[slot] >= 0) return table_[slot];
+  int index = size();
+  chars_.append(p, len);
+  offsets_.push_back(chars_.size());
+  table_[slot] = index;
+  if (static_cast<size_t>(index) * 2 > table_.size()) {
+    rehash(table_.size() * 2);
+  }
+  return index;
+}
+
+/**
+ * Get the index of an ID.
+ */
+int IdDictionary::find(const char *p, size_t len) const {
+  return table_[find_slot(p, len)];
+}
+
+/**
+ * Write the dictionary: the number of IDs, the size of the buffer,
+ * offsets and the buffer.
+ */
+void IdDictionary::write(FILE *fp) const {
+  uint64_t dims[2] = { offsets_.size(), chars_.size() };
+  if (fwrite(dims, sizeof(dims), 1, fp) != 1
+      || fwrite(&offsets_[0], sizeof(uint64_t), offsets_.size(), fp)
+         != offsets_.size()
+      || fwrite(chars_.data(), 1, chars_.size(), fp) != chars_.size()) {
+    fprintf(stderr, "[Error] cannot write a model file\n");
+    exit(1);
+  }
+}
+
+/**
+ * Read the dictionary and rebuild the hash table.
+ */
+const char *IdDictionary::read(const char *p, const char *end) {
+  uint64_t dims[2];
+  if (static_cast<size_t>(end - p) < sizeof(dims)) {
+    fprintf(stderr, "[Error] broken model file\n");
+    exit(1);
+  }
+  memcpy(dims, p, sizeof(dims));
+  p += sizeof(dims);
+  if (dims[0] < 2 || static_cast<size_t>(end - p) / sizeof(uint64_t) < dims[0]
+      || static_cast<size_t>(end - p) - dims[0] * sizeof(uint64_t)
+         < dims[1]) {
+    fprintf(stderr, "[Error] broken model file\n");
+    exit(1);
+  }
+  offsets_.resize(dims[0]);
+  memcpy(&offsets_[0], p, sizeof(uint64_t) * dims[0]);
+  p += sizeof(uint64_t) * dims[0];
+  chars_.assign(p, dims[1]);
+  p += dims[1];
+  // offsets index chars_ in rehash(), find_slot() and id()
+  bool valid = offsets_[0] == 0 && offsets_.back() == dims[1]
+    && dims[0] - 1 <= INT_MAX;
+  for (size_t i = 1; valid && i < offsets_.size(); i++) {
+    valid = offsets_[i-1] <= offsets_[i];
+  }
+  if (!valid) {
+    fprintf(stderr, "[Error] broken model file\n");
+    exit(1);
+  }
+  size_t nslot = DICTIONARY_MIN_SLOTS;
+  while (nslot < offsets_.size() * 2) nslot *= 2;
+  rehash(nslot);
+  return p;
+}
+
+} /* namespace mf */
@@ -0,0 +1,142 @@
+//
+// Dictionary of external user and item IDs
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef MF_DICTIONARY_H_
+#define MF_DICTIONARY_H_
+
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace mf {
+
+/**
+ * Dictionary which maps external IDs (any strings without tabs and
+ * newlines, such as 64-bit hashes) to dense indexes from 1 in the
+ * order of addition. Index 0 is a dummy as in the rating files.
+ * IDs are stored in one buffer and indexed by an open addressing hash
+ * table, so memory is proportional to the IDs actually added.
+ */
+class IdDictionary {
+ private:
+  std::string chars_;               ///< concatenated IDs
+  std::vector<uint64_t> offsets_;   ///< beginning of IDs (+ end)
+  std::vector<int> table_;          ///< hash table of indexes (-1: empty)
+
+  /**
+   * Get the hash value of an ID.
+   * @param p ID
+   * @param len length of the ID
+   * @return hash value
+   */
+  static uint64_t hash(const char *p, size_t len);
+
+  /**
+   * Find the slot of an ID in the hash table.
+   * @param p ID
+   * @param len length of the ID
+   * @return the slot which holds the ID or an empty slot
+   */
+  size_t find_slot(const char *p, size_t len) const;
+
+  /**
+   * Rebuild the hash table with a number of slots.
+   * @param nslot the number of slots (power of 2)
+   */
+  void rehash(size_t nslot);
+
+ public:
+  /**
+   * Constructor.
+   */
+  IdDictionary() {
+    clear();
+  }
+
+  /**
+   * Destructor.
+   */
+  ~IdDictionary() { }
+
+  /**
+   * Remove all IDs.
+   */
+  void clear();
+
+  /**
+   * Get the index of an ID, adding it if it is new.
+   * @param p ID
+   * @param len length of the ID
+   * @return index
+   */
+  int add(const char *p, size_t len);
+
+  /**
+   * Get the index of an ID.
+   * @param p ID
+   * @param len length of the ID
+   * @return index (-1 if the ID is unknown)
+   */
+  int find(const char *p, size_t len) const;
+
+  /**
+   * Get the index of an ID.
+   * @param id ID
+   * @return index (-1 if the ID is unknown)
+   */
+  int find(const std::string &id) const {
+    return find(id.data(), id.size());
+  }
+
+  /**
+   * Get the ID of an index.
+   * @param index index (from 1)
+   * @return ID
+   */
+  std::string id(int index) const {
+    return chars_.substr(offsets_[index], offsets_[index+1] - offsets_[index]);
+  }
+
+  /**
+   * Get the number of indexes (IDs + the dummy index 0).
+   * @return the number of indexes
+   */
+  int size() const {
+    return offsets_.size() - 1;
+  }
+
+  /**
+   * Write the dictionary to a model file.
+   * @param fp output file
+   */
+  void write(FILE *fp) const;
+
+  /**
+   * Read the dictionary from a mapped model file.
+   * @param p current position
+   * @param end end of the file
+   * @return position after the dictionary
+   */
+  const char *read(const char *p, const char *end);
+};
+
+} /* namespace mf */
+
+#endif  // MF_DICTIONARY_H_
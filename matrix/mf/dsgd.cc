@@ -0,0 +1,179 @@
+//
+// Distributed stochastic gradient descent (DSGD)
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include "dsgd.h"
+
+namespace mf {
+
+/* commands sent from the master process to workers */
+enum {
+  COMMAND_TRAIN  = 1,  ///< train a block
+  COMMAND_FINISH = 2   ///< send the user block and exit
+};
+
+/**
+ * Command message.
+ */
+struct Command {
+  int type;    ///< command type
+  int block;   ///< item block index
+  double eta;  ///< learning rate
+};
+
+/**
+ * Set boundaries of user blocks and item blocks.
+ */
+void MatrixFactorizerDsgd::set_block_bounds() {
+  size_t N = mtrain_.nonZeros();
+  const int *outer = mtrain_.outerIndexPtr();
+  row_bounds_.assign(nworker_ + 1, 0);
+  col_bounds_.assign(nworker_ + 1, 0);
+  for (size_t i = 1; i < nworker_; i++) {
+    size_t target = N * i / nworker_;
+    row_bounds_[i] = std::lower_bound(outer, outer + mtrain_.rows(),
+                                      static_cast<int>(target)) - outer;
+    if (row_bounds_[i] < row_bounds_[i-1]) row_bounds_[i] = row_bounds_[i-1];
+    col_bounds_[i] = mtrain_.cols() * i / nworker_;
+  }
+  row_bounds_[nworker_] = mtrain_.rows();
+  col_bounds_[nworker_] = mtrain_.cols();
+}
+
+/**
+ * Train a block with stochastic gradient descent.
+ */
+void MatrixFactorizerDsgd::train_block(size_t user_block, size_t item_block,
+                                       double eta, double lambda) {
+  const int *outer = mtrain_.outerIndexPtr();
+  const int *inner = mtrain_.innerIndexPtr();
+  const int *values = mtrain_.valuePtr();
+  int col_begin = col_bounds_[item_block];
+  int col_end = col_bounds_[item_block+1];
+  UserState state;
+  for (int i = row_bounds_[user_block]; i < row_bounds_[user_block+1]; i++) {
+    const int *p = std::lower_bound(inner + outer[i], inner + outer[i+1],
+                                    col_begin);
+    begin_user(i, state);
+    for (; p != inner + outer[i+1] && *p < col_end; ++p) {
+      update_factors(i, *p, values[p - inner], eta, eta, lambda, state);
+    }
+    end_user(i, state);
+  }
+}
+
+/**
+ * Main loop of a worker process.
+ */
+void MatrixFactorizerDsgd::run_worker(size_t worker, int fd, double lambda) {
+  Command command;
+  while (true) {
+    read_all(fd, &command, sizeof(command));
+    if (command.type == COMMAND_TRAIN) {
+      int col_begin = col_bounds_[command.block];
+      int col_end = col_bounds_[command.block+1];
+      size_t size = sizeof(float) * V_.rows() * (col_end - col_begin);
+      read_all(fd, V_.data() + V_.rows() * col_begin, size);
+      train_block(worker, command.block, command.eta, lambda);
+      write_all(fd, V_.data() + V_.rows() * col_begin, size);
+    } else {
+      Mat block = U_.middleRows(row_bounds_[worker],
+                                row_bounds_[worker+1] - row_bounds_[worker]);
+      write_all(fd, block.data(), sizeof(float) * block.size());
+      return;
+    }
+  }
+}
+
+/**
+ * Factorize a training matrix.
+ */
+void MatrixFactorizerDsgd::factorize(size_t ncluster, size_t niter,
+                                     double eta, double lambda) {
+  U_.resize(mtrain_.rows(), ncluster);
+  V_.resize(ncluster, mtrain_.cols());
+  set_matrix_random(U_);
+  set_matrix_random(V_);
+  set_block_bounds();
+
+  std::vector<int> fds(nworker_);
+  std::vector<pid_t> pids(nworker_);
+  for (size_t w = 0; w < nworker_; w++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+      fprintf(stderr, "[Error] cannot create socket: %s\n", strerror(errno));
+      exit(1);
+    }
+    pids[w] = fork();
+    if (pids[w] < 0) {
+      fprintf(stderr, "[Error] cannot fork: %s\n", strerror(errno));
+      exit(1);
+    } else if (pids[w] == 0) {
+      close(sv[0]);
+      for (size_t i = 0; i < w; i++) close(fds[i]);
+      run_worker(w, sv[1], lambda);
+      close(sv[1]);
+      _exit(0);
+    }
+    close(sv[1]);
+    fds[w] = sv[0];
+  }
+
+  Command command;
+  for (size_t i = 0; i < niter; i++) {
+    for (size_t s = 0; s < nworker_; s++) {
+      command.type = COMMAND_TRAIN;
+      command.eta = eta / (1 + i + static_cast<double>(s) / nworker_);
+      for (size_t w = 0; w < nworker_; w++) {
+        command.block = (w + s) % nworker_;
+        int col_begin = col_bounds_[command.block];
+        int col_end = col_bounds_[command.block+1];
+        write_all(fds[w], &command, sizeof(command));
+        write_all(fds[w], V_.data() + V_.rows() * col_begin,
+                  sizeof(float) * V_.rows() * (col_end - col_begin));
+      }
+      for (size_t w = 0; w < nworker_; w++) {
+        int block = (w + s) % nworker_;
+        int col_begin = col_bounds_[block];
+        int col_end = col_bounds_[block+1];
+        read_all(fds[w], V_.data() + V_.rows() * col_begin,
+                 sizeof(float) * V_.rows() * (col_end - col_begin));
+      }
+    }
+  }
+
+  command.type = COMMAND_FINISH;
+  for (size_t w = 0; w < nworker_; w++) {
+    write_all(fds[w], &command, sizeof(command));
+    Mat block(row_bounds_[w+1] - row_bounds_[w], U_.cols());
+    read_all(fds[w], block.data(), sizeof(float) * block.size());
+    U_.middleRows(row_bounds_[w], block.rows()) = block;
+    close(fds[w]);
+    int status;
+    waitpid(pids[w], &status, 0);
+  }
+}
+
+} /* namespace mf */
@@ -0,0 +1,96 @@
+//
+// Distributed stochastic gradient descent (DSGD)
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef MF_DSGD_H_
+#define MF_DSGD_H_
+
+#include <vector>
+#include "factorizer.h"
+
+namespace mf {
+
+/**
+ * Matrix factorization using distributed stochastic gradient descent.
+ * The training matrix is split into nworker x nworker blocks of
+ * users and items. In each sub-epoch every worker process trains one
+ * block of a stratum, in which no two blocks share users or items,
+ * and item blocks are passed through Unix domain sockets.
+ */
+class MatrixFactorizerDsgd : public MatrixFactorizerSgd {
+ private:
+  size_t nworker_;                 ///< the number of worker processes
+  std::vector<int> row_bounds_;    ///< boundaries of user blocks
+  std::vector<int> col_bounds_;    ///< boundaries of item blocks
+
+  /**
+   * Set boundaries of user blocks and item blocks.
+   * User blocks have almost the same number of ratings.
+   */
+  void set_block_bounds();
+
+  /**
+   * Train a block with stochastic gradient descent.
+   * @param user_block user block index
+   * @param item_block item block index
+   * @param eta learning rate
+   * @param lambda a tuning parameter
+   */
+  void train_block(size_t user_block, size_t item_block,
+                   double eta, double lambda);
+
+  /**
+   * Main loop of a worker process.
+   * @param worker worker index
+   * @param fd socket connected to the master process
+   * @param lambda a tuning parameter
+   */
+  void run_worker(size_t worker, int fd, double lambda);
+
+ public:
+  /**
+   * Constructor.
+   */
+  MatrixFactorizerDsgd() : nworker_(1) { }
+
+  /**
+   * Destructor.
+   */
+  ~MatrixFactorizerDsgd() { }
+
+  /**
+   * Set the number of worker processes.
+   * @param nworker the number of worker processes
+   */
+  void set_num_workers(size_t nworker) {
+    nworker_ = nworker > 0 ? nworker : 1;
+  }
+
+  /**
+   * Factorize a training matrix.
+   * @param ncluster the number of clusters
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  void factorize(size_t ncluster, size_t niter, double eta, double lambda);
+};
+
+} /* namespace mf */
+
+#endif  // MF_DSGD_H_
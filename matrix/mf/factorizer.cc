@@ -21,6 +21,51 @@
 
 namespace mf {
 
-/* no implementation yet */
+/**
+ * Create a factorizer of a model type.
+ */
+MatrixFactorizer *create_factorizer(int type) {
+  switch (type) {
+    case MODEL_SGD:
+      return new MatrixFactorizerSgd;
+    case MODEL_SGD_BIAS:
+      return new MatrixFactorizerSgdBias;
+    case MODEL_SVDPP:
+      return new MatrixFactorizerSvdpp;
+    case MODEL_ALS:
+      return new MatrixFactorizerAls;
+    case MODEL_IMPLICIT:
+      return new MatrixFactorizerImplicitAls;
+    default:
+      return NULL;
+  }
+}
+
+/**
+ * Load a model of any type from a binary file.
+ */
+MatrixFactorizer *load_factorizer(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  char magic[4];
+  uint32_t header[2];
+  if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+      || memcmp(magic, MODEL_FILE_MAGIC, sizeof(magic)) != 0
+      || fread(header, sizeof(uint32_t), 2, fp) != 2) {
+    fprintf(stderr, "[Error] invalid model file: %s\n", filename);
+    exit(1);
+  }
+  fclose(fp);
+  MatrixFactorizer *mf = create_factorizer(header[1]);
+  if (mf == NULL) {
+    fprintf(stderr, "[Error] unknown model type: %u\n", header[1]);
+    exit(1);
+  }
+  mf->load_model(filename);
+  return mf;
+}
 
 } /* namespace mf */
@@ -20,23 +20,106 @@
 #ifndef MF_FACTORIZER_H_
 #define MF_FACTORIZER_H_
 
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <climits>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
-#include <fstream>
+#include <cstring>
 #include <iostream>
-#include <queue>
-#include <tr1/unordered_map>
+#include <string>
 #include <vector>
+#include <Eigen/Cholesky>
 #include <Eigen/Core>
 #include <Eigen/Sparse>
+#include "rating.h"
+#include "sgd_kernel.h"
 #include "util.h"
 
 namespace mf {
 
 /* typedef */
 typedef Eigen::MatrixXf Mat;
-typedef Eigen::SparseMatrix<int, Eigen::RowMajor> SMat;
+typedef std::vector<std::pair<int, double> > ItemList;
+
+/* model types */
+enum ModelType {
+  MODEL_SGD      = 1,  ///< MatrixFactorizerSgd
+  MODEL_SGD_BIAS = 2,  ///< MatrixFactorizerSgdBias
+  MODEL_SVDPP    = 3,  ///< MatrixFactorizerSvdpp
+  MODEL_ALS      = 4,  ///< MatrixFactorizerAls
+  MODEL_IMPLICIT = 5   ///< MatrixFactorizerImplicitAls
+};
+
+/* training orders of stochastic gradient descent */
+enum TrainingOrder {
+  ORDER_ROW     = 0,  ///< users in row order, ratings in column order
+  ORDER_SHUFFLE = 1   ///< shuffled in each epoch within cache-sized tiles
+};
+
+/* learning rates of stochastic gradient descent */
+enum LearningRate {
+  RATE_DECAY   = 0,  ///< eta / (1 + count / N) for all parameters
+  RATE_ADAGRAD = 1,  ///< eta / sqrt(sum of squared gradients) of each row
+  RATE_RMSPROP = 2   ///< eta / sqrt(moving average of squared gradients)
+};
+
+/* constants */
+const char MODEL_FILE_MAGIC[4] = {'M', 'F', 'M', 'D'};  ///< magic number
+const char MODEL_IDS_MAGIC[4] = {'M', 'F', 'I', 'D'};   ///< magic of IDs
+const uint32_t MODEL_FILE_VERSION = 1;                  ///< format version
+const int TOPN_USER_BLOCK = 64;    ///< users scored at once in top-N
+const int TOPN_ITEM_BLOCK = 4096;  ///< items scored at once in top-N
+const int RECOMMEND_USER_BLOCK = 1024;  ///< users written at once
+const size_t SGD_TILE_BYTES = 512 * 1024;  ///< user factors in a tile
+const double RMSPROP_DECAY = 0.99;    ///< decay of squared gradients
+const double STOP_TOLERANCE = 1e-4;   ///< minimum improvement of RMSE
+
+/**
+ * Push an item to a heap which keeps top n items.
+ * The first element of the heap is the item of the lowest rate.
+ * @param heap heap of items
+ * @param num the maximum number of items
+ * @param item pair of an item index and a rate
+ */
+inline void push_top_item(ItemList &heap, size_t num,
+                          const std::pair<int, double> &item) {
+  if (heap.size() < num) {
+    heap.push_back(item);
+    std::push_heap(heap.begin(), heap.end(), greater_pair<int, double>);
+  } else if (num > 0 && greater_pair(item, heap.front())) {
+    std::pop_heap(heap.begin(), heap.end(), greater_pair<int, double>);
+    heap.back() = item;
+    std::push_heap(heap.begin(), heap.end(), greater_pair<int, double>);
+  }
+}
+
+/**
+ * Observer of epochs with validation RMSE (see set_epoch_observer()).
+ * (virtual class)
+ */
+class EpochObserver {
+ public:
+  /**
+   * Destructor.
+   */
+  virtual ~EpochObserver() { }
+
+  /**
+   * Receive the RMSE of an epoch.
+   * @param epoch the number of epochs run
+   * @param train_rmse training RMSE
+   * @param valid_rmse validation RMSE
+   * @return false if training should stop
+   */
+  virtual bool end_epoch(size_t epoch, double train_rmse,
+                         double valid_rmse) = 0;
+};
 
 /**
  * Matrix factorizer interfaces
@@ -44,26 +127,22 @@ typedef Eigen::SparseMatrix<int, Eigen::RowMajor> SMat;
  */
 class MatrixFactorizer {
  private:
-  template<typename KeyType, typename ValueType>
-  struct GreaterPair {
-    bool operator() (const std::pair<KeyType, ValueType> a,
-                     const std::pair<KeyType, ValueType> b) {
-      return a.second < b.second;
-    }
-  };
-
   /**
    * Save a matrix to a file.
+   * With ID mapping, each row from 1 starts with its external ID.
    * @param filename output file name
-   * @return return true if succeeded
+   * @param mat matrix (one vector in each row)
+   * @param ids dictionary of rows
    */
-  void save_matrix(const char *filename, const Mat &mat) const {
+  void save_matrix(const char *filename, const Mat &mat,
+                   const IdDictionary &ids) const {
     FILE *fp = fopen(filename, "w");
     if (fp == NULL) {
       fprintf(stderr, "[Error] cannot open %s\n", filename);
       exit(1);
     }
-    for (int i = 0; i < mat.rows(); i++) {
+    for (int i = map_ids_ ? 1 : 0; i < mat.rows(); i++) {
+      if (map_ids_) fprintf(fp, "%s\t", ids.id(i).c_str());
       for (int j = 0; j < mat.cols(); j++) {
         if (j != 0) fprintf(fp, "\t");
         fprintf(fp, "%.2f", mat(i, j));
@@ -73,46 +152,297 @@ class MatrixFactorizer {
     fclose(fp);
   }
 
+  /**
+   * Get the index of an external ID.
+   * @param ids dictionary of users or items
+   * @param id external ID (a numeric index without ID mapping)
+   * @param size the number of users or items
+   * @return index (-1 if unknown)
+   */
+  int lookup_index(const IdDictionary &ids, const std::string &id,
+                   int size) const {
+    if (map_ids_) return ids.find(id);
+    size_t index;
+    const char *end = id.data() + id.size();
+    if (id.empty() || parse_uint(id.data(), end, index) != end
+        || index >= static_cast<size_t>(size)) {
+      return -1;
+    }
+    return index;
+  }
+
+  /**
+   * Convert an index into a string.
+   * @param index index
+   * @return decimal string
+   */
+  static std::string index_string(int index) {
+    char str[16];
+    sprintf(str, "%d", index);
+    return str;
+  }
+
+  /**
+   * Write a user or an item: its external ID with ID mapping, or its
+   * index otherwise.
+   * @param fp output file
+   * @param ids dictionary of users or items
+   * @param index index
+   */
+  void write_id(FILE *fp, const IdDictionary &ids, int index) const {
+    if (map_ids_) {
+      fputs(ids.id(index).c_str(), fp);
+    } else {
+      fprintf(fp, "%d", index);
+    }
+  }
+
+  /**
+   * Functor to keep ratings of users and items in the training matrix.
+   */
+  struct InTraining {
+    Eigen::Index rows;  ///< the number of users
+    Eigen::Index cols;  ///< the number of items
+    InTraining(Eigen::Index r, Eigen::Index c) : rows(r), cols(c) { }
+    bool operator() (const Eigen::Index &row, const Eigen::Index &col,
+                     const int &) const {
+      return row < rows && col < cols;
+    }
+  };
+
+  /**
+   * Header of a model file.
+   * The header is followed by the sections written by write_model(),
+   * and by MODEL_IDS_MAGIC and the dictionaries of users and items if
+   * IDs are mapped.
+   */
+  struct ModelFileHeader {
+    char magic[4];     ///< MODEL_FILE_MAGIC
+    uint32_t version;  ///< MODEL_FILE_VERSION
+    uint32_t type;     ///< ModelType
+    uint32_t reserved; ///< reserved (0)
+  };
+
  protected:
-  SMat mtrain_;  ///< training matrix
-  Mat U_;        ///< user matrix
-  Mat V_;        ///< item matrix
+  SMat mtrain_;    ///< training matrix
+  Mat U_;          ///< user matrix
+  Mat V_;          ///< item matrix
+  size_t nthread_; ///< the number of threads
+  int frozen_items_; ///< items of smaller indexes are not updated by SGD
+  int order_;              ///< TrainingOrder
+  bool log_epochs_;        ///< report each epoch if true
+  double target_rmse_;     ///< target of training RMSE (0 if none)
+  size_t target_epoch_;    ///< the first epoch reaching the target (0 if not)
+  int rate_;                        ///< LearningRate
+  std::vector<float> user_gradients_;  ///< squared gradients of users
+  std::vector<float> item_gradients_;  ///< squared gradients of items
+  SMat mvalid_;            ///< validation matrix
+  size_t patience_;        ///< epochs without improvement before stopping
+  size_t nepoch_;          ///< the number of epochs run
+  size_t best_epoch_;      ///< the epoch of the best validation RMSE
+  double best_rmse_;       ///< the best validation RMSE
+  EpochObserver *observer_;  ///< receiver of epochs (NULL if none)
+  bool map_ids_;           ///< map external IDs to indexes if true
+  IdDictionary user_ids_;  ///< dictionary of user IDs
+  IdDictionary item_ids_;  ///< dictionary of item IDs
 
   /**
-   * Read matrix data from a text file.
-   * @param filename a text file
+   * Read matrix data from a text file or a binary rating file.
+   * With ID mapping, ratings of unknown users and items are skipped.
+   * @param filename input file
    * @param mat output matrix
    */
   void read_file(const char *filename, SMat &mat) const {
-    std::ifstream ifs(filename);
-    if (!ifs) {
-      fprintf(stderr, "cannot open %s\n", filename);
+    if (map_ids_) {
+      read_known_rating_file(filename, user_ids_, item_ids_, mat);
+    } else {
+      read_rating_file(filename, mat);
+    }
+  }
+
+  /**
+   * Read training data from a text file or a binary rating file.
+   * With ID mapping, new users and items are added to the dictionaries.
+   * @param filename input file
+   * @param mat output matrix
+   */
+  void read_training_file(const char *filename, SMat &mat) {
+    if (map_ids_) {
+      read_mapped_rating_file(filename, user_ids_, item_ids_, mat);
+    } else {
+      read_rating_file(filename, mat);
+    }
+  }
+
+  /**
+   * Write data to a model file.
+   * @param fp output file
+   * @param data data
+   * @param size data size in bytes
+   */
+  static void write_data(FILE *fp, const void *data, size_t size) {
+    if (size > 0 && fwrite(data, 1, size, fp) != size) {
+      fprintf(stderr, "[Error] cannot write a model file\n");
+      exit(1);
+    }
+  }
+
+  /**
+   * Read data from a mapped model file.
+   * @param p current position
+   * @param end end of the file
+   * @param data output buffer
+   * @param size data size in bytes
+   * @return position after the data
+   */
+  static const char *read_data(const char *p, const char *end,
+                               void *data, size_t size) {
+    if (static_cast<size_t>(end - p) < size) {
+      fprintf(stderr, "[Error] broken model file\n");
+      exit(1);
+    }
+    memcpy(data, p, size);
+    return p + size;
+  }
+
+  /**
+   * Write a dense matrix to a model file.
+   * @param fp output file
+   * @param mat matrix
+   */
+  static void write_matrix(FILE *fp, const Mat &mat) {
+    uint64_t dims[2] = { static_cast<uint64_t>(mat.rows()),
+                         static_cast<uint64_t>(mat.cols()) };
+    write_data(fp, dims, sizeof(dims));
+    write_data(fp, mat.data(), sizeof(float) * mat.size());
+  }
+
+  /**
+   * Read a dense matrix from a mapped model file.
+   * @param p current position
+   * @param end end of the file
+   * @param mat output matrix
+   * @return position after the matrix
+   */
+  static const char *read_matrix(const char *p, const char *end, Mat &mat) {
+    uint64_t dims[2];
+    p = read_data(p, end, dims, sizeof(dims));
+    uint64_t avail = static_cast<size_t>(end - p) / sizeof(float);
+    if (dims[0] > INT_MAX || dims[1] > INT_MAX
+        || (dims[1] > 0 && dims[0] > avail / dims[1])) {
+      fprintf(stderr, "[Error] broken model file\n");
+      exit(1);
+    }
+    mat.resize(dims[0], dims[1]);
+    return read_data(p, end, mat.data(), sizeof(float) * mat.size());
+  }
+
+  /**
+   * Write a vector to a model file.
+   * @param fp output file
+   * @param vec vector
+   */
+  static void write_vector(FILE *fp, const std::vector<double> &vec) {
+    uint64_t size = vec.size();
+    write_data(fp, &size, sizeof(size));
+    if (size > 0) write_data(fp, &vec[0], sizeof(double) * size);
+  }
+
+  /**
+   * Read a vector from a mapped model file.
+   * @param p current position
+   * @param end end of the file
+   * @param vec output vector
+   * @return position after the vector
+   */
+  static const char *read_vector(const char *p, const char *end,
+                                 std::vector<double> &vec) {
+    uint64_t size;
+    p = read_data(p, end, &size, sizeof(size));
+    if (size > static_cast<size_t>(end - p) / sizeof(double)) {
+      fprintf(stderr, "[Error] broken model file\n");
+      exit(1);
+    }
+    vec.resize(size);
+    if (size == 0) return p;
+    return read_data(p, end, &vec[0], sizeof(double) * size);
+  }
+
+  /**
+   * Write a sparse matrix to a model file.
+   * @param fp output file
+   * @param mat compressed sparse matrix
+   */
+  static void write_sparse_matrix(FILE *fp, const SMat &mat) {
+    uint64_t dims[3] = { static_cast<uint64_t>(mat.rows()),
+                         static_cast<uint64_t>(mat.cols()),
+                         static_cast<uint64_t>(mat.nonZeros()) };
+    write_data(fp, dims, sizeof(dims));
+    write_data(fp, mat.outerIndexPtr(), sizeof(int) * (dims[0] + 1));
+    write_data(fp, mat.innerIndexPtr(), sizeof(int) * dims[2]);
+    write_data(fp, mat.valuePtr(), sizeof(int) * dims[2]);
+  }
+
+  /**
+   * Read a sparse matrix from a mapped model file.
+   * The compressed rows are checked as those of binary rating files,
+   * since they are used as indexes of the factors.
+   * @param p current position
+   * @param end end of the file
+   * @param mat output matrix
+   * @return position after the matrix
+   */
+  static const char *read_sparse_matrix(const char *p, const char *end,
+                                        SMat &mat) {
+    uint64_t dims[3];
+    p = read_data(p, end, dims, sizeof(dims));
+    // with counts of int, the byte count below fits in 64 bits
+    if (dims[0] > INT_MAX || dims[1] > INT_MAX || dims[2] > INT_MAX
+        || sizeof(int) * (dims[0] + 1 + dims[2] * 2)
+           > static_cast<size_t>(end - p)) {
+      fprintf(stderr, "[Error] broken model file\n");
       exit(1);
     }
-    size_t max_userid = 0;
-    size_t max_itemid = 0;
-    std::string line;
-    std::vector<std::string> splited;
-    while (getline(ifs, line)) {
-      split_string(line, "\t", splited);
-      size_t userid = atoi(splited[0].c_str());
-      size_t itemid = atoi(splited[1].c_str());
-      if (max_userid < userid) max_userid = userid;
-      if (max_itemid < itemid) max_itemid = itemid;
-      splited.clear();
+    mat.resize(dims[0], dims[1]);
+    mat.resizeNonZeros(dims[2]);
+    p = read_data(p, end, mat.outerIndexPtr(), sizeof(int) * (dims[0] + 1));
+    p = read_data(p, end, mat.innerIndexPtr(), sizeof(int) * dims[2]);
+    p = read_data(p, end, mat.valuePtr(), sizeof(int) * dims[2]);
+    if (!check_compressed_rows(mat.outerIndexPtr(), mat.innerIndexPtr(),
+                               dims[0], dims[1], dims[2])) {
+      fprintf(stderr, "[Error] broken model file\n");
+      exit(1);
     }
-    mat.resize(max_userid+1, max_itemid+1);
+    return p;
+  }
+
+  /**
+   * Write the parameters of the model.
+   * Subclasses append their own parameters after these ones.
+   * @param fp output file
+   */
+  virtual void write_model(FILE *fp) const {
+    write_sparse_matrix(fp, mtrain_);
+    write_matrix(fp, U_);
+    write_matrix(fp, V_);
+  }
 
-    ifs.clear();
-    ifs.seekg(0, std::ios_base::beg);
-    while (getline(ifs, line)) {
-      split_string(line, "\t", splited);
-      size_t userid = atoi(splited[0].c_str());
-      size_t itemid = atoi(splited[1].c_str());
-      double rate = atof(splited[2].c_str());
-      mat.insert(userid, itemid) = rate;
-      splited.clear();
+  /**
+   * Read the parameters of the model written by write_model().
+   * @param p current position
+   * @param end end of the file
+   * @return position after the parameters
+   */
+  virtual const char *read_model(const char *p, const char *end) {
+    p = read_sparse_matrix(p, end, mtrain_);
+    p = read_matrix(p, end, U_);
+    p = read_matrix(p, end, V_);
+    if (U_.cols() != V_.rows() || mtrain_.rows() > U_.rows()
+        || mtrain_.cols() > V_.cols()) {
+      fprintf(stderr, "[Error] broken model file\n");
+      exit(1);
     }
+    return p;
   }
 
   /**
@@ -127,6 +457,37 @@ class MatrixFactorizer {
     }
   }
 
+  /**
+   * Grow a matrix and set the average of the old rows (or columns) to
+   * the new rows (or columns), so that new users and items start from
+   * an ordinary point of the trained model. An empty matrix is filled
+   * with random values.
+   * @param mat matrix to be grown
+   * @param rows the number of rows
+   * @param cols the number of columns
+   */
+  void grow_matrix(Mat &mat, int rows, int cols) const {
+    int old_rows = mat.rows();
+    int old_cols = mat.cols();
+    if (rows <= old_rows && cols <= old_cols) return;
+    if (old_rows == 0 || old_cols == 0) {
+      mat.resize(rows, cols);
+      set_matrix_random(mat);
+      return;
+    }
+    Eigen::RowVectorXf row_mean = mat.colwise().mean();
+    Eigen::VectorXf col_mean = mat.rowwise().mean();
+    mat.conservativeResize(std::max(rows, old_rows), std::max(cols, old_cols));
+    float mean = row_mean.mean();
+    for (int i = old_rows; i < mat.rows(); i++) {
+      mat.row(i).head(old_cols) = row_mean;
+    }
+    for (int j = old_cols; j < mat.cols(); j++) {
+      mat.col(j).head(old_rows) = col_mean;
+      mat.col(j).tail(mat.rows() - old_rows).setConstant(mean);
+    }
+  }
+
   /**
    * Get the average value of a matrix.
    * @param mat matrix
@@ -145,249 +506,1824 @@ class MatrixFactorizer {
   }
 
   /**
-   * Predict a rate using user matrix and item matrix. (virtual function)
+   * Get RMSE(root mean square error) of predicted rates.
+   * @param mat matrix of correct rates
+   * @param rounding round predicted rates if true
+   * @return RMSE
+   */
+  double rmse(const SMat &mat, bool rounding) const {
+    if (mat.nonZeros() == 0) return -1;
+    double sum = 0.0;
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+:sum) \
+      num_threads(nthread_)
+    for (int j = 0; j < mat.outerSize(); j++) {
+      for (SMat::InnerIterator it(mat, j); it; ++it) {
+        if (it.row() >= U_.rows() || it.col() >= V_.cols()) {
+          fprintf(stderr, "no data: row:%ld col:%ld\n",
+                  static_cast<long>(it.row()), static_cast<long>(it.col()));
+          continue;
+        }
+        double rate = predict_rate(it.row(), it.col());
+        if (rounding) rate = round(rate);
+        double target = preference(it.value());
+        sum += (rate - target) * (rate - target);
+      }
+    }
+    return sqrt(sum / mat.nonZeros());
+  }
+
+  /**
+   * State of a visit to a user in stochastic gradient descent.
+   */
+  struct UserState {
+    double average_step;  ///< step of the average rate (with biases)
+  };
+
+  /**
+   * Start a visit to a user in stochastic gradient descent.
    * @param user user index
-   * @param item item index
-   * @return rate
+   * @param state state of the visit
    */
-  virtual double predict_rate(int user, int item) const = 0;
+  void begin_user(int user, UserState &state) {
+    state.average_step = 0.0;
+  }
 
- public:
   /**
-   * Constructor.
+   * Finish a visit to a user in stochastic gradient descent.
+   * @param user user index
+   * @param state state of the visit
    */
-  MatrixFactorizer() { }
+  void end_user(int user, UserState &state) { }
 
   /**
-   * Destructor.
+   * Finish an epoch of stochastic gradient descent before it is
+   * evaluated. (nothing by default)
    */
-  ~MatrixFactorizer() { }
+  void end_epoch() { }
 
   /**
-   * Factorize a training matrix. (virtual function)
-   * @param ncluster the number of clusters
+   * Run stochastic gradient descent over the training matrix.
+   * When more than one thread is set, rows (users) are distributed
+   * over threads and item factors are updated without locks (Hogwild!).
+   * The learning rate of each rating is decayed by its position in
+   * the same order as the serial loop, or adapted to each row (see
+   * update_rating()).
+   * The ratings of a user are given to the updater between
+   * begin_user() and end_user() with a per-thread Updater::UserState.
+   * Factorizers with biases accumulate the step of the global average
+   * rate in the state and apply it in end_user(), so that threads do
+   * not write the shared value for every rating.
+   * Training stops early when the validation RMSE stops improving.
+   * @param updater object which has begin_user(user, state),
+   *                update_factors(user, item, rate, eta_user, eta_item,
+   *                               lambda, state, grads),
+   *                end_user(user, state) and end_epoch()
    * @param niter the number of iterations
    * @param eta a tuning parameter
    * @param lambda a tuning parameter
    */
-  virtual void factorize(size_t ncluster, size_t niter,
-                         double eta, double lambda) = 0;
+  template<typename Updater>
+  void run_sgd(Updater &updater, size_t niter, double eta, double lambda) {
+    if (order_ == ORDER_SHUFFLE) {
+      run_shuffled_sgd(updater, niter, eta, lambda);
+      return;
+    }
+    size_t N = mtrain_.nonZeros();
+    const int *outer = mtrain_.outerIndexPtr();
+    begin_training();
+    for (size_t i = 0; i < niter; i++) {
+      double start = get_time();
+      #pragma omp parallel num_threads(nthread_)
+      {
+        typename Updater::UserState state;
+        #pragma omp for schedule(dynamic, 16)
+        for (int j = 0; j < mtrain_.outerSize(); j++) {
+          if (outer[j] == outer[j+1]) continue;
+          size_t count = i * N + outer[j];
+          updater.begin_user(j, state);
+          for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
+            count++;
+            double eta_2 = eta / (1 + static_cast<double>(count) / N);
+            update_rating(updater, it.row(), it.col(), it.value(),
+                          eta, eta_2, lambda, state);
+          }
+          updater.end_user(j, state);
+        }
+      }
+      if (log_epochs_) {
+        updater.end_epoch();
+        if (log_epoch(i, get_time() - start)) break;
+      }
+    }
+  }
 
   /**
-   * Read a training file.
-   * @param filename training file
+   * Run stochastic gradient descent over a shuffled rating stream.
+   * A tile holds the users whose factors fit in SGD_TILE_BYTES and all
+   * the items. (Tiles of items split the ratings of a user into short
+   * runs, and the user factors are reloaded for every rating.)
+   * Tiles of the stream are distributed over threads, and the ratings
+   * of a user in a tile are given to the updater between begin_user()
+   * and end_user(). The learning rate is set in the same way as
+   * run_sgd() by the position of each rating in the epoch.
+   * @param updater object which has begin_user(user, state),
+   *                update_factors(user, item, rate, eta_user, eta_item,
+   *                               lambda, state, grads),
+   *                end_user(user, state) and end_epoch()
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
    */
-  virtual void train(const char *filename) {
-    read_file(filename, mtrain_);
+  template<typename Updater>
+  void run_shuffled_sgd(Updater &updater, size_t niter,
+                        double eta, double lambda) {
+    size_t rank = std::max(1, static_cast<int>(U_.cols()));
+    int tile = std::max(static_cast<size_t>(1),
+                        SGD_TILE_BYTES / (sizeof(float) * rank));
+    RatingStream stream;
+    stream.build(mtrain_, tile, mtrain_.cols());
+    size_t N = stream.size();
+    begin_training();
+    for (size_t i = 0; i < niter; i++) {
+      double start = get_time();
+      stream.shuffle(rand(), nthread_);
+      #pragma omp parallel num_threads(nthread_)
+      {
+        typename Updater::UserState state;
+        #pragma omp for schedule(dynamic, 1)
+        for (int t = 0; t < static_cast<int>(stream.num_tiles()); t++) {
+          size_t count = i * N + stream.position(t);
+          for (size_t r = stream.first_run(t); r < stream.last_run(t); r++) {
+            const Rating *p = stream.run_begin(r);
+            const Rating *end = stream.run_end(r);
+            int user = p->user;
+            updater.begin_user(user, state);
+            for (; p != end; ++p) {
+              count++;
+              double eta_2 = eta / (1 + static_cast<double>(count) / N);
+              update_rating(updater, user, p->item, p->rate,
+                            eta, eta_2, lambda, state);
+            }
+            updater.end_user(user, state);
+          }
+        }
+      }
+      if (log_epochs_) {
+        updater.end_epoch();
+        if (log_epoch(i, get_time() - start)) break;
+      }
+    }
   }
 
   /**
-   * Do test.
-   * @param filename test file
-   * @return RMSE(root mean square error)
+   * Update factors with a rating at the learning rate of the user and
+   * the item. With RATE_ADAGRAD or RATE_RMSPROP, each user row and item
+   * column keeps the sum (or the moving average) of the squared norms of
+   * its gradients (row-wise AdaGrad), and eta is divided by the square
+   * root of it.
+   * @param updater object which has update_factors() with grads
+   * @param user user index
+   * @param item item index
+   * @param rate rate
+   * @param eta a tuning parameter
+   * @param eta_2 decayed learning rate (RATE_DECAY)
+   * @param lambda a tuning parameter
+   * @param state state of the visit to the user
+   * @return error of the predicted rate
    */
-  double test(const char *filename) const {
-    SMat mtest;
-    read_file(filename, mtest);
-    if (mtest.nonZeros() == 0) return -1;
-    double rmse = 0.0;
-    for (int j = 0; j < mtest.outerSize(); j++) {
-      for (SMat::InnerIterator it(mtest, j); it; ++it) {
-        if (it.row() >= U_.rows() || it.col() >= V_.cols()) {
-          fprintf(stderr, "no data: row:%d col:%d\n", it.row(), it.col());
-          continue;
-        }
-        int rate = round(predict_rate(it.row(), it.col()));
-        rmse += (rate - it.value()) * (rate - it.value());
-      }
+  template<typename Updater>
+  double update_rating(Updater &updater, int user, int item, double rate,
+                       double eta, double eta_2, double lambda,
+                       typename Updater::UserState &state) {
+    if (rate_ == RATE_DECAY) {
+      return updater.update_factors(user, item, rate, eta_2, eta_2,
+                                    lambda, state);
+    }
+    float &user_gradient = user_gradients_[user];
+    float &item_gradient = item_gradients_[item];
+    double grads[2] = { 0.0, 0.0 };
+    double val = updater.update_factors(user, item, rate,
+                                        eta / sqrt(user_gradient),
+                                        eta / sqrt(item_gradient),
+                                        lambda, state, grads);
+    if (rate_ == RATE_ADAGRAD) {
+      user_gradient += grads[0];
+      item_gradient += grads[1];
+    } else {
+      user_gradient = RMSPROP_DECAY * user_gradient
+        + (1 - RMSPROP_DECAY) * grads[0];
+      item_gradient = RMSPROP_DECAY * item_gradient
+        + (1 - RMSPROP_DECAY) * grads[1];
     }
-    return sqrt(rmse / mtest.nonZeros());
+    return val;
   }
 
   /**
-   * Print all predicted rates.
+   * Reset the learning rates and the log of epochs before training.
+   * Squared gradients of rows start from 1, so the first learning rate
+   * of each row is eta.
    */
-  void print_all_rate() const {
-    for (int i = 1; i < mtrain_.rows(); i++) {
-      for (int j = 1; j < mtrain_.cols(); j++) {
-        printf("%d\t%d\t%.2f\n", i, j, predict_rate(i, j));
-      }
+  void begin_training() {
+    if (rate_ != RATE_DECAY) {
+      user_gradients_.assign(U_.rows(), 1.0);
+      item_gradients_.assign(V_.cols(), 1.0);
     }
+    target_epoch_ = 0;
+    nepoch_ = 0;
+    best_epoch_ = 0;
+    best_rmse_ = 0.0;
   }
 
   /**
-   * Print top n predicted rates.
-   * @param num the number of output rates
+   * Report an epoch of stochastic gradient descent with training RMSE
+   * (and validation RMSE), and keep the first epoch which reaches the
+   * target RMSE.
+   * @param epoch index of the epoch
+   * @param elapsed time of the epoch in seconds
+   * @return return true if training should stop
    */
-  void print_top_rate(size_t num) const {
-    for (int i = 1; i < mtrain_.rows(); i++) {
-      std::priority_queue<std::pair<int, double>,
-                          std::vector<std::pair<int, double> >,
-                          GreaterPair<int, double> > pq;
-      for (int j = 1; j < mtrain_.cols(); j++) {
-        pq.push(std::pair<int, double>(j,predict_rate(i, j)));
-      }
-      for (size_t k = 0; k < num && !pq.empty(); k++) {
-        std::pair<int, double> p = pq.top();
-        printf("%d\t%d\t%.2f\n", i, p.first, p.second);
-        pq.pop();
+  bool log_epoch(size_t epoch, double elapsed) {
+    nepoch_ = epoch + 1;
+    double error = rmse(mtrain_, false);
+    if (target_epoch_ == 0 && target_rmse_ > 0 && error <= target_rmse_) {
+      target_epoch_ = nepoch_;
+    }
+    if (mvalid_.nonZeros() == 0) {
+      fprintf(stderr, "Epoch %ld: %.3f sec, %.0f ratings/sec, RMSE=%.4f\n",
+              nepoch_, elapsed, mtrain_.nonZeros() / elapsed, error);
+      return false;
+    }
+    double valid = rmse(mvalid_, false);
+    if (observer_) {
+      if (!observer_->end_epoch(nepoch_, error, valid)) return true;
+    } else {
+      fprintf(stderr, "Epoch %ld: %.3f sec, %.0f ratings/sec, RMSE=%.4f, "
+              "validation RMSE=%.4f\n", nepoch_, elapsed,
+              mtrain_.nonZeros() / elapsed, error, valid);
+    }
+    if (best_epoch_ == 0 || valid < best_rmse_ - STOP_TOLERANCE) {
+      best_epoch_ = nepoch_;
+      best_rmse_ = valid;
+      return false;
+    }
+    return patience_ > 0 && nepoch_ - best_epoch_ >= patience_;
+  }
+
+  /**
+   * Run stochastic gradient descent over the ratings of some users.
+   * The cost depends on the given users rather than on the whole
+   * training matrix. Items of smaller indexes than first_item keep
+   * their parameters, since a few users' ratings would pull the trained
+   * items away from the rest of the users. The learning rate is
+   * decayed by iteration.
+   * @param updater object which has begin_user(user, state),
+   *                update_factors(user, item, rate, eta_user, eta_item,
+   *                               lambda, state)
+   *                and end_user(user, state)
+   * @param users user indexes
+   * @param first_item index of the first item to be updated
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  template<typename Updater>
+  void run_local_sgd(Updater &updater, const std::vector<int> &users,
+                     int first_item, size_t niter, double eta, double lambda) {
+    frozen_items_ = first_item;
+    for (size_t i = 0; i < niter; i++) {
+      double eta_2 = eta / (1 + i);
+      #pragma omp parallel num_threads(nthread_)
+      {
+        typename Updater::UserState state;
+        #pragma omp for schedule(dynamic, 16)
+        for (int k = 0; k < static_cast<int>(users.size()); k++) {
+          int j = users[k];
+          updater.begin_user(j, state);
+          for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
+            updater.update_factors(it.row(), it.col(), it.value(),
+                                   eta_2, eta_2, lambda, state);
+          }
+          updater.end_user(j, state);
+        }
       }
     }
+    frozen_items_ = 0;
   }
 
   /**
-   * Save a user matrix.
-   * @param filename output file name
+   * Grow the parameters of the model for new users and items.
+   * @param users the number of users
+   * @param items the number of items
    */
-  void save_user_matrix(const char *filename) const {
-    save_matrix(filename, U_);
+  virtual void resize_model(int users, int items) {
+    grow_matrix(U_, users, U_.cols());
+    grow_matrix(V_, V_.rows(), items);
   }
 
   /**
-   * Save a item matrix.
-   * @param filename output file name
+   * Refine the parameters of some users and items after new ratings
+   * are merged into the training matrix. (virtual function)
+   * @param users indexes of the users who have new ratings
+   * @param items indexes of the items which have new ratings
+   * @param new_item index of the first item added by the new ratings
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
    */
-  void save_item_matrix(const char *filename) const {
-    save_matrix(filename, V_.transpose());
+  virtual void refine(const std::vector<int> &users,
+                      const std::vector<int> &items, int new_item,
+                      size_t niter, double eta, double lambda) = 0;
+
+  /**
+   * Predict a rate using user matrix and item matrix. (virtual function)
+   * @param user user index
+   * @param item item index
+   * @return rate
+   */
+  virtual double predict_rate(int user, int item) const = 0;
+
+  /**
+   * Get the value which a predicted rate should be close to.
+   * (virtual function)
+   * @param rate rate in a rating matrix
+   * @return the rate itself
+   */
+  virtual double preference(double rate) const {
+    return rate;
   }
 
-  void save_recommend(const char *filename, size_t max) const {
-    FILE *fp = fopen(filename, "w");
+ public:
+  /**
+   * Constructor.
+   */
+  MatrixFactorizer()
+    : nthread_(1), frozen_items_(0), order_(ORDER_ROW), log_epochs_(false),
+      target_rmse_(0.0), target_epoch_(0), rate_(RATE_DECAY), patience_(0),
+      nepoch_(0), best_epoch_(0), best_rmse_(0.0), observer_(NULL),
+      map_ids_(false) { }
+
+  /**
+   * Destructor.
+   */
+  virtual ~MatrixFactorizer() { }
+
+  /**
+   * Get the type of the model. (virtual function)
+   * @return ModelType
+   */
+  virtual int model_type() const = 0;
+
+  /**
+   * Save the model to a binary file.
+   * The file holds the training matrix and all the parameters,
+   * and can be loaded by load_model() without training.
+   * @param filename output file name
+   */
+  void save_model(const char *filename) const {
+    FILE *fp = fopen(filename, "wb");
     if (fp == NULL) {
       fprintf(stderr, "[Error] cannot open %s\n", filename);
       exit(1);
     }
-    // user cluster
-    std::vector<int> user_clusters(U_.rows());
-    for (int i = 0; i < U_.rows(); i++) {
-      int max_idx = 0;
-      double max_val = -1.0;
-      for (int j = 0; j < U_.cols(); j++) {
-        if (max_val < U_(i, j)) {
-          max_idx = j;
-          max_val = U_(i, j);
-        }
-      }
-      user_clusters[i] = max_idx;
+    ModelFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+    header.version = MODEL_FILE_VERSION;
+    header.type = model_type();
+    write_data(fp, &header, sizeof(header));
+    write_model(fp);
+    if (map_ids_) {
+      write_data(fp, MODEL_IDS_MAGIC, sizeof(MODEL_IDS_MAGIC));
+      user_ids_.write(fp);
+      item_ids_.write(fp);
     }
-    // cluster items
-    std::vector<std::tr1::unordered_map<int, size_t> *>
-      cluster_item_maps(V_.rows());
-    std::tr1::unordered_map<int, size_t>::iterator cit;
-    for (int i = 0; i < mtrain_.outerSize(); i++) {
-      for (SMat::InnerIterator it(mtrain_, i); it; ++it) {
-//        if (it.value() < 3.0) continue;
-        int cluster_id = user_clusters[it.row()];
-        if (cluster_item_maps[cluster_id] == NULL) {
-          cluster_item_maps[cluster_id] =
-            new std::tr1::unordered_map<int, size_t>;
-        }
-        cit = cluster_item_maps[cluster_id]->find(it.col());
-        if (cit == cluster_item_maps[cluster_id]->end()) {
-          cluster_item_maps[cluster_id]->insert(
-            std::pair<int, size_t>(it.col(), 1));
-        } else {
-          cit->second += 1;
-        }
-      }
+    if (fclose(fp) != 0) {
+      fprintf(stderr, "[Error] cannot write a model file\n");
+      exit(1);
+    }
+  }
+
+  /**
+   * Load a model from a binary file using mmap.
+   * @param filename input file name
+   */
+  void load_model(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      fprintf(stderr, "[Error] cannot open %s\n", filename);
+      exit(1);
+    }
+    void *addr = MAP_FAILED;
+    if (st.st_size > 0) {
+      addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (addr == MAP_FAILED) {
+      fprintf(stderr, "[Error] cannot mmap %s\n", filename);
+      exit(1);
+    }
+    const char *p = static_cast<const char *>(addr);
+    const char *end = p + st.st_size;
+    ModelFileHeader header;
+    p = read_data(p, end, &header, sizeof(header));
+    if (memcmp(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != MODEL_FILE_VERSION
+        || static_cast<int>(header.type) != model_type()) {
+      fprintf(stderr, "[Error] invalid model file: %s\n", filename);
+      exit(1);
+    }
+    p = read_model(p, end);
+    map_ids_ = static_cast<size_t>(end - p) >= sizeof(MODEL_IDS_MAGIC)
+      && memcmp(p, MODEL_IDS_MAGIC, sizeof(MODEL_IDS_MAGIC)) == 0;
+    if (map_ids_) {
+      p = user_ids_.read(p + sizeof(MODEL_IDS_MAGIC), end);
+      item_ids_.read(p, end);
+    } else {
+      user_ids_.clear();
+      item_ids_.clear();
+    }
+    munmap(addr, st.st_size);
+  }
+
+  /**
+   * Factorize a training matrix. (virtual function)
+   * @param ncluster the number of clusters
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  virtual void factorize(size_t ncluster, size_t niter,
+                         double eta, double lambda) = 0;
+
+  /**
+   * Fold new ratings into a factorized model without factorizing the
+   * whole training matrix again.
+   * The ratings are merged into the training matrix (a new rating of
+   * the same user and item replaces the old one), the model is grown
+   * for new users and items, and only the parameters of the users and
+   * items which have new ratings are refined. (SGD factorizers move the
+   * users and new items, and keep the items which had been trained.)
+   * @param filename file of new ratings
+   * @param niter the number of local iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  void update(const char *filename, size_t niter, double eta, double lambda) {
+    SMat delta;
+    read_training_file(filename, delta);
+    SMat merged;
+    merge_rating_matrix(mtrain_, delta, merged);
+    mtrain_.swap(merged);
+    int new_item = V_.cols();
+    resize_model(mtrain_.rows(), mtrain_.cols());
+    std::vector<int> users;
+    std::vector<char> item_flags(delta.cols(), 0);
+    for (int i = 0; i < delta.outerSize(); i++) {
+      SMat::InnerIterator it(delta, i);
+      if (it) users.push_back(i);
+      for (; it; ++it) item_flags[it.col()] = 1;
+    }
+    std::vector<int> items;
+    for (size_t j = 0; j < item_flags.size(); j++) {
+      if (item_flags[j]) items.push_back(j);
+    }
+    refine(users, items, new_item, niter, eta, lambda);
+    fprintf(stderr, "Updated %ld users and %ld items with %ld ratings\n",
+            users.size(), items.size(), static_cast<long>(delta.nonZeros()));
+  }
+
+  /**
+   * Get the user vectors used to score items.
+   * predict_rate(user, item) must be equal to
+   * user_offset(user) + item_offset(item) + vectors.row(user) * V_.col(item)
+   * @param begin index of the first user
+   * @param num the number of users
+   * @param mat output matrix (num x ncluster)
+   */
+  virtual void user_vectors(int begin, int num, Mat &mat) const {
+    mat = U_.middleRows(begin, num);
+  }
+
+  /**
+   * Get memory of vectors cached for predictions.
+   * @return bytes (0 if nothing is cached)
+   */
+  virtual size_t cache_bytes() const {
+    return 0;
+  }
+
+  /**
+   * Get the offset of a user added to every predicted rate.
+   * @param user user index
+   * @return offset value
+   */
+  virtual double user_offset(int user) const {
+    return 0.0;
+  }
+
+  /**
+   * Get the offset of an item added to every predicted rate.
+   * @param item item index
+   * @return offset value
+   */
+  virtual double item_offset(int item) const {
+    return 0.0;
+  }
+
+  /**
+   * Set the number of threads used in training and test.
+   * @param nthread the number of threads
+   */
+  void set_num_threads(size_t nthread) {
+    nthread_ = nthread > 0 ? nthread : 1;
+  }
+
+  /**
+   * Set the order of ratings in stochastic gradient descent.
+   * @param order TrainingOrder
+   */
+  void set_training_order(int order) {
+    order_ = order;
+  }
+
+  /**
+   * Report time and training RMSE of each epoch of stochastic gradient
+   * descent.
+   * @param target target of training RMSE (0 if none)
+   */
+  void set_epoch_log(double target) {
+    log_epochs_ = true;
+    target_rmse_ = target;
+  }
+
+  /**
+   * Set the learning rates of stochastic gradient descent.
+   * @param rate LearningRate
+   */
+  void set_learning_rate(int rate) {
+    rate_ = rate;
+  }
+
+  /**
+   * Map external IDs of users and items (any strings) to dense indexes
+   * while reading training files, instead of using numeric IDs as
+   * indexes. Call before train(). The dictionaries are saved with the
+   * model, and IDs are written in place of indexes.
+   * @param map_ids true to map IDs
+   */
+  void set_id_mapping(bool map_ids) {
+    map_ids_ = map_ids;
+  }
+
+  /**
+   * Check whether external IDs are mapped.
+   * @return true if IDs are mapped
+   */
+  bool maps_ids() const {
+    return map_ids_;
+  }
+
+  /**
+   * Get the dictionary of user IDs (empty without ID mapping).
+   * @return dictionary
+   */
+  const IdDictionary &user_dictionary() const {
+    return user_ids_;
+  }
+
+  /**
+   * Get the dictionary of item IDs (empty without ID mapping).
+   * @return dictionary
+   */
+  const IdDictionary &item_dictionary() const {
+    return item_ids_;
+  }
+
+  /**
+   * Get the index of a user.
+   * @param id external ID (a numeric index without ID mapping)
+   * @return user index (-1 if unknown)
+   */
+  int user_index(const std::string &id) const {
+    return lookup_index(user_ids_, id, U_.rows());
+  }
+
+  /**
+   * Get the index of an item.
+   * @param id external ID (a numeric index without ID mapping)
+   * @return item index (-1 if unknown)
+   */
+  int item_index(const std::string &id) const {
+    return lookup_index(item_ids_, id, V_.cols());
+  }
+
+  /**
+   * Get the external ID of a user.
+   * @param user user index
+   * @return ID (the index without ID mapping)
+   */
+  std::string user_id(int user) const {
+    return map_ids_ ? user_ids_.id(user) : index_string(user);
+  }
+
+  /**
+   * Get the external ID of an item.
+   * @param item item index
+   * @return ID (the index without ID mapping)
+   */
+  std::string item_id(int item) const {
+    return map_ids_ ? item_ids_.id(item) : index_string(item);
+  }
+
+  /**
+   * Evaluate RMSE of a validation file after each epoch of stochastic
+   * gradient descent, and stop training when the validation RMSE has not
+   * improved for the given number of epochs. Call after train().
+   * Ratings of users and items out of the training matrix are ignored.
+   * @param filename validation file
+   * @param patience the number of epochs (0 if training does not stop)
+   */
+  void set_validation(const char *filename, size_t patience) {
+    SMat mat;
+    read_file(filename, mat);
+    set_validation(mat, patience);
+  }
+
+  /**
+   * Evaluate RMSE of a validation matrix after each epoch (see
+   * set_validation(const char *, size_t)). Call after train().
+   * @param mat validation matrix
+   * @param patience the number of epochs (0 if training does not stop)
+   */
+  void set_validation(const SMat &mat, size_t patience) {
+    mvalid_ = mat;
+    mvalid_.prune(InTraining(mtrain_.rows(), mtrain_.cols()));
+    patience_ = patience;
+    log_epochs_ = true;
+  }
+
+  /**
+   * Pass training and validation RMSE of each epoch to an observer
+   * instead of reporting them, and stop training when the observer
+   * returns false. Call with set_validation().
+   * @param observer EpochObserver (NULL to report epochs again)
+   */
+  void set_epoch_observer(EpochObserver *observer) {
+    observer_ = observer;
+  }
+
+  /**
+   * Get the number of epochs run in the last training.
+   * @return the number of epochs (0 if epochs are not logged)
+   */
+  size_t num_epochs() const {
+    return nepoch_;
+  }
+
+  /**
+   * Get the epoch of the best validation RMSE.
+   * @return the number of epochs
+   */
+  size_t best_epoch() const {
+    return best_epoch_;
+  }
+
+  /**
+   * Get the best validation RMSE.
+   * @return RMSE
+   */
+  double best_validation_rmse() const {
+    return best_rmse_;
+  }
+
+  /**
+   * Get the first epoch which reached the target RMSE.
+   * @return the number of epochs (0 if not reached)
+   */
+  size_t epochs_to_target() const {
+    return target_epoch_;
+  }
+
+  /**
+   * Get the number of ratings in the training matrix.
+   * @return the number of ratings
+   */
+  size_t num_ratings() const {
+    return mtrain_.nonZeros();
+  }
+
+  /**
+   * Read a training file.
+   * @param filename training file
+   */
+  void train(const char *filename) {
+    SMat mat;
+    read_training_file(filename, mat);
+    train_matrix(mat);
+  }
+
+  /**
+   * Use a rating matrix as the training matrix. The matrix is swapped
+   * rather than copied, so mat is left with the previous training matrix.
+   * @param mat training matrix
+   */
+  virtual void train_matrix(SMat &mat) {
+    mtrain_.swap(mat);
+  }
+
+  /**
+   * Do test.
+   * @param filename test file
+   * @return RMSE(root mean square error)
+   */
+  double test(const char *filename) const {
+    SMat mtest;
+    read_file(filename, mtest);
+    return rmse(mtest, true);
+  }
+
+  /**
+   * Do test with a test matrix.
+   * @param mtest test matrix
+   * @return RMSE(root mean square error)
+   */
+  double test(const SMat &mtest) const {
+    return rmse(mtest, true);
+  }
+
+  /**
+   * Get recall@n of a test file: the fraction of test ratings whose
+   * items are in the top n items of their users (see top_items()).
+   * @param filename test file
+   * @param num n of recall@n
+   * @return recall@n (-1 if there are no test ratings of known users)
+   */
+  double recall(const char *filename, size_t num) const {
+    SMat mtest;
+    read_file(filename, mtest);
+    return recall(mtest, num);
+  }
+
+  /**
+   * Get recall@n of a test matrix (see recall(const char *, size_t)).
+   * @param mtest test matrix
+   * @param num n of recall@n
+   * @return recall@n (-1 if there are no test ratings of known users)
+   */
+  double recall(const SMat &mtest, size_t num) const {
+    std::vector<int> users;
+    for (int i = 0; i < mtest.outerSize() && i < U_.rows(); i++) {
+      if (mtest.outerIndexPtr()[i+1] > mtest.outerIndexPtr()[i]) {
+        users.push_back(i);
+      }
+    }
+    std::vector<ItemList> results;
+    top_items(users, num, results);
+    size_t nhit = 0;
+    size_t ntest = 0;
+    for (size_t u = 0; u < users.size(); u++) {
+      const ItemList &items = results[u];
+      for (SMat::InnerIterator it(mtest, users[u]); it; ++it) {
+        for (size_t j = 0; j < items.size(); j++) {
+          if (items[j].first == it.col()) {
+            nhit++;
+            break;
+          }
+        }
+        ntest++;
+      }
+    }
+    return ntest > 0 ? static_cast<double>(nhit) / ntest : -1;
+  }
+
+  /**
+   * Get the number of users.
+   * @return the number of rows of the user matrix
+   */
+  int num_users() const {
+    return U_.rows();
+  }
+
+  /**
+   * Get the number of items.
+   * @return the number of columns of the item matrix
+   */
+  int num_items() const {
+    return V_.cols();
+  }
+
+  /**
+   * Get the item matrix.
+   * @return item matrix (ncluster x items)
+   */
+  const Mat &item_matrix() const {
+    return V_;
+  }
+
+  /**
+   * Get items rated by a user in the training matrix.
+   * @param user user index
+   * @param items output item indexes (sorted)
+   */
+  void rated_items(int user, std::vector<int> &items) const {
+    items.clear();
+    if (user >= mtrain_.rows()) return;
+    for (SMat::InnerIterator it(mtrain_, user); it; ++it) {
+      items.push_back(it.col());
+    }
+  }
+
+  /**
+   * Get RMSE of the training matrix.
+   * @return RMSE(root mean square error)
+   */
+  double training_rmse() const {
+    return rmse(mtrain_, false);
+  }
+
+  /**
+   * Predict a rate of a user and an item.
+   * @param user user index (less than num_users())
+   * @param item item index (less than num_items())
+   * @return predicted rate
+   */
+  double predict(int user, int item) const {
+    return predict_rate(user, item);
+  }
+
+  /**
+   * Print all predicted rates.
+   */
+  void print_all_rate() const {
+    for (int i = 1; i < mtrain_.rows(); i++) {
+      for (int j = 1; j < mtrain_.cols(); j++) {
+        printf("%d\t%d\t%.2f\n", i, j, predict_rate(i, j));
+      }
+    }
+  }
+
+  /**
+   * Get top n items of a block of users by predicted rates.
+   * The users are scored against blocks of items with dense matrix
+   * products, and each user keeps a heap of at most n items. Items rated
+   * in the training matrix and item 0 are skipped.
+   * @param users user vectors (nuser x ncluster) from user_vectors()
+   * @param ids user indexes (nuser)
+   * @param item_offsets item_offset() of all items
+   * @param num the number of items for each user
+   * @param results output item lists sorted by rates (nuser lists)
+   */
+  void top_items_block(const Mat &users, const int *ids,
+                       const Eigen::VectorXf &item_offsets, size_t num,
+                       ItemList *results) const {
+    int nuser = users.rows();
+    Mat scores;
+    std::vector<const int *> rated(nuser, NULL);
+    std::vector<const int *> rated_end(nuser, NULL);
+    for (int u = 0; u < nuser; u++) {
+      if (ids[u] >= mtrain_.rows()) continue;
+      const int *outer = mtrain_.outerIndexPtr();
+      rated[u] = mtrain_.innerIndexPtr() + outer[ids[u]];
+      rated_end[u] = mtrain_.innerIndexPtr() + outer[ids[u]+1];
+    }
+    for (int ib = 0; ib < V_.cols(); ib += TOPN_ITEM_BLOCK) {
+      int nitem = std::min(TOPN_ITEM_BLOCK, static_cast<int>(V_.cols()) - ib);
+      scores.noalias() =
+        V_.middleCols(ib, nitem).transpose() * users.transpose();
+      for (int u = 0; u < nuser; u++) {
+        ItemList &heap = results[u];
+        double offset = user_offset(ids[u]);
+        const float *col = scores.col(u).data();
+        for (int j = (ib == 0 ? 1 : 0); j < nitem; j++) {
+          int item = ib + j;
+          while (rated[u] != rated_end[u] && *rated[u] < item) ++rated[u];
+          if (rated[u] != rated_end[u] && *rated[u] == item) continue;
+          push_top_item(heap, num, std::pair<int, double>(
+            item, offset + item_offsets(item) + col[j]));
+        }
+      }
+    }
+    for (int u = 0; u < nuser; u++) {
+      std::sort(results[u].begin(), results[u].end(),
+                greater_pair<int, double>);
+    }
+  }
+
+  /**
+   * Get top n items of users by predicted rates.
+   * Blocks of users are scored on the threads set by set_num_threads()
+   * (see top_items_block()).
+   * @param begin index of the first user
+   * @param end index of the last user + 1
+   * @param num the number of items for each user
+   * @param results output item lists sorted by rates (end - begin lists)
+   */
+  void top_items(int begin, int end, size_t num,
+                 std::vector<ItemList> &results) const {
+    results.assign(end > begin ? end - begin : 0, ItemList());
+    if (num == 0 || end <= begin) return;
+    Eigen::VectorXf item_offsets(V_.cols());
+    for (int j = 0; j < V_.cols(); j++) item_offsets(j) = item_offset(j);
+    #pragma omp parallel num_threads(nthread_)
+    {
+      Mat users;
+      std::vector<int> ids;
+      #pragma omp for schedule(dynamic, 1)
+      for (int b = begin; b < end; b += TOPN_USER_BLOCK) {
+        int nuser = std::min(TOPN_USER_BLOCK, end - b);
+        user_vectors(b, nuser, users);
+        ids.resize(nuser);
+        for (int u = 0; u < nuser; u++) ids[u] = b + u;
+        top_items_block(users, &ids[0], item_offsets, num,
+                        &results[b - begin]);
+      }
     }
-    // sort cluster items
-    std::vector<std::pair<int, double> > pairs;
-    std::vector<std::vector<int> > cluster_items(V_.rows());
-    for (size_t i = 0; i < cluster_item_maps.size(); i++) {
-      if (cluster_item_maps[i] == NULL) continue;
-      for (cit = cluster_item_maps[i]->begin();
-           cit != cluster_item_maps[i]->end(); ++cit) {
-        pairs.push_back(std::pair<int, size_t>(cit->first, cit->second));
+  }
+
+  /**
+   * Get top n items of a list of users by predicted rates.
+   * @param users user indexes
+   * @param num the number of items for each user
+   * @param results output item lists sorted by rates (one for each user)
+   */
+  void top_items(const std::vector<int> &users, size_t num,
+                 std::vector<ItemList> &results) const {
+    results.assign(users.size(), ItemList());
+    if (num == 0 || users.empty()) return;
+    int nuser = users.size();
+    Eigen::VectorXf item_offsets(V_.cols());
+    for (int j = 0; j < V_.cols(); j++) item_offsets(j) = item_offset(j);
+    #pragma omp parallel num_threads(nthread_)
+    {
+      Mat vectors;
+      Mat vec;
+      #pragma omp for schedule(dynamic, 1)
+      for (int b = 0; b < nuser; b += TOPN_USER_BLOCK) {
+        int n = std::min(TOPN_USER_BLOCK, nuser - b);
+        vectors.resize(n, U_.cols());
+        for (int u = 0; u < n; u++) {
+          user_vectors(users[b + u], 1, vec);
+          vectors.row(u) = vec.row(0);
+        }
+        top_items_block(vectors, &users[b], item_offsets, num, &results[b]);
       }
-      sort(pairs.begin(), pairs.end(), greater_pair<int, size_t>);
-      for (size_t j = 0; j < pairs.size(); j++) {
-        cluster_items[i].push_back(pairs[j].first);
+    }
+  }
+
+  /**
+   * Print top n predicted rates of each user.
+   * Items rated in the training matrix are not printed.
+   * @param num the number of output rates
+   */
+  void print_top_rate(size_t num) const {
+    const int block = TOPN_USER_BLOCK * 16;
+    std::vector<ItemList> results;
+    for (int i = 1; i < U_.rows(); i += block) {
+      int end = std::min(i + block, static_cast<int>(U_.rows()));
+      top_items(i, end, num, results);
+      for (int u = i; u < end; u++) {
+        const ItemList &items = results[u - i];
+        for (size_t k = 0; k < items.size(); k++) {
+          write_id(stdout, user_ids_, u);
+          putchar('\t');
+          write_id(stdout, item_ids_, items[k].first);
+          printf("\t%.2f\n", items[k].second);
+        }
       }
-      pairs.clear();
     }
-    cluster_item_maps.clear();
+  }
+
+  /**
+   * Save a user matrix.
+   * @param filename output file name
+   */
+  void save_user_matrix(const char *filename) const {
+    save_matrix(filename, U_, user_ids_);
+  }
+
+  /**
+   * Save a item matrix.
+   * @param filename output file name
+   */
+  void save_item_matrix(const char *filename) const {
+    save_matrix(filename, V_.transpose(), item_ids_);
+  }
+
+  /**
+   * Save recommended items. Each user is assigned to the cluster of its
+   * largest factor, and the items rated by users of the cluster are
+   * ranked by predicted rates of the user. Users are scored in parallel
+   * and written in order.
+   * @param filename output file name
+   * @param max the maximum number of items of each user
+   */
+  void save_recommend(const char *filename, size_t max) const {
+    FILE *fp = fopen(filename, "w");
+    if (fp == NULL) {
+      fprintf(stderr, "[Error] cannot open %s\n", filename);
+      exit(1);
+    }
+    // user cluster
+    int nuser = U_.rows();
+    int ncluster = V_.rows();
+    std::vector<int> user_clusters(nuser);
+    #pragma omp parallel for num_threads(nthread_)
+    for (int i = 0; i < nuser; i++) {
+      int max_idx = 0;
+      double max_val = -1.0;
+      for (int j = 0; j < U_.cols(); j++) {
+        if (max_val < U_(i, j)) {
+          max_idx = j;
+          max_val = U_(i, j);
+        }
+      }
+      user_clusters[i] = max_idx;
+    }
+    // users of each cluster
+    int nrow = mtrain_.outerSize();
+    std::vector<int> cluster_offsets(ncluster + 1, 0);
+    for (int i = 0; i < nrow; i++) cluster_offsets[user_clusters[i] + 1]++;
+    for (int c = 0; c < ncluster; c++) {
+      cluster_offsets[c+1] += cluster_offsets[c];
+    }
+    std::vector<int> cluster_users(nrow);
+    std::vector<int> positions(cluster_offsets.begin(),
+                               cluster_offsets.end() - 1);
+    for (int i = 0; i < nrow; i++) {
+      cluster_users[positions[user_clusters[i]]++] = i;
+    }
+    // cluster items sorted by the number of ratings
+    std::vector<std::vector<int> > cluster_items(ncluster);
+    #pragma omp parallel num_threads(nthread_)
+    {
+      std::vector<int> counts(mtrain_.cols(), 0);
+      std::vector<int> items;
+      std::vector<std::pair<int, int> > pairs;
+      #pragma omp for schedule(dynamic)
+      for (int c = 0; c < ncluster; c++) {
+        for (int k = cluster_offsets[c]; k < cluster_offsets[c+1]; k++) {
+          for (SMat::InnerIterator it(mtrain_, cluster_users[k]); it; ++it) {
+            if (counts[it.col()]++ == 0) items.push_back(it.col());
+          }
+        }
+        for (size_t j = 0; j < items.size(); j++) {
+          pairs.push_back(std::pair<int, int>(items[j], counts[items[j]]));
+          counts[items[j]] = 0;
+        }
+        std::sort(pairs.begin(), pairs.end(), greater_pair<int, int>);
+        cluster_items[c].resize(pairs.size());
+        for (size_t j = 0; j < pairs.size(); j++) {
+          cluster_items[c][j] = pairs[j].first;
+        }
+        items.clear();
+        pairs.clear();
+      }
+    }
+    // top items of each block of users
+    std::vector<ItemList> tops(RECOMMEND_USER_BLOCK);
+    for (int begin = 1; begin < nuser; begin += RECOMMEND_USER_BLOCK) {
+      int end = std::min(nuser, begin + RECOMMEND_USER_BLOCK);
+      #pragma omp parallel for schedule(dynamic, 16) num_threads(nthread_)
+      for (int i = begin; i < end; i++) {
+        ItemList &heap = tops[i - begin];
+        const std::vector<int> &items = cluster_items[user_clusters[i]];
+        heap.clear();
+        for (size_t j = 0; j < items.size(); j++) {
+          push_top_item(heap, max, std::pair<int, double>(
+            items[j], predict_rate(i, items[j])));
+        }
+        std::sort(heap.begin(), heap.end(), greater_pair<int, double>);
+      }
+      for (int i = begin; i < end; i++) {
+        const ItemList &heap = tops[i - begin];
+        write_id(fp, user_ids_, i);
+        for (size_t j = 0; j < heap.size(); j++) {
+          fputc('\t', fp);
+          write_id(fp, item_ids_, heap[j].first);
+        }
+        fputc('\n', fp);
+      }
+    }
+    fclose(fp);
+  }
+};
+
+
+/**
+ * Matrix factorization using stochastic gradient descent.
+ */
+class MatrixFactorizerSgd : public MatrixFactorizer {
+  friend class MatrixFactorizer;
+
+ protected:
+  /**
+   * Updater which uses the fixed-rank kernel of rank K.
+   * User vectors are kept in a transposed user matrix (K x users), so
+   * that the vectors of both users and items are contiguous. The user
+   * matrix is copied back at the end of an epoch to be evaluated.
+   * Biases are updated if they are given.
+   */
+  template<int K>
+  class FixedRankUpdater {
+   private:
+    Mat *users_;            ///< user matrix
+    float *ut_;             ///< transposed user matrix
+    float *v_;              ///< item matrix
+    double *average_;       ///< average value of rates (or NULL)
+    double *user_biases_;   ///< user bias (or NULL)
+    double *item_biases_;   ///< item bias (or NULL)
+
+   public:
+    typedef MatrixFactorizer::UserState UserState;
+
+    FixedRankUpdater(Mat *users, float *U, float *V, double *average,
+                     double *user_biases, double *item_biases)
+      : users_(users), ut_(U), v_(V), average_(average),
+        user_biases_(user_biases), item_biases_(item_biases) { }
+
+    void begin_user(int user, UserState &state) {
+      state.average_step = 0.0;
+    }
+
+    double update_factors(int user, int item, double rate, double eta_user,
+                          double eta_item, double lambda, UserState &state,
+                          double *grads = NULL) {
+      float *u = ut_ + static_cast<size_t>(user) * K;
+      float *v = v_ + static_cast<size_t>(item) * K;
+      if (average_ == NULL) {
+        return sgd_step<K>(u, v, 0.0, rate, eta_user, eta_item, lambda,
+                           grads);
+      }
+      double val = sgd_step<K>(
+        u, v, *average_ + user_biases_[user] + item_biases_[item],
+        rate, eta_user, eta_item, lambda, grads);
+      if (grads != NULL) {
+        double user_grad = val - lambda * user_biases_[user];
+        double item_grad = val - lambda * item_biases_[item];
+        grads[0] += user_grad * user_grad;
+        grads[1] += item_grad * item_grad;
+      }
+      state.average_step += eta_item * val;
+      user_biases_[user] += eta_user * (val - lambda * user_biases_[user]);
+      item_biases_[item] += eta_item * (val - lambda * item_biases_[item]);
+      return val;
+    }
+
+    void end_user(int user, UserState &state) {
+      if (average_ != NULL) *average_ += state.average_step;
+    }
+
+    void end_epoch() {
+      *users_ = Eigen::Map<Mat>(ut_, K, users_->rows()).transpose();
+    }
+  };
+
+  /**
+   * Run stochastic gradient descent with the fixed-rank kernel.
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   * @param average average value of rates (NULL if no biases)
+   * @param user_biases user biases (NULL if no biases)
+   * @param item_biases item biases (NULL if no biases)
+   */
+  template<int K>
+  void run_fixed_rank_sgd(size_t niter, double eta, double lambda,
+                          double *average, double *user_biases,
+                          double *item_biases) {
+    Mat Ut = U_.transpose();
+    FixedRankUpdater<K> updater(&U_, Ut.data(), V_.data(), average,
+                                user_biases, item_biases);
+    run_sgd(updater, niter, eta, lambda);
+    U_ = Ut.transpose();
+  }
+
+  /**
+   * Run stochastic gradient descent with a fixed-rank kernel if the
+   * number of clusters is 8, 16, 32, 64 or 128, or with the generic
+   * update_factors() of this class otherwise.
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   * @param average average value of rates (NULL if no biases)
+   * @param user_biases user biases (NULL if no biases)
+   * @param item_biases item biases (NULL if no biases)
+   * @return return true if a fixed-rank kernel is used
+   */
+  bool run_kernel_sgd(size_t niter, double eta, double lambda,
+                      double *average = NULL, double *user_biases = NULL,
+                      double *item_biases = NULL) {
+    switch (U_.cols()) {
+      case 8:
+        run_fixed_rank_sgd<8>(niter, eta, lambda,
+                              average, user_biases, item_biases);
+        return true;
+      case 16:
+        run_fixed_rank_sgd<16>(niter, eta, lambda,
+                               average, user_biases, item_biases);
+        return true;
+      case 32:
+        run_fixed_rank_sgd<32>(niter, eta, lambda,
+                               average, user_biases, item_biases);
+        return true;
+      case 64:
+        run_fixed_rank_sgd<64>(niter, eta, lambda,
+                               average, user_biases, item_biases);
+        return true;
+      case 128:
+        run_fixed_rank_sgd<128>(niter, eta, lambda,
+                                average, user_biases, item_biases);
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /**
+   * Update factors with a rating.
+   * @param user user index
+   * @param item item index
+   * @param rate rate
+   * @param eta_user learning rate of the user
+   * @param eta_item learning rate of the item
+   * @param lambda a tuning parameter
+   * @param state state of the visit to the user
+   * @param grads output squared norms of the gradients of the user and
+   *              the item (NULL if not needed)
+   * @return error of the predicted rate
+   */
+  double update_factors(int user, int item, double rate, double eta_user,
+                        double eta_item, double lambda, UserState &state,
+                        double *grads = NULL) {
+    double val = rate - predict_rate(user, item);
+    if (grads != NULL) {
+      grads[0] = (val * V_.col(item).transpose()
+                  - lambda * U_.row(user)).squaredNorm();
+    }
+    U_.row(user) += eta_user * (val * V_.col(item).transpose()
+                                - lambda * U_.row(user));
+    if (item < frozen_items_) return val;
+    if (grads != NULL) {
+      grads[1] = (val * U_.row(user).transpose()
+                  - lambda * V_.col(item)).squaredNorm();
+    }
+    V_.col(item) += eta_item * (val * U_.row(user).transpose()
+                                - lambda * V_.col(item));
+    return val;
+  }
+
+  /**
+   * Predict a rate using user matrix and item matrix.
+   * @param user user index
+   * @param item item index
+   * @return a rate
+   */
+  double predict_rate(int user, int item) const {
+    assert(user < U_.rows() && item < V_.cols());
+    return U_.row(user).dot(V_.col(item));
+  }
+
+  /**
+   * Refine the factors of users and new items with the ratings of
+   * the users.
+   * @param users indexes of the users who have new ratings
+   * @param items indexes of the items which have new ratings
+   * @param new_item index of the first item added by the new ratings
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  void refine(const std::vector<int> &users, const std::vector<int> &items,
+              int new_item, size_t niter, double eta, double lambda) {
+    run_local_sgd(*this, users, new_item, niter, eta, lambda);
+  }
+
+ public:
+  /**
+   * Constructor.
+   */
+  MatrixFactorizerSgd() { }
+
+  /**
+   * Destructor.
+   */
+  ~MatrixFactorizerSgd() { }
+
+  /**
+   * Get the type of the model.
+   * @return ModelType
+   */
+  int model_type() const {
+    return MODEL_SGD;
+  }
+
+  /**
+   * Factorize a training matrix.
+   * @param ncluster the number of clusters
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  void factorize(size_t ncluster, size_t niter, double eta, double lambda) {
+    U_.resize(mtrain_.rows(), ncluster);
+    V_.resize(ncluster, mtrain_.cols());
+    set_matrix_random(U_);
+    set_matrix_random(V_);
+    if (!run_kernel_sgd(niter, eta, lambda)) {
+      run_sgd(*this, niter, eta, lambda);
+    }
+  }
+};
+
+
+/**
+ * Matrix factorization using stochastic gradient descent with biases.
+ * Biases will be updated in each iteration.
+ */
+class MatrixFactorizerSgdBias : public MatrixFactorizerSgd {
+  friend class MatrixFactorizer;
+
+ protected:
+  std::vector<double> user_biases_;  ///< user bias
+  std::vector<double> item_biases_;  ///< item bias
+  double average_rate_;              ///< average value of rates
+
+   /**
+   * Get a bias value.
+   * @param user user index
+   * @param item item index
+   * @return a bias value
+   */
+  double bias(int user, int item) const {
+    assert(user < static_cast<int>(user_biases_.size()) &&
+           item < static_cast<int>(item_biases_.size()));
+    return average_rate_ + user_biases_[user] + item_biases_[item];
+  }
+
+  /**
+   * Predict a rate using user matrix and item matrix.
+   * @param user user index
+   * @param item item index
+   * @return a rate
+   */
+  double predict_rate(int user, int item) const {
+    assert(user < U_.rows() && item < V_.cols());
+    return bias(user, item) + U_.row(user).dot(V_.col(item));
+  }
+
+  /**
+   * Update factors and biases with a rating.
+   * @param user user index
+   * @param item item index
+   * @param rate rate
+   * @param eta_user learning rate of the user
+   * @param eta_item learning rate of the item
+   * @param lambda a tuning parameter
+   * @param state state of the visit to the user
+   * @param grads output squared norms of the gradients of the user and
+   *              the item with their biases (NULL if not needed)
+   * @return error of the predicted rate
+   */
+  double update_factors(int user, int item, double rate, double eta_user,
+                        double eta_item, double lambda, UserState &state,
+                        double *grads = NULL) {
+    double val = rate - predict_rate(user, item);
+    if (grads != NULL) {
+      double bias_grad = val - lambda * user_biases_[user];
+      grads[0] = (val * V_.col(item).transpose()
+                  - lambda * U_.row(user)).squaredNorm()
+        + bias_grad * bias_grad;
+    }
+    U_.row(user) += eta_user * (val * V_.col(item).transpose()
+                                - lambda * U_.row(user));
+    user_biases_[user] += eta_user * (val - lambda * user_biases_[user]);
+    if (item < frozen_items_) return val;
+    if (grads != NULL) {
+      double bias_grad = val - lambda * item_biases_[item];
+      grads[1] = (val * U_.row(user).transpose()
+                  - lambda * V_.col(item)).squaredNorm()
+        + bias_grad * bias_grad;
+    }
+    V_.col(item) += eta_item * (val * U_.row(user).transpose()
+                                - lambda * V_.col(item));
+    state.average_step += eta_item * val;
+    item_biases_[item] += eta_item * (val - lambda * item_biases_[item]);
+    return val;
+  }
+
+  /**
+   * Finish a visit to a user and apply the step of the average rate.
+   * @param user user index
+   * @param state state of the visit
+   */
+  void end_user(int user, UserState &state) {
+    average_rate_ += state.average_step;
+  }
+
+  /**
+   * Set random values to the biases of users and items
+   * (after the factors are resized).
+   */
+  void set_biases_random() {
+    user_biases_.resize(U_.rows());
+    item_biases_.resize(V_.cols());
+    for (int i = 0; i < U_.rows(); i++) {
+      user_biases_[i] = static_cast<double>(rand()) / RAND_MAX;
+    }
+    for (int i = 0; i < V_.cols(); i++) {
+      item_biases_[i] = static_cast<double>(rand()) / RAND_MAX;
+    }
+  }
+
+  /**
+   * Write the parameters of the model.
+   * @param fp output file
+   */
+  void write_model(FILE *fp) const {
+    MatrixFactorizer::write_model(fp);
+    write_data(fp, &average_rate_, sizeof(average_rate_));
+    write_vector(fp, user_biases_);
+    write_vector(fp, item_biases_);
+  }
+
+  /**
+   * Read the parameters of the model.
+   * @param p current position
+   * @param end end of the file
+   * @return position after the parameters
+   */
+  const char *read_model(const char *p, const char *end) {
+    p = MatrixFactorizer::read_model(p, end);
+    p = read_data(p, end, &average_rate_, sizeof(average_rate_));
+    p = read_vector(p, end, user_biases_);
+    return read_vector(p, end, item_biases_);
+  }
+
+  /**
+   * Grow the factors and the biases for new users and items.
+   * Biases of new users and items are set to zero.
+   * @param users the number of users
+   * @param items the number of items
+   */
+  void resize_model(int users, int items) {
+    MatrixFactorizer::resize_model(users, items);
+    if (users > static_cast<int>(user_biases_.size())) {
+      user_biases_.resize(users, 0.0);
+    }
+    if (items > static_cast<int>(item_biases_.size())) {
+      item_biases_.resize(items, 0.0);
+    }
+  }
+
+  /**
+   * Refine the factors and the biases of users and new items with
+   * the ratings of the users.
+   * @param users indexes of the users who have new ratings
+   * @param items indexes of the items which have new ratings
+   * @param new_item index of the first item added by the new ratings
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  void refine(const std::vector<int> &users, const std::vector<int> &items,
+              int new_item, size_t niter, double eta, double lambda) {
+    run_local_sgd(*this, users, new_item, niter, eta, lambda);
+  }
+
+ public:
+  /**
+   * Get the offset of a user (average rate and user bias).
+   * @param user user index
+   * @return offset value
+   */
+  double user_offset(int user) const {
+    return average_rate_ + user_biases_[user];
+  }
+
+  /**
+   * Get the offset of an item (item bias).
+   * @param item item index
+   * @return offset value
+   */
+  double item_offset(int item) const {
+    return item_biases_[item];
+  }
+
+  /**
+   * Constructor.
+   */
+  MatrixFactorizerSgdBias() : average_rate_(0.0) { }
+
+  /**
+   * Destructor.
+   */
+  ~MatrixFactorizerSgdBias() { }
+
+  /**
+   * Get the type of the model.
+   * @return ModelType
+   */
+  int model_type() const {
+    return MODEL_SGD_BIAS;
+  }
+
+  /**
+   * Use a rating matrix as the training matrix (swapped with mat).
+   * @param mat training matrix
+   */
+  void train_matrix(SMat &mat) {
+    mtrain_.swap(mat);
+    average_rate_ = matrix_average(mtrain_);
+  }
+
+  /**
+   * Factorize a training matrix.
+   * @param ncluster the number of clusters
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  void factorize(size_t ncluster, size_t niter, double eta, double lambda) {
+    U_.resize(mtrain_.rows(), ncluster);
+    V_.resize(ncluster, mtrain_.cols());
+    set_matrix_random(U_);
+    set_matrix_random(V_);
+    set_biases_random();
+    if (!run_kernel_sgd(niter, eta, lambda, &average_rate_,
+                        &user_biases_[0], &item_biases_[0])) {
+      run_sgd(*this, niter, eta, lambda);
+    }
+  }
+};
+
+/**
+ * SVD++
+ * Matrix factorization using stochastic gradient descent with biases
+ * and implicit information (rental hisotry, ..)
+ */
+class MatrixFactorizerSvdpp : public MatrixFactorizerSgdBias {
+  friend class MatrixFactorizer;
+
+ private:
+  typedef std::vector<std::vector<int> > Implicit;
+  Implicit implicit_;  ///< impclit information
+  Mat Y_;              ///< bias of impclit information
+  Mat effective_;      ///< cached effective user vectors (ncluster x users)
+
+  /**
+   * Set implicit information
+   */
+  void set_implicit_information() {
+    implicit_.clear();
+    implicit_.resize(mtrain_.rows());
+    for (int j = 0; j < mtrain_.outerSize(); j++) {
+      for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
+        implicit_[it.row()].push_back(it.col());
+      }
+    }
+  }
+
+  /**
+   * Get the bias values of implicit information
+   * @param user user index
+   * @return the vector of implicit bias
+   */
+  Eigen::VectorXf implicit_value(int user) const {
+    Eigen::VectorXf vec = Eigen::VectorXf::Zero(Y_.rows());
+    if (implicit_[user].size() == 0) return vec;
+    for (size_t i = 0; i < implicit_[user].size(); i++) {
+      vec += Y_.col(implicit_[user][i]);
+    }
+    vec *= pow(static_cast<double>(implicit_[user].size()), -0.5);
+    return vec;
+  }
+
+  /**
+   * Cache the effective vector of each user: the user vector plus the
+   * implicit value, so that a prediction is one dot product.
+   */
+  void set_effective_vectors() {
+    effective_.resize(U_.cols(), U_.rows());
+    #pragma omp parallel for schedule(dynamic, 64) num_threads(nthread_)
+    for (int i = 0; i < U_.rows(); i++) {
+      effective_.col(i) = U_.row(i).transpose() + implicit_value(i);
+    }
+  }
+
+  /**
+   * Drop the cached effective vectors while factors are updated.
+   */
+  void clear_effective_vectors() {
+    effective_.resize(0, 0);
+  }
+
+  /**
+   * State of a visit to a user.
+   * While a user is visited, every rating moves all the implicit factors
+   * of the user's items by the same decay and the same vector, so the
+   * update is kept as Y_j * scale + step for all j and applied once at
+   * the end of the visit. The implicit value is kept up to date from
+   * the sum of Y_j at the beginning of the visit.
+   */
+  struct UserState {
+    Eigen::VectorXf sum;       ///< sum of implicit factors at the beginning
+    Eigen::VectorXf step;      ///< accumulated step of implicit factors
+    Eigen::VectorXf implicit;  ///< current implicit value of the user
+    double scale;              ///< accumulated decay of implicit factors
+    double coeff;              ///< |N(u)|^-0.5
+    double average_step;       ///< accumulated step of the average rate
+  };
+
+  /**
+   * Start a visit to a user.
+   * @param user user index
+   * @param state state of the visit
+   */
+  void begin_user(int user, UserState &state) {
+    state.sum = Eigen::VectorXf::Zero(Y_.rows());
+    for (size_t k = 0; k < implicit_[user].size(); k++) {
+      state.sum += Y_.col(implicit_[user][k]);
+    }
+    state.step = Eigen::VectorXf::Zero(Y_.rows());
+    state.average_step = 0.0;
+    state.scale = 1.0;
+    state.coeff = pow(static_cast<double>(implicit_[user].size()), -0.5);
+    state.implicit = state.coeff * state.sum;
+  }
 
-    for (int i = 1; i < U_.rows(); i++) {
-      fprintf(fp, "%d", i);
-      int cluster_id = user_clusters[i];
-      for (size_t j = 0; j < cluster_items[cluster_id].size(); j++) {
-        pairs.push_back(std::pair<int, double>(
-          cluster_items[cluster_id][j],
-          predict_rate(i, cluster_items[cluster_id][j])));
-      }
-      sort(pairs.begin(), pairs.end(), greater_pair<int, double>);
-      for (size_t j = 0; j < pairs.size() && j < max; j++) {
-        fprintf(fp, "\t%d", pairs[j].first);
-      }
-      fprintf(fp, "\n");
-      pairs.clear();
+  /**
+   * Update factors and biases with a rating and accumulate the update of
+   * implicit factors.
+   * @param user user index
+   * @param item item index
+   * @param rate rate
+   * @param eta_user learning rate of the user
+   * @param eta_item learning rate of the item
+   * @param lambda a tuning parameter
+   * @param state state of the visit to the user
+   * @param grads output squared norms of the gradients of the user and
+   *              the item with their biases (NULL if not needed)
+   * @return error of the predicted rate
+   */
+  double update_factors(int user, int item, double rate, double eta_user,
+                        double eta_item, double lambda, UserState &state,
+                        double *grads = NULL) {
+    double val = rate - bias(user, item) - V_.col(item).dot(
+      U_.row(user).transpose() + state.implicit);
+    if (grads != NULL) {
+      double bias_grad = val - lambda * user_biases_[user];
+      grads[0] = (val * V_.col(item).transpose()
+                  - lambda * U_.row(user)).squaredNorm()
+        + bias_grad * bias_grad;
     }
-    fclose(fp);
-    for (size_t i = 0; i < cluster_item_maps.size(); i++) {
-      if (cluster_item_maps[i]) delete cluster_item_maps[i];
-    }
-
-    /*
-    std::vector<std::pair<int, size_t> > pairs;
-    std::vector<std::vector<int> > cluster_items(V_.rows());
-    for (size_t i = 0; i < cluster_item_maps.size(); i++) {
-      if (cluster_item_maps[i] == NULL) continue;
-      for (cit = cluster_item_maps[i]->begin();
-           cit != cluster_item_maps[i]->end(); ++cit) {
-        pairs.push_back(std::pair<int, size_t>(cit->first, cit->second));
-      }
-      sort(pairs.begin(), pairs.end(), greater_pair<int, size_t>);
-      for (size_t j = 0; j < pairs.size() && j < max; j++) {
-        cluster_items[i].push_back(pairs[j].first);
+    U_.row(user) += eta_user * (val * V_.col(item).transpose()
+                                - lambda * U_.row(user));
+    user_biases_[user] += eta_user * (val - lambda * user_biases_[user]);
+    if (item >= frozen_items_) {
+      if (grads != NULL) {
+        double bias_grad = val - lambda * item_biases_[item];
+        grads[1] = (val * (U_.row(user).transpose() + state.implicit)
+                    - lambda * V_.col(item)).squaredNorm()
+          + bias_grad * bias_grad;
       }
-      pairs.clear();
+      V_.col(item) += eta_item * (val * (U_.row(user).transpose()
+                                         + state.implicit)
+                                  - lambda * V_.col(item));
+      state.average_step += eta_item * val;
+      item_biases_[item] += eta_item * (val - lambda * item_biases_[item]);
     }
-    cluster_item_maps.clear();
+    double decay = 1.0 - eta_user * lambda / 2.0;
+    state.scale *= decay;
+    state.step = decay * state.step
+      + (eta_user * val * state.coeff) * V_.col(item);
+    state.implicit = state.coeff * (state.scale * state.sum
+                                    + implicit_[user].size() * state.step);
+    return val;
+  }
 
-    for (int i = 1; i < U_.rows(); i++) {
-      fprintf(fp, "%d", i);
-      int cluster_id = user_clusters[i];
-      for (size_t j = 0; j < cluster_items[cluster_id].size(); j++) {
-        fprintf(fp, "\t%d", cluster_items[cluster_id][j]);
-      }
-      fprintf(fp, "\n");
-    }
-    fclose(fp);
-    for (size_t i = 0; i < cluster_item_maps.size(); i++) {
-      if (cluster_item_maps[i]) delete cluster_item_maps[i];
+  /**
+   * Finish a visit to a user and apply the update of implicit factors
+   * and the average rate.
+   * @param user user index
+   * @param state state of the visit
+   */
+  void end_user(int user, UserState &state) {
+    average_rate_ += state.average_step;
+    for (size_t k = 0; k < implicit_[user].size(); k++) {
+      if (implicit_[user][k] < frozen_items_) continue;
+      Y_.col(implicit_[user][k]) =
+        state.scale * Y_.col(implicit_[user][k]) + state.step;
     }
-    */
   }
-};
-
 
-/**
- * Matrix factorization using stochastic gradient descent.
- */
-class MatrixFactorizerSgd : public MatrixFactorizer {
  protected:
   /**
    * Predict a rate using user matrix and item matrix.
    * @param user user index
    * @param item item index
    * @return a rate
-   */
+   */ 
   double predict_rate(int user, int item) const {
-    assert(user < U_.rows() && item < V_.cols());
-    return U_.row(user).dot(V_.col(item));
+    if (effective_.cols() == U_.rows()) {
+      return bias(user, item) + V_.col(item).dot(effective_.col(user));
+    }
+    return bias(user, item) + V_.col(item).transpose().dot(
+      U_.row(user).transpose() + implicit_value(user));
+//    double rate = bias(user, item) + V_.col(item).transpose().dot(
+//      U_.row(user).transpose() + implicit_value(user));
+//    return (rate > 5.0) ? 5.0 : (rate < 3.0) ? 3.0 : rate;
+  }
+
+  /**
+   * Write the parameters of the model.
+   * @param fp output file
+   */
+  void write_model(FILE *fp) const {
+    MatrixFactorizerSgdBias::write_model(fp);
+    write_matrix(fp, Y_);
+  }
+
+  /**
+   * Read the parameters of the model.
+   * @param p current position
+   * @param end end of the file
+   * @return position after the parameters
+   */
+  const char *read_model(const char *p, const char *end) {
+    p = MatrixFactorizerSgdBias::read_model(p, end);
+    p = read_matrix(p, end, Y_);
+    set_implicit_information();
+    set_effective_vectors();
+    return p;
+  }
+
+  /**
+   * Grow the factors, the biases and the implicit factors for new users
+   * and items.
+   * @param users the number of users
+   * @param items the number of items
+   */
+  void resize_model(int users, int items) {
+    MatrixFactorizerSgdBias::resize_model(users, items);
+    grow_matrix(Y_, Y_.rows(), items);
+    if (users > static_cast<int>(implicit_.size())) implicit_.resize(users);
+    clear_effective_vectors();
+  }
+
+  /**
+   * Refine the parameters of users and new items with the ratings of
+   * the users. The implicit information of the users is renewed first.
+   * @param users indexes of the users who have new ratings
+   * @param items indexes of the items which have new ratings
+   * @param new_item index of the first item added by the new ratings
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  void refine(const std::vector<int> &users, const std::vector<int> &items,
+              int new_item, size_t niter, double eta, double lambda) {
+    for (size_t i = 0; i < users.size(); i++) {
+      rated_items(users[i], implicit_[users[i]]);
+    }
+    clear_effective_vectors();
+    run_local_sgd(*this, users, new_item, niter, eta, lambda);
+    set_effective_vectors();
   }
 
  public:
   /**
-   * Constructor.
+   * Get the type of the model.
+   * @return ModelType
    */
-  MatrixFactorizerSgd() { }
+  int model_type() const {
+    return MODEL_SVDPP;
+  }
 
   /**
-   * Destructor.
+   * Get the user vectors with implicit information.
+   * @param begin index of the first user
+   * @param num the number of users
+   * @param mat output matrix (num x ncluster)
    */
-  ~MatrixFactorizerSgd() { }
+  void user_vectors(int begin, int num, Mat &mat) const {
+    if (effective_.cols() == U_.rows()) {
+      mat = effective_.middleCols(begin, num).transpose();
+      return;
+    }
+    mat = U_.middleRows(begin, num);
+    for (int i = 0; i < num; i++) {
+      mat.row(i) += implicit_value(begin + i).transpose();
+    }
+  }
+
+  /**
+   * Get memory of the cached effective user vectors.
+   * @return bytes
+   */
+  size_t cache_bytes() const {
+    return effective_.size() * sizeof(float);
+  }
 
   /**
    * Factorize a training matrix.
@@ -397,51 +2333,119 @@ class MatrixFactorizerSgd : public MatrixFactorizer {
    * @param lambda a tuning parameter
    */
   void factorize(size_t ncluster, size_t niter, double eta, double lambda) {
-    size_t count = 0;
-    size_t N = mtrain_.nonZeros();
     U_.resize(mtrain_.rows(), ncluster);
     V_.resize(ncluster, mtrain_.cols());
+    Y_.resize(ncluster, mtrain_.cols());
     set_matrix_random(U_);
     set_matrix_random(V_);
-    for (size_t i = 0; i < niter; i++) {
-      for (int j = 0; j < mtrain_.outerSize(); j++) {
-        for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
-          count++;
-          double eta_2 = eta / (1 + static_cast<double>(count) / N);
-          double val = it.value() - predict_rate(it.row(), it.col());
-          U_.row(it.row()) += eta_2 * (val * V_.col(it.col()).transpose()
-                                       - lambda * U_.row(it.row()));
-          V_.col(it.col()) += eta_2 * (val * U_.row(it.row()).transpose()
-                                       - lambda * V_.col(it.col()));
-        }
-      }
-    }
+    set_matrix_random(Y_);
+    set_biases_random();
+    set_implicit_information();
+    clear_effective_vectors();
+    run_sgd(*this, niter, eta, lambda);
+    set_effective_vectors();
   }
 };
 
-
 /**
- * Matrix factorization using stochastic gradient descent with biases.
- * Biases will be updated in each iteration.
+ * Matrix factorization using alternating least squares with biases.
+ * User rows and item columns are solved alternately; each row is
+ * an independent k x k linear system, so rows are solved in parallel.
  */
-class MatrixFactorizerSgdBias : public MatrixFactorizerSgd {
- protected:
+class MatrixFactorizerAls : public MatrixFactorizer {
+ private:
+  SMatCol mtrain_col_;               ///< column-major training matrix
   std::vector<double> user_biases_;  ///< user bias
   std::vector<double> item_biases_;  ///< item bias
   double average_rate_;              ///< average value of rates
+  bool use_bias_;                    ///< use biases if true
 
-   /**
+  /**
    * Get a bias value.
    * @param user user index
    * @param item item index
    * @return a bias value
    */
   double bias(int user, int item) const {
-    assert(user < static_cast<int>(user_biases_.size()) &&
-           item < static_cast<int>(item_biases_.size()));
+    if (!use_bias_) return 0.0;
     return average_rate_ + user_biases_[user] + item_biases_[item];
   }
 
+  /**
+   * Solve user rows with fixed item matrix.
+   * @param users user indexes
+   * @param lambda a tuning parameter
+   */
+  void solve_users(const std::vector<int> &users, double lambda) {
+    int k = U_.cols();
+    int dim = use_bias_ ? k + 1 : k;
+    #pragma omp parallel num_threads(nthread_)
+    {
+      Eigen::MatrixXd A(dim, dim);
+      Eigen::VectorXd b(dim);
+      Eigen::VectorXd x(dim);
+      #pragma omp for schedule(dynamic, 16)
+      for (int r = 0; r < static_cast<int>(users.size()); r++) {
+        int i = users[r];
+        size_t n = 0;
+        A.setZero();
+        b.setZero();
+        x(dim - 1) = 1.0;
+        for (SMat::InnerIterator it(mtrain_, i); it; ++it) {
+          x.head(k) = V_.col(it.col()).cast<double>();
+          double rate = it.value();
+          if (use_bias_) rate -= average_rate_ + item_biases_[it.col()];
+          A.selfadjointView<Eigen::Lower>().rankUpdate(x);
+          b += rate * x;
+          n++;
+        }
+        if (n == 0) continue;
+        A.diagonal().array() += lambda * n;
+        x = A.selfadjointView<Eigen::Lower>().ldlt().solve(b);
+        U_.row(i) = x.head(k).cast<float>().transpose();
+        if (use_bias_) user_biases_[i] = x(k);
+      }
+    }
+  }
+
+  /**
+   * Solve item columns with fixed user matrix.
+   * @param items item indexes
+   * @param lambda a tuning parameter
+   */
+  void solve_items(const std::vector<int> &items, double lambda) {
+    int k = V_.rows();
+    int dim = use_bias_ ? k + 1 : k;
+    #pragma omp parallel num_threads(nthread_)
+    {
+      Eigen::MatrixXd A(dim, dim);
+      Eigen::VectorXd b(dim);
+      Eigen::VectorXd x(dim);
+      #pragma omp for schedule(dynamic, 16)
+      for (int c = 0; c < static_cast<int>(items.size()); c++) {
+        int j = items[c];
+        size_t n = 0;
+        A.setZero();
+        b.setZero();
+        x(dim - 1) = 1.0;
+        for (SMatCol::InnerIterator it(mtrain_col_, j); it; ++it) {
+          x.head(k) = U_.row(it.row()).transpose().cast<double>();
+          double rate = it.value();
+          if (use_bias_) rate -= average_rate_ + user_biases_[it.row()];
+          A.selfadjointView<Eigen::Lower>().rankUpdate(x);
+          b += rate * x;
+          n++;
+        }
+        if (n == 0) continue;
+        A.diagonal().array() += lambda * n;
+        x = A.selfadjointView<Eigen::Lower>().ldlt().solve(b);
+        V_.col(j) = x.head(k).cast<float>();
+        if (use_bias_) item_biases_[j] = x(k);
+      }
+    }
+  }
+
+ protected:
   /**
    * Predict a rate using user matrix and item matrix.
    * @param user user index
@@ -454,177 +2458,419 @@ class MatrixFactorizerSgdBias : public MatrixFactorizerSgd {
   }
 
   /**
-   * Set random values to the biases of users and items
+   * Write the parameters of the model.
+   * @param fp output file
    */
-  void set_biases_random() {
-    user_biases_.resize(mtrain_.rows());
-    item_biases_.resize(mtrain_.cols());
-    for (int i = 0; i < mtrain_.rows(); i++) {
-      user_biases_[i] = static_cast<double>(rand()) / RAND_MAX;
+  void write_model(FILE *fp) const {
+    MatrixFactorizer::write_model(fp);
+    uint32_t use_bias = use_bias_;
+    write_data(fp, &use_bias, sizeof(use_bias));
+    write_data(fp, &average_rate_, sizeof(average_rate_));
+    write_vector(fp, user_biases_);
+    write_vector(fp, item_biases_);
+  }
+
+  /**
+   * Read the parameters of the model.
+   * @param p current position
+   * @param end end of the file
+   * @return position after the parameters
+   */
+  const char *read_model(const char *p, const char *end) {
+    p = MatrixFactorizer::read_model(p, end);
+    uint32_t use_bias;
+    p = read_data(p, end, &use_bias, sizeof(use_bias));
+    use_bias_ = use_bias;
+    p = read_data(p, end, &average_rate_, sizeof(average_rate_));
+    p = read_vector(p, end, user_biases_);
+    p = read_vector(p, end, item_biases_);
+    mtrain_col_ = mtrain_;
+    return p;
+  }
+
+  /**
+   * Grow the factors and the biases for new users and items.
+   * Biases of new users and items are set to zero.
+   * @param users the number of users
+   * @param items the number of items
+   */
+  void resize_model(int users, int items) {
+    MatrixFactorizer::resize_model(users, items);
+    if (users > static_cast<int>(user_biases_.size())) {
+      user_biases_.resize(users, 0.0);
     }
-    for (int i = 0; i < mtrain_.cols(); i++) {
-      item_biases_[i] = static_cast<double>(rand()) / RAND_MAX;
+    if (items > static_cast<int>(item_biases_.size())) {
+      item_biases_.resize(items, 0.0);
+    }
+  }
+
+  /**
+   * Solve the rows of users and the columns of items which have
+   * new ratings.
+   * @param users indexes of the users who have new ratings
+   * @param items indexes of the items which have new ratings
+   * @param new_item index of the first item added by the new ratings
+   * @param niter the number of sweeps
+   * @param eta not used
+   * @param lambda a tuning parameter
+   */
+  void refine(const std::vector<int> &users, const std::vector<int> &items,
+              int new_item, size_t niter, double eta, double lambda) {
+    mtrain_col_ = mtrain_;
+    for (size_t i = 0; i < niter; i++) {
+      solve_users(users, lambda);
+      solve_items(items, lambda);
     }
   }
 
  public:
+  /**
+   * Get the offset of a user (average rate and user bias).
+   * @param user user index
+   * @return offset value
+   */
+  double user_offset(int user) const {
+    return use_bias_ ? average_rate_ + user_biases_[user] : 0.0;
+  }
+
+  /**
+   * Get the offset of an item (item bias).
+   * @param item item index
+   * @return offset value
+   */
+  double item_offset(int item) const {
+    return use_bias_ ? item_biases_[item] : 0.0;
+  }
+
   /**
    * Constructor.
+   * @param use_bias use biases of users and items if true
    */
-  MatrixFactorizerSgdBias() : average_rate_(0.0) { }
+  MatrixFactorizerAls(bool use_bias = true)
+    : average_rate_(0.0), use_bias_(use_bias) { }
 
   /**
    * Destructor.
    */
-  ~MatrixFactorizerSgdBias() { }
+  ~MatrixFactorizerAls() { }
 
   /**
-   * Read a training file.
-   * @param filename training file
+   * Get the type of the model.
+   * @return ModelType
    */
-  void train(const char *filename) {
-    read_file(filename, mtrain_);
-    average_rate_ = matrix_average(mtrain_);
+  int model_type() const {
+    return MODEL_ALS;
+  }
+
+  /**
+   * Use a rating matrix as the training matrix (swapped with mat).
+   * @param mat training matrix
+   */
+  void train_matrix(SMat &mat) {
+    mtrain_.swap(mat);
+    mtrain_col_ = mtrain_;
+    average_rate_ = use_bias_ ? matrix_average(mtrain_) : 0.0;
   }
 
   /**
    * Factorize a training matrix.
    * @param ncluster the number of clusters
-   * @param niter the number of iterations
-   * @param eta a tuning parameter
-   * @param lambda a tuning parameter
+   * @param niter the number of sweeps
+   * @param eta not used (ALS has no learning rate)
+   * @param lambda a tuning parameter (weighted by the number of rates)
    */
   void factorize(size_t ncluster, size_t niter, double eta, double lambda) {
-    size_t count = 0;
-    size_t N = mtrain_.nonZeros();
     U_.resize(mtrain_.rows(), ncluster);
     V_.resize(ncluster, mtrain_.cols());
     set_matrix_random(U_);
     set_matrix_random(V_);
-    set_biases_random();
+    user_biases_.assign(mtrain_.rows(), 0.0);
+    item_biases_.assign(mtrain_.cols(), 0.0);
+    std::vector<int> users(mtrain_.rows());
+    for (int i = 0; i < mtrain_.rows(); i++) users[i] = i;
+    std::vector<int> items(mtrain_.cols());
+    for (int j = 0; j < mtrain_.cols(); j++) items[j] = j;
+    begin_training();
     for (size_t i = 0; i < niter; i++) {
-      for (int j = 0; j < mtrain_.outerSize(); j++) {
-        for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
-          count++;
-          double eta_2 = eta / (1 + static_cast<double>(count) / N);
-          double val = it.value() - predict_rate(it.row(), it.col());
-          U_.row(it.row()) += eta_2 * (val * V_.col(it.col()).transpose()
-                                       - lambda * U_.row(it.row()));
-          V_.col(it.col()) += eta_2 * (val * U_.row(it.row()).transpose()
-                                       - lambda * V_.col(it.col()));
-          average_rate_ += eta_2 * val;
-          user_biases_[it.row()] +=
-            eta_2 * (val - lambda * user_biases_[it.row()]);
-          item_biases_[it.col()] +=
-            eta_2 * (val - lambda * item_biases_[it.col()]);
-        }
-      }
+      double start = get_time();
+      solve_users(users, lambda);
+      solve_items(items, lambda);
+      if (log_epochs_ && log_epoch(i, get_time() - start)) break;
     }
   }
 };
 
 /**
- * SVD++
- * Matrix factorization using stochastic gradient descent with biases
- * and implicit information (rental hisotry, ..)
+ * Matrix factorization of implicit feedback using weighted alternating
+ * least squares. Every user and item pair has a preference (1 if rated,
+ * otherwise 0) with a confidence 1 + alpha * rate, so the loss covers
+ * all the zero entries of the matrix. The zero entries are never
+ * materialised: the Gram matrix of the fixed side (k x k) stands for
+ * all the pairs with confidence 1, and only the rated pairs add their
+ * extra confidence. Each row is solved with a few steps of conjugate
+ * gradient from the previous solution, in parallel over rows.
  */
-class MatrixFactorizerSvdpp : public MatrixFactorizerSgdBias {
+class MatrixFactorizerImplicitAls : public MatrixFactorizer {
  private:
-  typedef std::vector<std::vector<int> > Implicit;
-  Implicit implicit_;  ///< impclit information
-  Mat Y_;              ///< bias of impclit information
+  SMatCol mtrain_col_;  ///< column-major training matrix
+  double alpha_;        ///< scale of confidence
+  size_t ncg_;          ///< conjugate gradient steps (0: exact solve)
 
   /**
-   * Set implicit information
+   * Solve a row of weighted least squares.
+   *   (G + sum_i (c_i - 1) y_i y_i^T + lambda I) x = sum_i c_i y_i
+   * @param gram Gram matrix G of the fixed side (k x k)
+   * @param ys fixed vectors y_i of the rated pairs (k x n)
+   * @param cs confidences c_i of the rated pairs (n)
+   * @param lambda a tuning parameter
+   * @param x current solution (updated)
    */
-  void set_implicit_information() {
-    implicit_.resize(mtrain_.rows());
-    for (int j = 0; j < mtrain_.outerSize(); j++) {
-      for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
-        implicit_[it.row()].push_back(it.col());
+  void solve_row(const Eigen::MatrixXf &gram, const Eigen::MatrixXf &ys,
+                 const Eigen::VectorXf &cs, double lambda,
+                 Eigen::VectorXf &x) const {
+    float l = lambda;
+    if (ncg_ == 0) {
+      Eigen::MatrixXf A = gram;
+      A.diagonal().array() += l;
+      A.noalias() += ys * (cs.array() - 1.0f).matrix().asDiagonal() *
+        ys.transpose();
+      x = A.ldlt().solve(ys * cs);
+      return;
+    }
+    Eigen::VectorXf w(cs.size());
+    Eigen::VectorXf ap(x.size());
+    w.noalias() = ys.transpose() * x;
+    Eigen::VectorXf r = ys * (cs.array() - (cs.array() - 1.0f) *
+                              w.array()).matrix();
+    r.noalias() -= gram * x;
+    r -= l * x;
+    Eigen::VectorXf p = r;
+    float rsold = r.squaredNorm();
+    for (size_t t = 0; t < ncg_ && rsold > 1e-10f; t++) {
+      w.noalias() = ys.transpose() * p;
+      w.array() *= cs.array() - 1.0f;
+      ap.noalias() = gram * p;
+      ap.noalias() += ys * w;
+      ap += l * p;
+      float a = rsold / p.dot(ap);
+      x += a * p;
+      r -= a * ap;
+      float rsnew = r.squaredNorm();
+      p = r + (rsnew / rsold) * p;
+      rsold = rsnew;
+    }
+  }
+
+  /**
+   * Solve user rows with fixed item matrix.
+   * @param users user indexes
+   * @param lambda a tuning parameter
+   */
+  void solve_users(const std::vector<int> &users, double lambda) {
+    int k = U_.cols();
+    Eigen::MatrixXf gram = V_ * V_.transpose();
+    #pragma omp parallel num_threads(nthread_)
+    {
+      Eigen::MatrixXf ys;
+      Eigen::VectorXf cs;
+      Eigen::VectorXf x(k);
+      #pragma omp for schedule(dynamic, 16)
+      for (int r = 0; r < static_cast<int>(users.size()); r++) {
+        int i = users[r];
+        int n = mtrain_.outerIndexPtr()[i+1] - mtrain_.outerIndexPtr()[i];
+        ys.resize(k, n);
+        cs.resize(n);
+        n = 0;
+        for (SMat::InnerIterator it(mtrain_, i); it; ++it, ++n) {
+          ys.col(n) = V_.col(it.col());
+          cs(n) = 1.0 + alpha_ * it.value();
+        }
+        x = U_.row(i).transpose();
+        solve_row(gram, ys, cs, lambda, x);
+        U_.row(i) = x.transpose();
       }
     }
   }
 
   /**
-   * Get the bias values of implicit information
-   * @param user user index
-   * @return the vector of implicit bias
+   * Solve item columns with fixed user matrix.
+   * @param items item indexes
+   * @param lambda a tuning parameter
    */
-  Eigen::VectorXf implicit_value(int user) const {
-    Eigen::VectorXf vec = Eigen::VectorXf::Zero(Y_.rows());
-    if (implicit_[user].size() == 0) return vec;
-    for (size_t i = 0; i < implicit_[user].size(); i++) {
-      vec += Y_.col(implicit_[user][i]);
+  void solve_items(const std::vector<int> &items, double lambda) {
+    int k = V_.rows();
+    Eigen::MatrixXf gram = U_.transpose() * U_;
+    #pragma omp parallel num_threads(nthread_)
+    {
+      Eigen::MatrixXf ys;
+      Eigen::VectorXf cs;
+      Eigen::VectorXf x(k);
+      #pragma omp for schedule(dynamic, 16)
+      for (int c = 0; c < static_cast<int>(items.size()); c++) {
+        int j = items[c];
+        int n = mtrain_col_.outerIndexPtr()[j+1] -
+          mtrain_col_.outerIndexPtr()[j];
+        ys.resize(k, n);
+        cs.resize(n);
+        n = 0;
+        for (SMatCol::InnerIterator it(mtrain_col_, j); it; ++it, ++n) {
+          ys.col(n) = U_.row(it.row()).transpose();
+          cs(n) = 1.0 + alpha_ * it.value();
+        }
+        x = V_.col(j);
+        solve_row(gram, ys, cs, lambda, x);
+        V_.col(j) = x;
+      }
     }
-    vec *= pow(static_cast<double>(implicit_[user].size()), -0.5);
-    return vec;
   }
 
  protected:
   /**
-   * Predict a rate using user matrix and item matrix.
+   * Predict a preference using user matrix and item matrix.
    * @param user user index
    * @param item item index
-   * @return a rate
-   */ 
+   * @return a preference (close to 1 if the user likes the item)
+   */
   double predict_rate(int user, int item) const {
-    return bias(user, item) + V_.col(item).transpose().dot(
-      U_.row(user).transpose() + implicit_value(user));
-//    double rate = bias(user, item) + V_.col(item).transpose().dot(
-//      U_.row(user).transpose() + implicit_value(user));
-//    return (rate > 5.0) ? 5.0 : (rate < 3.0) ? 3.0 : rate;
+    assert(user < U_.rows() && item < V_.cols());
+    return U_.row(user).dot(V_.col(item));
+  }
+
+  /**
+   * Get the preference of a rate.
+   * @param rate rate in a rating matrix
+   * @return 1 if rated, otherwise 0
+   */
+  double preference(double rate) const {
+    return rate > 0 ? 1.0 : 0.0;
+  }
+
+  /**
+   * Write the parameters of the model.
+   * @param fp output file
+   */
+  void write_model(FILE *fp) const {
+    MatrixFactorizer::write_model(fp);
+    write_data(fp, &alpha_, sizeof(alpha_));
+  }
+
+  /**
+   * Read the parameters of the model.
+   * @param p current position
+   * @param end end of the file
+   * @return position after the parameters
+   */
+  const char *read_model(const char *p, const char *end) {
+    p = MatrixFactorizer::read_model(p, end);
+    p = read_data(p, end, &alpha_, sizeof(alpha_));
+    mtrain_col_ = mtrain_;
+    return p;
+  }
+
+  /**
+   * Solve the rows of users and the columns of items which have
+   * new ratings.
+   * @param users indexes of the users who have new ratings
+   * @param items indexes of the items which have new ratings
+   * @param new_item index of the first item added by the new ratings
+   * @param niter the number of sweeps
+   * @param eta not used (alpha of the model is kept)
+   * @param lambda a tuning parameter
+   */
+  void refine(const std::vector<int> &users, const std::vector<int> &items,
+              int new_item, size_t niter, double eta, double lambda) {
+    mtrain_col_ = mtrain_;
+    for (size_t i = 0; i < niter; i++) {
+      solve_users(users, lambda);
+      solve_items(items, lambda);
+    }
   }
 
  public:
+  /**
+   * Constructor.
+   * @param ncg the number of conjugate gradient steps for each row
+   *            (0 to solve rows exactly with Cholesky decomposition)
+   */
+  MatrixFactorizerImplicitAls(size_t ncg = 3)
+    : alpha_(1.0), ncg_(ncg) { }
+
+  /**
+   * Destructor.
+   */
+  ~MatrixFactorizerImplicitAls() { }
+
+  /**
+   * Get the type of the model.
+   * @return ModelType
+   */
+  int model_type() const {
+    return MODEL_IMPLICIT;
+  }
+
+  /**
+   * Set the number of conjugate gradient steps for each row.
+   * @param ncg the number of steps (0 to solve rows exactly)
+   */
+  void set_cg_steps(size_t ncg) {
+    ncg_ = ncg;
+  }
+
+  /**
+   * Use a rating matrix as the training matrix (swapped with mat).
+   * Values are counts (or any positive weights) of implicit feedback.
+   * @param mat training matrix
+   */
+  void train_matrix(SMat &mat) {
+    mtrain_.swap(mat);
+    mtrain_col_ = mtrain_;
+  }
+
   /**
    * Factorize a training matrix.
    * @param ncluster the number of clusters
-   * @param niter the number of iterations
-   * @param eta a tuning parameter
+   * @param niter the number of sweeps
+   * @param eta alpha, the scale of confidence (1 + alpha * rate)
    * @param lambda a tuning parameter
    */
   void factorize(size_t ncluster, size_t niter, double eta, double lambda) {
-    size_t count = 0;
-    size_t N = mtrain_.nonZeros();
+    alpha_ = eta;
     U_.resize(mtrain_.rows(), ncluster);
     V_.resize(ncluster, mtrain_.cols());
-    Y_.resize(ncluster, mtrain_.cols());
     set_matrix_random(U_);
     set_matrix_random(V_);
-    set_matrix_random(Y_);
-    set_biases_random();
-    set_implicit_information();
+    U_ *= 0.1;
+    V_ *= 0.1;
+    U_.row(0).setZero();
+    V_.col(0).setZero();
+    std::vector<int> users(mtrain_.rows());
+    for (int i = 0; i < mtrain_.rows(); i++) users[i] = i;
+    std::vector<int> items(mtrain_.cols());
+    for (int j = 0; j < mtrain_.cols(); j++) items[j] = j;
+    begin_training();
     for (size_t i = 0; i < niter; i++) {
-      for (int j = 0; j < mtrain_.outerSize(); j++) {
-        for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
-          Eigen::VectorXf vec = implicit_value(it.row());
-          count++;
-          double eta_2 = eta / (1 + static_cast<double>(count) / N);
-          double val = it.value() - predict_rate(it.row(), it.col());
-
-          U_.row(it.row()) += eta_2 * (val * V_.col(it.col()).transpose()
-                                       - lambda * U_.row(it.row()));
-          V_.col(it.col()) +=
-            eta_2 * (val * (U_.row(it.row()).transpose() + vec)
-                     - lambda * V_.col(it.col()));
-          average_rate_ += eta_2 * val;
-          user_biases_[it.row()] +=
-            eta_2 * (val - lambda * user_biases_[it.row()]);
-          item_biases_[it.col()] +=
-            eta_2 * (val - lambda * item_biases_[it.col()]);
-          double coeff = pow(implicit_[it.row()].size(), -0.5);
-          for (size_t k = 0; k < implicit_[it.row()].size(); k++) {
-            Y_.col(implicit_[it.row()][k]) +=
-              eta_2 * (val * coeff * V_.col(it.col())
-                - lambda / 2.0 * Y_.col(implicit_[it.row()][k]));
-          }
-        }
-      }
+      double start = get_time();
+      solve_users(users, lambda);
+      solve_items(items, lambda);
+      if (log_epochs_ && log_epoch(i, get_time() - start)) break;
     }
   }
 };
 
+/**
+ * Create a factorizer of a model type.
+ * @param type ModelType
+ * @return new factorizer (NULL if the type is unknown)
+ */
+MatrixFactorizer *create_factorizer(int type);
+
+/**
+ * Load a model of any type from a binary file.
+ * @param filename model file
+ * @return new factorizer holding the model
+ */
+MatrixFactorizer *load_factorizer(const char *filename);
+
 } /* namespace mf */
 
 #endif  // MF_FACTORIZER_H_ 
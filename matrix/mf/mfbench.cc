@@ -0,0 +1,324 @@
+//
+// Benchmark of matrix factorization on synthetic ratings
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <omp.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "factorizer.h"
+#include "rating.h"
+
+/* constants */
+const unsigned int BENCH_SEED = 1;   ///< seed of synthetic ratings
+const int BENCH_TEST_STEP = 10;      ///< every n-th rating is a test rating
+const int BENCH_TOPN_USERS = 10000;  ///< max users of the top-N stage
+const size_t BENCH_TOPN = 10;        ///< n of top-N items
+const double BENCH_ETA = 0.01;       ///< learning rate of epochs
+const double BENCH_LAMBDA = 0.02;    ///< regularization of epochs
+
+/**
+ * Timing of a stage.
+ */
+struct BenchResult {
+  std::string stage;  ///< name of the stage
+  size_t nthread;     ///< the number of threads
+  double seconds;     ///< elapsed time
+  double count;       ///< processed ratings or users
+  std::string unit;   ///< unit of throughput
+  double rss;         ///< peak RSS of the process so far (MB)
+};
+
+/* function prototypes */
+int main(int argc, char **argv);
+static void usage(const char *progname);
+static double peak_rss();
+static void add_result(const char *stage, size_t nthread, double seconds,
+                       double count, const char *unit,
+                       std::vector<BenchResult> &results);
+static void split_test_matrix(const mf::SMat &mat, mf::SMat &train,
+                              mf::SMat &test);
+static void write_text_rating_file(const char *filename,
+                                   const mf::SMat &mat);
+template<typename Factorizer>
+static void bench_epoch(const char *stage, const char *filename,
+                        size_t ncluster, const std::vector<size_t> &threads,
+                        std::vector<BenchResult> &results);
+static void print_json(int nuser, int nitem, double density, double skew,
+                       size_t ncluster, size_t nrating, size_t ntest,
+                       const std::vector<BenchResult> &results);
+
+int main(int argc, char **argv) {
+  if (argc < 5 || argc > 7) usage(argv[0]);
+  int nuser       = atoi(argv[1]);
+  int nitem       = atoi(argv[2]);
+  double density  = atof(argv[3]);
+  double skew     = atof(argv[4]);
+  size_t ncluster = argc >= 6 ? atoi(argv[5]) : 16;
+  size_t maxthread = argc >= 7 ? atoi(argv[6])
+    : sysconf(_SC_NPROCESSORS_ONLN);
+  if (nuser <= 0 || nitem <= 0 || density <= 0 || ncluster == 0) {
+    usage(argv[0]);
+  }
+  if (maxthread == 0) maxthread = 1;
+  std::vector<size_t> threads;
+  for (size_t t = 1; t < maxthread; t *= 2) threads.push_back(t);
+  threads.push_back(maxthread);
+  std::vector<BenchResult> results;
+
+  // generate ratings
+  mf::SMat mat, train, test;
+  double start = mf::get_time();
+  mf::generate_rating_matrix(nuser, nitem, density, skew, BENCH_SEED, mat);
+  add_result("generate", maxthread, mf::get_time() - start,
+             mat.nonZeros(), "ratings/sec", results);
+  split_test_matrix(mat, train, test);
+  mf::SMat().swap(mat);
+
+  char dirname[] = "/tmp/mfbench.XXXXXX";
+  if (mkdtemp(dirname) == NULL) {
+    fprintf(stderr, "[Error] cannot make a temporary directory\n");
+    exit(1);
+  }
+  std::string textname = std::string(dirname) + "/train.tsv";
+  std::string binname = std::string(dirname) + "/train.bin";
+  std::string testname = std::string(dirname) + "/test.bin";
+  write_text_rating_file(textname.c_str(), train);
+  mf::write_binary_rating_file(binname.c_str(), train);
+  mf::write_binary_rating_file(testname.c_str(), test);
+  size_t nrating = train.nonZeros();
+  size_t ntest = test.nonZeros();
+  mf::SMat().swap(train);
+  mf::SMat().swap(test);
+
+  // read_file
+  for (size_t t = 0; t < threads.size(); t++) {
+    omp_set_num_threads(threads[t]);
+    mf::SMat tmp;
+    start = mf::get_time();
+    mf::read_rating_file(textname.c_str(), tmp);
+    add_result("read_text", threads[t], mf::get_time() - start, nrating,
+               "ratings/sec", results);
+  }
+  {
+    mf::SMat tmp;
+    start = mf::get_time();
+    mf::read_rating_file(binname.c_str(), tmp);
+    add_result("read_binary", 1, mf::get_time() - start, nrating,
+               "ratings/sec", results);
+  }
+
+  // one epoch of each factorizer
+  bench_epoch<mf::MatrixFactorizerSgd>("epoch_sgd", binname.c_str(),
+                                       ncluster, threads, results);
+  bench_epoch<mf::MatrixFactorizerSgdBias>("epoch_sgd_bias", binname.c_str(),
+                                           ncluster, threads, results);
+  bench_epoch<mf::MatrixFactorizerSvdpp>("epoch_svdpp", binname.c_str(),
+                                         ncluster, threads, results);
+
+  // test and top-N of a model
+  mf::MatrixFactorizerSgdBias model;
+  model.set_num_threads(maxthread);
+  model.train(binname.c_str());
+  srand(BENCH_SEED);
+  model.factorize(ncluster, 1, BENCH_ETA, BENCH_LAMBDA);
+  std::vector<int> users;
+  int step = std::max(1, nuser / BENCH_TOPN_USERS);
+  for (int i = 1; i <= nuser; i += step) users.push_back(i);
+  for (size_t t = 0; t < threads.size(); t++) {
+    model.set_num_threads(threads[t]);
+    start = mf::get_time();
+    model.test(testname.c_str());
+    add_result("test", threads[t], mf::get_time() - start, ntest,
+               "ratings/sec", results);
+  }
+  for (size_t t = 0; t < threads.size(); t++) {
+    model.set_num_threads(threads[t]);
+    std::vector<mf::ItemList> items;
+    start = mf::get_time();
+    model.top_items(users, BENCH_TOPN, items);
+    add_result("top_n", threads[t], mf::get_time() - start, users.size(),
+               "users/sec", results);
+  }
+
+  unlink(textname.c_str());
+  unlink(binname.c_str());
+  unlink(testname.c_str());
+  rmdir(dirname);
+  print_json(nuser, nitem, density, skew, ncluster, nrating, ntest, results);
+  return 0;
+}
+
+/**
+ * Show usage.
+ * @param progname the name of this program
+ */
+static void usage(const char *progname) {
+  fprintf(stderr, "%s: benchmark of matrix factorization\n", progname);
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, " %% %s nuser nitem density skew [ncluster [maxthread]]\n", progname);
+  std::exit(EXIT_FAILURE);
+}
+
+/**
+ * Get the peak resident set size of this process.
+ * @return peak RSS (MB)
+ */
+static double peak_rss() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0) return 0.0;
+  return usage.ru_maxrss / 1024.0;
+}
+
+/**
+ * Add the timing of a stage.
+ * @param stage name of the stage
+ * @param nthread the number of threads
+ * @param seconds elapsed time
+ * @param count processed ratings or users
+ * @param unit unit of throughput
+ * @param results output results
+ */
+static void add_result(const char *stage, size_t nthread, double seconds,
+                       double count, const char *unit,
+                       std::vector<BenchResult> &results) {
+  BenchResult result;
+  result.stage = stage;
+  result.nthread = nthread;
+  result.seconds = seconds;
+  result.count = count;
+  result.unit = unit;
+  result.rss = peak_rss();
+  results.push_back(result);
+  fprintf(stderr, "%s (%ld threads): %.3f sec, %.0f %s\n", stage, nthread,
+          seconds, count / (seconds > 0 ? seconds : 1e-9), unit);
+}
+
+/**
+ * Split a rating matrix into training ratings and test ratings.
+ * @param mat rating matrix
+ * @param train output training matrix
+ * @param test output test matrix (every BENCH_TEST_STEP-th rating)
+ */
+static void split_test_matrix(const mf::SMat &mat, mf::SMat &train,
+                              mf::SMat &test) {
+  typedef Eigen::Triplet<int> Triplet;
+  std::vector<Triplet> train_triplets, test_triplets;
+  train_triplets.reserve(mat.nonZeros());
+  size_t k = 0;
+  for (int i = 0; i < mat.outerSize(); i++) {
+    for (mf::SMat::InnerIterator it(mat, i); it; ++it) {
+      Triplet triplet(it.row(), it.col(), it.value());
+      if (++k % BENCH_TEST_STEP == 0) {
+        test_triplets.push_back(triplet);
+      } else {
+        train_triplets.push_back(triplet);
+      }
+    }
+  }
+  train.resize(mat.rows(), mat.cols());
+  train.setFromTriplets(train_triplets.begin(), train_triplets.end());
+  test.resize(mat.rows(), mat.cols());
+  test.setFromTriplets(test_triplets.begin(), test_triplets.end());
+}
+
+/**
+ * Write a rating matrix to a text file.
+ * @param filename output file
+ * @param mat rating matrix
+ */
+static void write_text_rating_file(const char *filename,
+                                   const mf::SMat &mat) {
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  for (int i = 0; i < mat.outerSize(); i++) {
+    for (mf::SMat::InnerIterator it(mat, i); it; ++it) {
+      fprintf(fp, "%d\t%d\t%d\n", static_cast<int>(it.row()),
+              static_cast<int>(it.col()), it.value());
+    }
+  }
+  fclose(fp);
+}
+
+/**
+ * Time one epoch of a factorizer with each number of threads.
+ * @param stage name of the stage
+ * @param filename training file
+ * @param ncluster the number of clusters
+ * @param threads numbers of threads
+ * @param results output results
+ */
+template<typename Factorizer>
+static void bench_epoch(const char *stage, const char *filename,
+                        size_t ncluster, const std::vector<size_t> &threads,
+                        std::vector<BenchResult> &results) {
+  for (size_t t = 0; t < threads.size(); t++) {
+    Factorizer mf;
+    mf.set_num_threads(threads[t]);
+    mf.train(filename);
+    srand(BENCH_SEED);
+    double start = mf::get_time();
+    mf.factorize(ncluster, 1, BENCH_ETA, BENCH_LAMBDA);
+    add_result(stage, threads[t], mf::get_time() - start, mf.num_ratings(),
+               "ratings/sec", results);
+  }
+}
+
+/**
+ * Print results as JSON. The speedup of a stage is relative to its
+ * first (single-threaded) result.
+ * @param nuser the number of users
+ * @param nitem the number of items
+ * @param density the fraction of rated pairs
+ * @param skew exponent of power-law weights
+ * @param ncluster the number of clusters
+ * @param nrating the number of training ratings
+ * @param ntest the number of test ratings
+ * @param results results
+ */
+static void print_json(int nuser, int nitem, double density, double skew,
+                       size_t ncluster, size_t nrating, size_t ntest,
+                       const std::vector<BenchResult> &results) {
+  printf("{\n");
+  printf("  \"config\": {\"users\": %d, \"items\": %d, \"density\": %g, "
+         "\"skew\": %g, \"ncluster\": %ld, \"ratings\": %ld, "
+         "\"test_ratings\": %ld},\n", nuser, nitem, density, skew,
+         ncluster, nrating, ntest);
+  printf("  \"results\": [\n");
+  size_t first = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult &r = results[i];
+    if (r.stage != results[first].stage) first = i;
+    double seconds = r.seconds > 0 ? r.seconds : 1e-9;
+    printf("    {\"stage\": \"%s\", \"threads\": %ld, \"seconds\": %.6f, "
+           "\"throughput\": %.1f, \"unit\": \"%s\", \"speedup\": %.3f, "
+           "\"peak_rss_mb\": %.1f}%s\n", r.stage.c_str(), r.nthread,
+           r.seconds, r.count / seconds, r.unit.c_str(),
+           results[first].seconds / seconds, r.rss,
+           i + 1 < results.size() ? "," : "");
+  }
+  printf("  ]\n");
+  printf("}\n");
+}
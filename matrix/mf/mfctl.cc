@@ -19,35 +19,96 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
 #include <string>
+#include "dsgd.h"
 #include "factorizer.h"
+#include "mips.h"
+#include "quantize.h"
+#include "rating.h"
+#include "server.h"
+#include "shard.h"
+#include "tune.h"
 
 /* typedef */
 //typedef mf::MatrixFactorizerSvdpp MF;
+//typedef mf::MatrixFactorizerAls MF;
+//typedef mf::MatrixFactorizerImplicitAls MF;
 typedef mf::MatrixFactorizerSgdBias MF;
 
 /* constants */
 size_t MAX_RECOMMEND = 30;
+size_t EVALUATE_TOPN = 10;      ///< k of recall@k
+int NUM_EVALUATE_USERS = 1000;  ///< the number of users to be evaluated
+bool MAP_IDS = false;           ///< map external IDs to indexes (--ids)
 
 /* function prototypes */
 int main(int argc, char **argv);
 static void usage(const char *progname);
 static int run_factorize(int argc, char **argv);
+static int run_fit(int argc, char **argv);
+static int run_dsgd(int argc, char **argv);
 static int run_test(int argc, char **argv);
 static int run_mktest(int argc, char **argv);
+static int run_convert(int argc, char **argv);
+static int run_index(int argc, char **argv);
+static int run_recommend(int argc, char **argv);
+static int run_update(int argc, char **argv);
+static int run_serve(int argc, char **argv);
+static int run_client(int argc, char **argv);
+static int run_quantize(int argc, char **argv);
+static int run_shard(int argc, char **argv);
+static int run_stream(int argc, char **argv);
+static int run_tune(int argc, char **argv);
+static void save_results(const mf::MatrixFactorizer &mf,
+                         const char *dirname);
 void cross_validation(const char *dir, size_t ncluster,
                       size_t niter, double eta, double lambda);
 
 int main(int argc, char **argv) {
+  if (argc >= 2 && !strcmp(argv[1], "--ids")) {
+    MAP_IDS = true;
+    argv[1] = argv[0];
+    argv++;
+    argc--;
+  }
   if (argc < 2) usage(argv[0]);
   std::string command(argv[1]);
   if (command == "factorize") {
     return run_factorize(argc, argv);
+  } else if (command == "fit") {
+    return run_fit(argc, argv);
+  } else if (command == "dsgd") {
+    return run_dsgd(argc, argv);
   } else if (command == "test") {
     return run_test(argc, argv);
   } else if (command == "mktest") {
     return run_mktest(argc, argv);
+  } else if (command == "convert") {
+    return run_convert(argc, argv);
+  } else if (command == "index") {
+    return run_index(argc, argv);
+  } else if (command == "recommend") {
+    return run_recommend(argc, argv);
+  } else if (command == "update") {
+    return run_update(argc, argv);
+  } else if (command == "serve") {
+    return run_serve(argc, argv);
+  } else if (command == "client") {
+    return run_client(argc, argv);
+  } else if (command == "quantize") {
+    return run_quantize(argc, argv);
+  } else if (command == "shard") {
+    return run_shard(argc, argv);
+  } else if (command == "stream") {
+    return run_stream(argc, argv);
+  } else if (command == "tune") {
+    return run_tune(argc, argv);
   } else {
     usage(argv[0]);
   }
@@ -60,77 +121,547 @@ int main(int argc, char **argv) {
 static void usage(const char *progname) {
   fprintf(stderr, "%s: matrix factorization utility tool\n", progname);
   fprintf(stderr, "Usage:\n");
-  fprintf(stderr, " %% %s factorize file dir ncluster niter eta lambda\n", progname);
+  fprintf(stderr, " %% %s [--ids] command ...\n", progname);
+  fprintf(stderr, "   --ids: map user and item IDs (any strings) to indexes in factorize, fit, dsgd, test, tune and index\n");
+  fprintf(stderr, "Commands:\n");
+  fprintf(stderr, " %% %s factorize file dir ncluster niter eta lambda [nthread [order [target]]]\n", progname);
+  fprintf(stderr, " %% %s fit file validfile dir ncluster niter eta lambda rate patience [nthread]\n", progname);
+  fprintf(stderr, " %% %s dsgd file dir ncluster niter eta lambda nworker\n", progname);
   fprintf(stderr, " %% %s mktest file dir ntest\n", progname);
-  fprintf(stderr, " %% %s test dir ncluster niter eta lambda\n", progname);
+  fprintf(stderr, " %% %s test dir ncluster niter eta lambda [nworker]\n", progname);
+  fprintf(stderr, " %% %s tune dir niter nclusters etas lambdas [nworker [ntrial]]\n", progname);
+  fprintf(stderr, " %% %s convert file binfile\n", progname);
+  fprintf(stderr, " %% %s recommend model num [nthread]\n", progname);
+  fprintf(stderr, " %% %s update model file niter eta lambda [nthread]\n", progname);
+  fprintf(stderr, " %% %s serve model address [nthread]\n", progname);
+  fprintf(stderr, " %% %s client address nconnection nrequest num\n", progname);
+  fprintf(stderr, " %% %s quantize model output precision testfile [nthread]\n", progname);
+  fprintf(stderr, " %% %s shard file dir nrating\n", progname);
+  fprintf(stderr, " %% %s stream dir ncluster niter eta lambda [nthread]\n", progname);
+  fprintf(stderr, " %% %s index file dir ncluster niter eta lambda nlist nprobe [nthread]\n", progname);
   std::exit(EXIT_FAILURE);
 }
 
 
+/**
+ * Factorize an input matrix and save the results.
+ */
 static int run_factorize(int argc, char **argv) {
   const char *progname = argv[0];
-  if (argc != 8) usage(progname);
+  if (argc < 8 || argc > 11) usage(progname);
   char *filename  = argv[2];
   char *dirname   = argv[3];
   size_t ncluster = atoi(argv[4]);
   size_t niter    = atoi(argv[5]);
   double eta      = atof(argv[6]);
   double lambda   = atof(argv[7]);
+  size_t nthread  = argc >= 9 ? atoi(argv[8]) : 1;
+  std::string order(argc >= 10 ? argv[9] : "row");
+  double target   = argc >= 11 ? atof(argv[10]) : 0.0;
 
   MF mf;
+  mf.set_num_threads(nthread);
+  mf.set_id_mapping(MAP_IDS);
+  if (order == "shuffle") {
+    mf.set_training_order(mf::ORDER_SHUFFLE);
+  } else if (order != "row") {
+    usage(progname);
+  }
+  if (argc >= 10) mf.set_epoch_log(target);
   mf.train(filename);
   fprintf(stderr, "Factorizing input matrix ...\n");
+  double start = mf::get_time();
+  mf.factorize(ncluster, niter, eta, lambda);
+  double elapsed = mf::get_time() - start;
+  fprintf(stderr, "Factorized in %.2f sec (%ld threads, %.0f ratings/sec)\n",
+          elapsed, nthread, mf.num_ratings() * niter / elapsed);
+  fprintf(stderr, "Training RMSE=%.4f\n", mf.training_rmse());
+  if (target > 0) {
+    if (mf.epochs_to_target() > 0) {
+      fprintf(stderr, "Reached RMSE=%.4f in %ld epochs\n",
+              target, mf.epochs_to_target());
+    } else {
+      fprintf(stderr, "Not reached RMSE=%.4f\n", target);
+    }
+  }
+  save_results(mf, dirname);
+  return 0;
+}
+
+/**
+ * Factorize an input matrix with adaptive learning rates and early
+ * stopping on a validation file, and save the results.
+ */
+static int run_fit(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 11 && argc != 12) usage(progname);
+  char *filename  = argv[2];
+  char *validname = argv[3];
+  char *dirname   = argv[4];
+  size_t ncluster = atoi(argv[5]);
+  size_t niter    = atoi(argv[6]);
+  double eta      = atof(argv[7]);
+  double lambda   = atof(argv[8]);
+  std::string rate(argv[9]);
+  size_t patience = atoi(argv[10]);
+  size_t nthread  = argc == 12 ? atoi(argv[11]) : 1;
+
+  MF mf;
+  mf.set_num_threads(nthread);
+  mf.set_id_mapping(MAP_IDS);
+  if (rate == "adagrad") {
+    mf.set_learning_rate(mf::RATE_ADAGRAD);
+  } else if (rate == "rmsprop") {
+    mf.set_learning_rate(mf::RATE_RMSPROP);
+  } else if (rate != "decay") {
+    usage(progname);
+  }
+  mf.train(filename);
+  mf.set_validation(validname, patience);
+  fprintf(stderr, "Factorizing input matrix ...\n");
+  double start = mf::get_time();
+  mf.factorize(ncluster, niter, eta, lambda);
+  double elapsed = mf::get_time() - start;
+  fprintf(stderr, "Factorized in %.2f sec (%ld epochs)\n",
+          elapsed, mf.num_epochs());
+  fprintf(stderr, "Best validation RMSE=%.4f at epoch %ld\n",
+          mf.best_validation_rmse(), mf.best_epoch());
+  save_results(mf, dirname);
+  return 0;
+}
+
+/**
+ * Factorize an input matrix with distributed stochastic gradient descent
+ * on worker processes and save the results.
+ */
+static int run_dsgd(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 9) usage(progname);
+  char *filename  = argv[2];
+  char *dirname   = argv[3];
+  size_t ncluster = atoi(argv[4]);
+  size_t niter    = atoi(argv[5]);
+  double eta      = atof(argv[6]);
+  double lambda   = atof(argv[7]);
+  size_t nworker  = atoi(argv[8]);
+
+  mf::MatrixFactorizerDsgd mf;
+  mf.set_num_workers(nworker);
+  mf.set_id_mapping(MAP_IDS);
+  mf.train(filename);
+  fprintf(stderr, "Factorizing input matrix ...\n");
+  double start = mf::get_time();
+  mf.factorize(ncluster, niter, eta, lambda);
+  double elapsed = mf::get_time() - start;
+  fprintf(stderr, "Factorized in %.2f sec (%ld workers, %.0f ratings/sec)\n",
+          elapsed, nworker, mf.num_ratings() * niter / elapsed);
+  fprintf(stderr, "Training RMSE=%.4f\n", mf.training_rmse());
+  save_results(mf, dirname);
+  return 0;
+}
+
+/**
+ * Split an input matrix into shards of users for out-of-core training.
+ */
+static int run_shard(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 5) usage(progname);
+  char *filename = argv[2];
+  char *dirname  = argv[3];
+  size_t nrating = atol(argv[4]);
+
+  mf::RatingShardSet set;
+  double start = mf::get_time();
+  mf::split_rating_file(filename, dirname, nrating, set);
+  double elapsed = mf::get_time() - start;
+  fprintf(stderr, "Split %ld ratings (%d users, %d items) into %ld shards "
+          "in %.3f sec\n", static_cast<long>(set.nrating), set.rows,
+          set.cols, set.shards.size(), elapsed);
+  return 0;
+}
+
+/**
+ * Factorize the shards of an input matrix reading one shard at a time,
+ * and save the model into the directory of the shards.
+ */
+static int run_stream(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 7 && argc != 8) usage(progname);
+  char *dirname   = argv[2];
+  size_t ncluster = atoi(argv[3]);
+  size_t niter    = atoi(argv[4]);
+  double eta      = atof(argv[5]);
+  double lambda   = atof(argv[6]);
+  size_t nthread  = argc == 8 ? atoi(argv[7]) : 1;
+
+  mf::MatrixFactorizerSharded mf;
+  mf.set_num_threads(nthread);
+  mf.train_shards(dirname);
+  fprintf(stderr, "Factorizing %ld shards ...\n", mf.num_shards());
+  double start = mf::get_time();
   mf.factorize(ncluster, niter, eta, lambda);
+  double elapsed = mf::get_time() - start;
+  fprintf(stderr, "Factorized in %.2f sec (%ld threads, %.0f ratings/sec)\n",
+          elapsed, nthread, mf.num_ratings() * niter / elapsed);
+  char mpath[256];
+  sprintf(mpath, "%s/model.bin", dirname);
+  mf.save_model(mpath);
+  return 0;
+}
+
+/**
+ * Save a user matrix, an item matrix and recommended items.
+ * @param mf factorized model
+ * @param dirname output directory
+ */
+static void save_results(const mf::MatrixFactorizer &mf,
+                         const char *dirname) {
   fprintf(stderr, "Saving a user matirx and a item matrix ...\n");
-  char upath[256], ipath[256], rpath[256];
+  char upath[256], ipath[256], mpath[256], rpath[256];
+  double start = mf::get_time();
   sprintf(upath, "%s/usermat.tsv", dirname);
   mf.save_user_matrix(upath);
   sprintf(ipath, "%s/itemmat.tsv", dirname);
   mf.save_item_matrix(ipath);
+  double text_time = mf::get_time() - start;
+  fprintf(stderr, "Saving a model ...\n");
+  start = mf::get_time();
+  sprintf(mpath, "%s/model.bin", dirname);
+  mf.save_model(mpath);
+  double binary_time = mf::get_time() - start;
+  fprintf(stderr, "Writing time: text matrices %.3f sec, model %.3f sec\n",
+          text_time, binary_time);
   fprintf(stderr, "Saving recommend items for each user ...\n");
   sprintf(rpath, "%s/recom.tsv", dirname);
   mf.save_recommend(rpath, MAX_RECOMMEND);
+}
+
+/**
+ * Load a model and print top n items of each user.
+ */
+static int run_recommend(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 4 && argc != 5) usage(progname);
+  char *modelname = argv[2];
+  size_t num      = atoi(argv[3]);
+  size_t nthread  = argc == 5 ? atoi(argv[4]) : 1;
+
+  double start = mf::get_time();
+  mf::MatrixFactorizer *mf = mf::load_factorizer(modelname);
+  fprintf(stderr, "Loaded a model in %.3f sec\n", mf::get_time() - start);
+  if (mf->cache_bytes() > 0) {
+    fprintf(stderr, "Cached vectors: %.1f MB\n",
+            mf->cache_bytes() / 1048576.0);
+  }
+  mf->set_num_threads(nthread);
+  mf->print_top_rate(num);
+  delete mf;
+  return 0;
+}
+
+/**
+ * Fold new ratings into a model and write the model back.
+ */
+static int run_update(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 7 && argc != 8) usage(progname);
+  char *modelname = argv[2];
+  char *filename  = argv[3];
+  size_t niter    = atoi(argv[4]);
+  double eta      = atof(argv[5]);
+  double lambda   = atof(argv[6]);
+  size_t nthread  = argc == 8 ? atoi(argv[7]) : 1;
+
+  mf::MatrixFactorizer *mf = mf::load_factorizer(modelname);
+  mf->set_num_threads(nthread);
+  fprintf(stderr, "Updating a model ...\n");
+  double start = mf::get_time();
+  mf->update(filename, niter, eta, lambda);
+  fprintf(stderr, "Updated in %.3f sec (%d users, %d items)\n",
+          mf::get_time() - start, mf->num_users(), mf->num_items());
+  fprintf(stderr, "Training RMSE=%.4f\n", mf->training_rmse());
+  // write a temporary file and rename it, so that a failed write does
+  // not destroy the only copy of the model
+  std::string tmpname = std::string(modelname) + ".tmp";
+  mf->save_model(tmpname.c_str());
+  if (rename(tmpname.c_str(), modelname) != 0) {
+    fprintf(stderr, "[Error] cannot rename %s to %s: %s\n",
+            tmpname.c_str(), modelname, strerror(errno));
+    exit(1);
+  }
+  delete mf;
+  return 0;
+}
+
+/**
+ * Load a model and answer queries on a socket.
+ */
+static int run_serve(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 4 && argc != 5) usage(progname);
+  char *modelname = argv[2];
+  char *address   = argv[3];
+  size_t nthread  = argc == 5 ? atoi(argv[4]) : 1;
+
+  double start = mf::get_time();
+  mf::MatrixFactorizer *mf = mf::load_factorizer(modelname);
+  fprintf(stderr, "Loaded a model in %.3f sec\n", mf::get_time() - start);
+  if (mf->cache_bytes() > 0) {
+    fprintf(stderr, "Cached vectors: %.1f MB\n",
+            mf->cache_bytes() / 1048576.0);
+  }
+  mf::RecommendServer server(*mf, nthread);
+  server.serve(address);
+  delete mf;
+  return 0;
+}
+
+/**
+ * Send top-N queries to a server and report latencies.
+ */
+static int run_client(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 6) usage(progname);
+  char *address      = argv[2];
+  size_t nconnection = atoi(argv[3]);
+  size_t nrequest    = atoi(argv[4]);
+  size_t num         = atoi(argv[5]);
+  if (nconnection == 0 || nrequest == 0 || num == 0) usage(progname);
+
+  mf::LoadResult result;
+  mf::generate_load(address, nconnection, nrequest, num, result);
+  printf("%ld requests in %.3f sec (%ld connections, %ld errors)\n",
+         result.nrequest, result.elapsed, nconnection, result.nerror);
+  printf("QPS=%.0f p50=%.3f ms p99=%.3f ms (%.1f requests/batch)\n",
+         result.qps, result.p50, result.p99, result.batch);
+  return 0;
+}
+
+/**
+ * Quantize a model and compare it with the float model.
+ */
+static int run_quantize(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 6 && argc != 7) usage(progname);
+  char *modelname = argv[2];
+  char *outname   = argv[3];
+  std::string precision(argv[4]);
+  char *testname  = argv[5];
+  size_t nthread  = argc == 7 ? atoi(argv[6]) : 1;
+
+  mf::QuantizedModel qmodel;
+  mf::MatrixFactorizer *mf = mf::load_factorizer(modelname);
+  mf->set_num_threads(nthread);
+  int type = precision == "fp16" ? mf::PRECISION_FP16 :
+    precision == "int8" ? mf::PRECISION_INT8 : 0;
+  if (type == 0) usage(progname);
+  qmodel.build(*mf, type);
+  qmodel.save(outname);
+  qmodel.load(outname);
+  qmodel.set_num_threads(nthread);
+
+  size_t float_bytes = sizeof(float) *
+    (mf->num_users() + mf->num_items()) * mf->item_matrix().rows();
+  printf("Memory of factors: fp32 %.1f MB, %s %.1f MB (%.2fx)\n",
+         float_bytes / 1048576.0, precision.c_str(),
+         qmodel.factor_bytes() / 1048576.0,
+         static_cast<double>(float_bytes) / qmodel.factor_bytes());
+  printf("RMSE: fp32 %.4f, %s %.4f\n",
+         mf->test(testname), precision.c_str(), qmodel.test(testname));
+
+  double recall = mf->recall(testname, EVALUATE_TOPN);
+  double qrecall = qmodel.recall(testname, EVALUATE_TOPN);
+  printf("Recall@%ld: fp32 %.4f, %s %.4f\n",
+         EVALUATE_TOPN, recall, precision.c_str(), qrecall);
+
+  // agreement of top-N items and throughput
+  std::vector<int> users;
+  int step = std::max(1, mf->num_users() / NUM_EVALUATE_USERS);
+  for (int u = 1; u < mf->num_users(); u += step) users.push_back(u);
+  std::vector<mf::ItemList> exact;
+  std::vector<mf::ItemList> approx;
+  double start = mf::get_time();
+  mf->top_items(users, EVALUATE_TOPN, exact);
+  double float_time = mf::get_time() - start;
+  start = mf::get_time();
+  qmodel.top_items(users, EVALUATE_TOPN, approx);
+  double qtime = mf::get_time() - start;
+  size_t nfound = 0;
+  size_t ntotal = 0;
+  for (size_t u = 0; u < users.size(); u++) {
+    for (size_t i = 0; i < exact[u].size(); i++) {
+      for (size_t j = 0; j < approx[u].size(); j++) {
+        if (exact[u][i].first == approx[u][j].first) {
+          nfound++;
+          break;
+        }
+      }
+    }
+    ntotal += exact[u].size();
+  }
+  printf("Top-%ld overlap with fp32: %.4f (%ld users)\n", EVALUATE_TOPN,
+         ntotal ? static_cast<double>(nfound) / ntotal : 0.0, users.size());
+  printf("Throughput: fp32 %.0f users/sec, %s %.0f users/sec\n",
+         users.size() / float_time, precision.c_str(), users.size() / qtime);
+  delete mf;
   return 0;
 }
 
+/**
+ * Result of a test set of cross validation.
+ */
+struct FoldResult {
+  double rmse;    ///< RMSE
+  double recall;  ///< recall@EVALUATE_TOPN
+};
+
+/**
+ * Read the rating matrix and the fold indexes written by mktest.
+ * @param dirname directory of test sets
+ * @param ratings output rating matrix
+ * @param folds output fold index of each rating
+ * @return the number of folds (0 if dirname has no fold file)
+ */
+static size_t read_folds(const char *dirname, mf::SMat &ratings,
+                         std::vector<uint8_t> &folds) {
+  char data_path[256], fold_path[256];
+  sprintf(data_path, "%s/ratings.bin", dirname);
+  sprintf(fold_path, "%s/folds.bin", dirname);
+  struct stat st;
+  if (stat(fold_path, &st)) return 0;
+  mf::read_rating_file(data_path, ratings);
+  return mf::read_fold_file(fold_path, folds);
+}
+
+/**
+ * Get the paths of a training file and a test file (u%ld.base and
+ * u%ld.test) of a test set.
+ * @param dirname directory of test sets
+ * @param fold index of the test set (from 0)
+ * @param train_path output path of the training file
+ * @param test_path output path of the test file
+ * @return true if both files exist
+ */
+static bool fold_files(const char *dirname, size_t fold,
+                       char *train_path, char *test_path) {
+  struct stat st;
+  sprintf(train_path, "%s/u%ld.base", dirname, fold + 1);
+  sprintf(test_path, "%s/u%ld.test", dirname, fold + 1);
+  return !stat(train_path, &st) && !stat(test_path, &st);
+}
+
+/**
+ * Train a model on a test set and evaluate it.
+ * @param dirname directory of test sets
+ * @param ratings rating matrix (empty for u%ld.base and u%ld.test)
+ * @param folds fold index of each rating
+ * @param fold index of the test set
+ * @param ncluster the number of clusters
+ * @param niter the number of iterations
+ * @param eta a tuning parameter
+ * @param lambda a tuning parameter
+ * @return RMSE and recall of the test set
+ */
+static FoldResult evaluate_fold(const char *dirname, const mf::SMat &ratings,
+                                const std::vector<uint8_t> &folds,
+                                size_t fold, size_t ncluster, size_t niter,
+                                double eta, double lambda) {
+  MF mf;
+  FoldResult result;
+  if (ratings.nonZeros() > 0) {
+    mf::SMat train, test;
+    mf::split_fold(ratings, folds, fold, train, test);
+    mf.train_matrix(train);
+    mf.factorize(ncluster, niter, eta, lambda);
+    result.rmse = mf.test(test);
+    result.recall = mf.recall(test, EVALUATE_TOPN);
+  } else {
+    char train_path[256], test_path[256];
+    fold_files(dirname, fold, train_path, test_path);
+    mf.set_id_mapping(MAP_IDS);
+    mf.train(train_path);
+    mf.factorize(ncluster, niter, eta, lambda);
+    result.rmse = mf.test(test_path);
+    result.recall = mf.recall(test_path, EVALUATE_TOPN);
+  }
+  return result;
+}
+
 /**
  * Run cross validation test.
+ * Test sets are evaluated in worker processes, which share the rating
+ * matrix of mktest and mask it by fold indexes.
  */
 static int run_test(int argc, char **argv) {
   const char *progname = argv[0];
-  if (argc != 7) usage(progname);
+  if (argc != 7 && argc != 8) usage(progname);
   char *dirname   = argv[2];
   size_t ncluster = atoi(argv[3]);
   size_t niter    = atoi(argv[4]);
   double eta      = atof(argv[5]);
   double lambda   = atof(argv[6]);
+  size_t nworker  = argc == 8 ? atoi(argv[7]) : 0;
+
+  mf::SMat ratings;
+  std::vector<uint8_t> folds;
+  size_t nfold = read_folds(dirname, ratings, folds);
+  if (nfold == 0) {
+    char train_path[256], test_path[256];
+    while (fold_files(dirname, nfold, train_path, test_path)) nfold++;
+  }
+  if (nfold == 0) {
+    fprintf(stderr, "[Error] no test sets in %s\n", dirname);
+    exit(1);
+  }
+  if (nworker == 0 || nworker > nfold) nworker = nfold;
+  printf("Factorizing %ld test sets with %ld workers ...\n", nfold, nworker);
+  fflush(stdout);
 
-  size_t ntest = 0;
+  std::vector<int> fds(nfold);
+  std::vector<pid_t> pids(nfold);
   double sum = 0.0;
-  struct stat st_train;
-  struct stat st_test;
-  for (size_t i = 1; ; i++) {
-    char train_path[128], test_path[128];
-    sprintf(train_path, "%s/u%ld.base", dirname, i);
-    sprintf(test_path, "%s/u%ld.test", dirname, i);
-    if (stat(train_path, &st_train) || stat(test_path, &st_test)) break;
-    printf("Training data: %s\n", train_path);
-    printf("Test data:     %s\n", test_path);
-    MF mf;
-    mf.train(train_path);
-    printf("Factorizing input matrix ...\n");
-    mf.factorize(ncluster, niter, eta, lambda);
-    double rmse = mf.test(test_path);
-    printf("RMSE=%0.3f\n\n", rmse);
-    sum += rmse;
-    ntest++;
+  double sum_recall = 0.0;
+  for (size_t i = 0; i < nfold + nworker; i++) {
+    if (i >= nworker) {
+      size_t f = i - nworker;
+      FoldResult result;
+      mf::read_all(fds[f], &result, sizeof(result));
+      close(fds[f]);
+      int status;
+      waitpid(pids[f], &status, 0);
+      printf("Test set %ld: RMSE=%0.3f Recall@%ld=%.4f\n", f + 1,
+             result.rmse, EVALUATE_TOPN, result.recall);
+      sum += result.rmse;
+      sum_recall += result.recall;
+    }
+    if (i >= nfold) continue;
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+      fprintf(stderr, "[Error] cannot create pipe: %s\n", strerror(errno));
+      exit(1);
+    }
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      fprintf(stderr, "[Error] cannot fork: %s\n", strerror(errno));
+      exit(1);
+    } else if (pids[i] == 0) {
+      close(pipefd[0]);
+      FoldResult result = evaluate_fold(dirname, ratings, folds, i, ncluster,
+                                        niter, eta, lambda);
+      mf::write_all(pipefd[1], &result, sizeof(result));
+      _exit(0);
+    }
+    close(pipefd[1]);
+    fds[i] = pipefd[0];
   }
-  printf("Result of cross validation: RMSE=%.3f\n", sum / ntest);
+  printf("Result of cross validation: RMSE=%.3f Recall@%ld=%.4f\n",
+         sum / nfold, EVALUATE_TOPN, sum_recall / nfold);
   return 0;
 }
 
 /**
- * Make test sets to split a file into a training file and a test file.
+ * Make test sets: the rating matrix in the binary format and a fold
+ * index of each rating.
  */
 static int run_mktest(int argc, char **argv) {
   const char *progname = argv[0];
@@ -139,39 +670,219 @@ static int run_mktest(int argc, char **argv) {
   char *dirname  = argv[3];
   size_t ntest   = atoi(argv[4]);
 
-  std::ifstream ifs(filename);
-  if (!ifs) {
-    fprintf(stderr, "[Error] cannot open file: %s\n", filename);
-    exit(1);
+  mf::SMat mat;
+  if (MAP_IDS) {
+    mf::IdDictionary users, items;
+    mf::read_mapped_rating_file(filename, users, items, mat);
+  } else {
+    mf::read_rating_file(filename, mat);
   }
-  FILE *fp_trains[ntest];
-  FILE *fp_tests[ntest];
-  for (size_t i = 0; i < ntest; i++) {
-    char train_path[256], test_path[256];
-    sprintf(train_path, "%s/u%ld.base", dirname, i+1);
-    if ((fp_trains[i] = fopen(train_path, "w")) == NULL) {
-      fprintf(stderr, "[Error] cannot open file: %s\n", train_path);
-      exit(1);
-    }
-    sprintf(test_path, "%s/u%ld.test", dirname, i+1);
-    if ((fp_tests[i] = fopen(test_path, "w")) == NULL) {
-      fprintf(stderr, "[Error] cannot open file: %s\n", test_path);
-      exit(1);
+  mat.makeCompressed();
+  std::vector<uint8_t> folds;
+  mf::assign_folds(mat.nonZeros(), ntest, mf::DEFAULT_SEED, folds);
+  char data_path[256], fold_path[256];
+  sprintf(data_path, "%s/ratings.bin", dirname);
+  sprintf(fold_path, "%s/folds.bin", dirname);
+  mf::write_binary_rating_file(data_path, mat);
+  mf::write_fold_file(fold_path, ntest, folds);
+  fprintf(stderr, "Assigned %ld ratings to %ld test sets\n",
+          static_cast<size_t>(mat.nonZeros()), ntest);
+  return 0;
+}
+
+/**
+ * Parse a comma-separated list of numbers.
+ * @param s input string
+ * @param values output values
+ */
+template<typename T>
+static void parse_list(const char *s, std::vector<T> &values) {
+  std::vector<std::string> splited;
+  mf::split_string(s, ",", splited);
+  values.clear();
+  for (size_t i = 0; i < splited.size(); i++) {
+    if (!splited[i].empty()) values.push_back(atof(splited[i].c_str()));
+  }
+}
+
+/**
+ * Search hyperparameters by cross validation on worker processes.
+ */
+static int run_tune(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc < 7 || argc > 9) usage(progname);
+  char *dirname   = argv[2];
+  size_t niter    = atoi(argv[3]);
+  size_t nworker  = argc >= 8 ? atoi(argv[7])
+                              : sysconf(_SC_NPROCESSORS_ONLN);
+  size_t ntrial   = argc >= 9 ? atoi(argv[8]) : 0;
+  std::vector<size_t> nclusters;
+  std::vector<double> etas, lambdas;
+  parse_list(argv[4], nclusters);
+  parse_list(argv[5], etas);
+  parse_list(argv[6], lambdas);
+  if (nclusters.empty() || etas.empty() || lambdas.empty()) usage(progname);
+
+  MF model;
+  mf::HyperparameterTuner tuner(model.model_type());
+  tuner.set_num_workers(nworker);
+  mf::SMat ratings;
+  std::vector<uint8_t> folds;
+  size_t nfold = read_folds(dirname, ratings, folds);
+  for (size_t i = 0; i < nfold; i++) {
+    mf::SMat train, test;
+    mf::split_fold(ratings, folds, i, train, test);
+    tuner.add_fold(train, test);
+  }
+  mf::SMat().swap(ratings);
+  char train_path[256], test_path[256];
+  while (nfold == 0 && fold_files(dirname, tuner.num_folds(), train_path,
+                                  test_path)) {
+    mf::SMat train, test;
+    if (MAP_IDS) {
+      mf::IdDictionary users, items;
+      mf::read_mapped_rating_file(train_path, users, items, train);
+      mf::read_known_rating_file(test_path, users, items, test);
+    } else {
+      mf::read_rating_file(train_path, train);
+      mf::read_rating_file(test_path, test);
     }
+    tuner.add_fold(train, test);
+  }
+  if (tuner.num_folds() == 0) {
+    fprintf(stderr, "[Error] no folds in %s\n", dirname);
+    exit(1);
+  }
+
+  std::vector<mf::TuneConfig> configs;
+  if (ntrial > 0) {
+    mf::random_configs(nclusters, etas, lambdas, ntrial, mf::DEFAULT_SEED,
+                       configs);
+  } else {
+    mf::grid_configs(nclusters, etas, lambdas, configs);
   }
+  fprintf(stderr, "Running %ld trials on %ld folds with %ld workers ...\n",
+          configs.size(), tuner.num_folds(), nworker);
+  double start = mf::get_time();
+  std::vector<mf::TuneResult> results;
+  tuner.run(configs, niter, results);
+  fprintf(stderr, "Finished in %.2f sec\n", mf::get_time() - start);
 
-  std::string line;
-  while (getline(ifs, line)) {
-    size_t index = rand() % ntest;
-    for (size_t i = 0; i < ntest; i++) {
-      if (i == index) fprintf(fp_tests[i], "%s\n", line.c_str());
-      else fprintf(fp_trains[i], "%s\n", line.c_str());
+  printf("rank\tncluster\teta\tlambda\tRMSE\tfolds\tepochs\ttime\tstatus\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const mf::TuneResult &result = results[i];
+    printf("%ld\t%ld\t%g\t%g\t%.4f\t%ld\t%ld\t%.2f\t", i + 1,
+           result.config.ncluster, result.config.eta, result.config.lambda,
+           result.rmse, result.nfold, result.nepoch, result.elapsed);
+    if (result.failed) {
+      printf("failed (the worker exited)\n");
+    } else if (result.rmse - result.rmse != 0) {  // not finite
+      printf("diverged at fold %ld epoch %ld\n", result.nfold,
+             result.stopped);
+    } else if (result.stopped > 0) {
+      printf("stopped at fold %ld epoch %ld\n", result.nfold,
+             result.stopped);
+    } else {
+      printf("finished\n");
     }
   }
-  for (size_t i = 0; i < ntest; i++) {
-    fclose(fp_trains[i]);
-    fclose(fp_tests[i]);
+  return 0;
+}
+
+/**
+ * Convert a text rating file into a binary rating file.
+ */
+static int run_convert(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 4) usage(progname);
+  char *filename = argv[2];
+  char *binname  = argv[3];
+
+  mf::SMat mat;
+  double start = mf::get_time();
+  mf::read_text_rating_file(filename, mat);
+  double text_time = mf::get_time() - start;
+  mf::write_binary_rating_file(binname, mat);
+  start = mf::get_time();
+  mf::read_binary_rating_file(binname, mat);
+  double binary_time = mf::get_time() - start;
+  fprintf(stderr, "Converted %ld ratings (%ld users, %ld items)\n",
+          static_cast<long>(mat.nonZeros()), static_cast<long>(mat.rows()),
+          static_cast<long>(mat.cols()));
+  fprintf(stderr, "Loading time: text %.3f sec, binary %.3f sec\n",
+          text_time, binary_time);
+  return 0;
+}
+
+/**
+ * Build an index for approximate top-N search of items and compare it
+ * with brute-force search.
+ */
+static int run_index(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 10 && argc != 11) usage(progname);
+  char *filename  = argv[2];
+  char *dirname   = argv[3];
+  size_t ncluster = atoi(argv[4]);
+  size_t niter    = atoi(argv[5]);
+  double eta      = atof(argv[6]);
+  double lambda   = atof(argv[7]);
+  size_t nlist    = atoi(argv[8]);
+  size_t nprobe   = atoi(argv[9]);
+  size_t nthread  = argc == 11 ? atoi(argv[10]) : 1;
+
+  MF mf;
+  mf.set_num_threads(nthread);
+  mf.set_id_mapping(MAP_IDS);
+  mf.train(filename);
+  fprintf(stderr, "Factorizing input matrix ...\n");
+  mf.factorize(ncluster, niter, eta, lambda);
+
+  fprintf(stderr, "Building an item index ...\n");
+  mf::MipsIndex index;
+  double start = mf::get_time();
+  index.build(mf, nlist, 10);
+  fprintf(stderr, "Built %ld lists in %.2f sec\n",
+          index.num_lists(), mf::get_time() - start);
+  char ipath[256];
+  sprintf(ipath, "%s/items.idx", dirname);
+  index.save(ipath);
+
+  // compare with brute-force search
+  int step = std::max(1, mf.num_users() / NUM_EVALUATE_USERS);
+  size_t nuser = 0;
+  size_t nfound = 0;
+  size_t ntotal = 0;
+  double brute_time = 0.0;
+  double index_time = 0.0;
+  std::vector<mf::ItemList> exact;
+  mf::ItemList approx;
+  std::vector<int> rated;
+  mf::Mat vec;
+  for (int u = 1; u < mf.num_users(); u += step) {
+    start = mf::get_time();
+    mf.top_items(u, u + 1, EVALUATE_TOPN, exact);
+    brute_time += mf::get_time() - start;
+    start = mf::get_time();
+    mf.user_vectors(u, 1, vec);
+    mf.rated_items(u, rated);
+    index.search(vec.data(), EVALUATE_TOPN, nprobe, approx, rated);
+    index_time += mf::get_time() - start;
+    for (size_t i = 0; i < exact[0].size(); i++) {
+      for (size_t j = 0; j < approx.size(); j++) {
+        if (exact[0][i].first == approx[j].first) {
+          nfound++;
+          break;
+        }
+      }
+    }
+    ntotal += exact[0].size();
+    nuser++;
   }
-  ifs.close();
+  if (nuser == 0) return 0;
+  printf("Recall@%ld=%.4f (%ld users)\n", EVALUATE_TOPN,
+         ntotal ? static_cast<double>(nfound) / ntotal : 0.0, nuser);
+  printf("Latency: brute force %.3f ms/query, index %.3f ms/query\n",
+         brute_time * 1000 / nuser, index_time * 1000 / nuser);
   return 0;
 }
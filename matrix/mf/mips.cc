@@ -0,0 +1,248 @@
+//
+// Approximate maximum inner product search of items
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <algorithm>
+#include <cstring>
+#include "mips.h"
+
+namespace mf {
+
+/* constants */
+const int MIPS_ASSIGN_BLOCK = 1024;    ///< vectors assigned at once
+const size_t MIPS_TRAIN_SAMPLE = 256;  ///< k-means samples per cluster
+
+/**
+ * Header of an index file.
+ */
+struct MipsFileHeader {
+  char magic[4];     ///< MIPS_FILE_MAGIC
+  uint32_t version;  ///< MIPS_FILE_VERSION
+  uint32_t dim;      ///< dimension of item vectors
+  uint32_t nlist;    ///< the number of clusters
+  uint64_t nitem;    ///< the number of indexed items
+};
+
+/**
+ * Assign vectors to the nearest cluster centers.
+ */
+void MipsIndex::assign_lists(const Mat &mat, std::vector<int> &assign) const {
+  assign.resize(mat.cols());
+  #pragma omp parallel
+  {
+    Mat dists;
+    #pragma omp for schedule(dynamic, 1)
+    for (int b = 0; b < mat.cols(); b += MIPS_ASSIGN_BLOCK) {
+      int n = std::min(MIPS_ASSIGN_BLOCK, static_cast<int>(mat.cols()) - b);
+      dists.noalias() = centroids_.transpose() * mat.middleCols(b, n);
+      for (int j = 0; j < n; j++) {
+        int best = 0;
+        float best_dist = 0.0;
+        for (int c = 0; c < dists.rows(); c++) {
+          float dist = centroid_norms_(c) - 2 * dists(c, j);
+          if (c == 0 || dist < best_dist) {
+            best = c;
+            best_dist = dist;
+          }
+        }
+        assign[b + j] = best;
+      }
+    }
+  }
+}
+
+/**
+ * Build an index of items of a factorized model.
+ */
+void MipsIndex::build(const MatrixFactorizer &mf, size_t nlist,
+                      size_t niter) {
+  const Mat &items = mf.item_matrix();
+  dim_ = items.rows();
+  int n = items.cols() > 1 ? items.cols() - 1 : 0;
+
+  // augmented vectors
+  Mat mat(dim_ + 2, n);
+  double max_norm = 0.0;
+  for (int j = 0; j < n; j++) {
+    mat.col(j).head(dim_) = items.col(j + 1);
+    mat(dim_, j) = mf.item_offset(j + 1);
+    double norm = mat.col(j).head(dim_ + 1).squaredNorm();
+    if (max_norm < norm) max_norm = norm;
+  }
+  for (int j = 0; j < n; j++) {
+    double norm = mat.col(j).head(dim_ + 1).squaredNorm();
+    mat(dim_ + 1, j) = sqrt(std::max(0.0, max_norm - norm));
+  }
+
+  // k-means on samples
+  if (nlist > static_cast<size_t>(n)) nlist = n;
+  if (nlist == 0) nlist = 1;
+  std::vector<int> perm(n);
+  for (int j = 0; j < n; j++) perm[j] = j;
+  size_t nsample = std::min(static_cast<size_t>(n), nlist * MIPS_TRAIN_SAMPLE);
+  for (size_t j = 0; j < nsample; j++) {
+    std::swap(perm[j], perm[j + rand() % (n - j)]);
+  }
+  Mat samples(dim_ + 2, nsample);
+  for (size_t j = 0; j < nsample; j++) samples.col(j) = mat.col(perm[j]);
+  centroids_ = Mat::Zero(dim_ + 2, nlist);
+  for (size_t c = 0; c < nlist && c < nsample; c++) {
+    centroids_.col(c) = samples.col(c);
+  }
+  std::vector<int> assign;
+  for (size_t i = 0; i < niter; i++) {
+    centroid_norms_ = centroids_.colwise().squaredNorm().transpose();
+    assign_lists(samples, assign);
+    Mat sums = Mat::Zero(dim_ + 2, nlist);
+    std::vector<size_t> counts(nlist, 0);
+    for (size_t j = 0; j < nsample; j++) {
+      sums.col(assign[j]) += samples.col(j);
+      counts[assign[j]]++;
+    }
+    for (size_t c = 0; c < nlist; c++) {
+      if (counts[c] > 0) {
+        centroids_.col(c) = sums.col(c) / counts[c];
+      } else if (nsample > 0) {
+        centroids_.col(c) = samples.col(rand() % nsample);
+      }
+    }
+  }
+  centroid_norms_ = centroids_.colwise().squaredNorm().transpose();
+
+  // inverted lists
+  assign_lists(mat, assign);
+  offsets_.assign(nlist + 1, 0);
+  for (int j = 0; j < n; j++) offsets_[assign[j] + 1]++;
+  for (size_t c = 0; c < nlist; c++) offsets_[c + 1] += offsets_[c];
+  std::vector<int> pos(offsets_.begin(), offsets_.end() - 1);
+  ids_.resize(n);
+  vectors_.resize(dim_ + 1, n);
+  for (int j = 0; j < n; j++) {
+    int p = pos[assign[j]]++;
+    ids_[p] = j + 1;
+    vectors_.col(p) = mat.col(j).head(dim_ + 1);
+  }
+}
+
+/**
+ * Search items of the largest inner products.
+ */
+void MipsIndex::search(const float *query, size_t num, size_t nprobe,
+                       ItemList &results,
+                       const std::vector<int> &exclude) const {
+  results.clear();
+  if (num == 0 || centroids_.cols() == 0) return;
+  Eigen::VectorXf q = Eigen::VectorXf::Zero(dim_ + 2);
+  q.head(dim_) = Eigen::Map<const Eigen::VectorXf>(query, dim_);
+  q(dim_) = 1.0;
+
+  // nearest clusters
+  Eigen::VectorXf dists = centroid_norms_ - 2 * centroids_.transpose() * q;
+  std::vector<std::pair<float, int> > lists(dists.size());
+  for (int c = 0; c < dists.size(); c++) {
+    lists[c] = std::pair<float, int>(dists(c), c);
+  }
+  if (nprobe > lists.size()) nprobe = lists.size();
+  std::partial_sort(lists.begin(), lists.begin() + nprobe, lists.end());
+
+  // exact inner products in the clusters
+  Eigen::VectorXf scores;
+  for (size_t i = 0; i < nprobe; i++) {
+    int c = lists[i].second;
+    int begin = offsets_[c];
+    int size = offsets_[c + 1] - begin;
+    if (size == 0) continue;
+    scores.noalias() = vectors_.middleCols(begin, size).transpose()
+      * q.head(dim_ + 1);
+    for (int j = 0; j < size; j++) {
+      int item = ids_[begin + j];
+      if (std::binary_search(exclude.begin(), exclude.end(), item)) continue;
+      push_top_item(results, num, std::pair<int, double>(item, scores(j)));
+    }
+  }
+  std::sort(results.begin(), results.end(), greater_pair<int, double>);
+}
+
+/**
+ * Save the index to a file.
+ */
+void MipsIndex::save(const char *filename) const {
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  MipsFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MIPS_FILE_MAGIC, sizeof(header.magic));
+  header.version = MIPS_FILE_VERSION;
+  header.dim = dim_;
+  header.nlist = centroids_.cols();
+  header.nitem = ids_.size();
+  if (fwrite(&header, sizeof(header), 1, fp) != 1
+      || fwrite(centroids_.data(), sizeof(float), centroids_.size(), fp)
+         != static_cast<size_t>(centroids_.size())
+      || fwrite(&offsets_[0], sizeof(int), offsets_.size(), fp)
+         != offsets_.size()
+      || (!ids_.empty()
+          && fwrite(&ids_[0], sizeof(int), ids_.size(), fp) != ids_.size())
+      || fwrite(vectors_.data(), sizeof(float), vectors_.size(), fp)
+         != static_cast<size_t>(vectors_.size())) {
+    fprintf(stderr, "[Error] cannot write %s\n", filename);
+    exit(1);
+  }
+  fclose(fp);
+}
+
+/**
+ * Load an index from a file.
+ */
+void MipsIndex::load(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  MipsFileHeader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1
+      || memcmp(header.magic, MIPS_FILE_MAGIC, sizeof(header.magic)) != 0
+      || header.version != MIPS_FILE_VERSION) {
+    fprintf(stderr, "[Error] invalid index file: %s\n", filename);
+    exit(1);
+  }
+  dim_ = header.dim;
+  centroids_.resize(dim_ + 2, header.nlist);
+  offsets_.resize(header.nlist + 1);
+  ids_.resize(header.nitem);
+  vectors_.resize(dim_ + 1, header.nitem);
+  if (fread(centroids_.data(), sizeof(float), centroids_.size(), fp)
+      != static_cast<size_t>(centroids_.size())
+      || fread(&offsets_[0], sizeof(int), offsets_.size(), fp)
+         != offsets_.size()
+      || (!ids_.empty()
+          && fread(&ids_[0], sizeof(int), ids_.size(), fp) != ids_.size())
+      || fread(vectors_.data(), sizeof(float), vectors_.size(), fp)
+         != static_cast<size_t>(vectors_.size())) {
+    fprintf(stderr, "[Error] invalid index file: %s\n", filename);
+    exit(1);
+  }
+  fclose(fp);
+  centroid_norms_ = centroids_.colwise().squaredNorm().transpose();
+}
+
+} /* namespace mf */
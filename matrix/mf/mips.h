@@ -0,0 +1,113 @@
+//
+// Approximate maximum inner product search of items
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef MF_MIPS_H_
+#define MF_MIPS_H_
+
+#include <stdint.h>
+#include <vector>
+#include "factorizer.h"
+
+namespace mf {
+
+/* constants */
+const char MIPS_FILE_MAGIC[4] = {'M', 'F', 'I', 'X'};  ///< magic number
+const uint32_t MIPS_FILE_VERSION = 1;                  ///< format version
+
+/**
+ * Inverted file index for maximum inner product search of items.
+ * An item vector v with an item offset b is augmented to
+ * x = (v, b, sqrt(M^2 - |v|^2 - b^2)) where M is the maximum norm,
+ * so that the nearest neighbors of a query (u, 1, 0) in Euclidean
+ * distance are the items of the largest inner products.
+ * Augmented items are clustered by k-means, and a query scores the
+ * items of the nprobe nearest clusters exactly.
+ */
+class MipsIndex {
+ private:
+  int dim_;                        ///< dimension of item vectors
+  Mat centroids_;                  ///< cluster centers ((dim+2) x nlist)
+  Eigen::VectorXf centroid_norms_; ///< squared norms of cluster centers
+  std::vector<int> offsets_;       ///< start of each list (nlist+1)
+  std::vector<int> ids_;           ///< item indexes in list order
+  Mat vectors_;                    ///< (v, b) in list order ((dim+1) x n)
+
+  /**
+   * Assign vectors to the nearest cluster centers.
+   * @param mat augmented vectors ((dim+2) x n)
+   * @param assign output cluster index of each vector
+   */
+  void assign_lists(const Mat &mat, std::vector<int> &assign) const;
+
+ public:
+  /**
+   * Constructor.
+   */
+  MipsIndex() : dim_(0) { }
+
+  /**
+   * Destructor.
+   */
+  ~MipsIndex() { }
+
+  /**
+   * Build an index of items of a factorized model.
+   * Item 0 is not indexed.
+   * @param mf factorized model
+   * @param nlist the number of clusters
+   * @param niter the number of k-means iterations
+   */
+  void build(const MatrixFactorizer &mf, size_t nlist, size_t niter);
+
+  /**
+   * Search items of the largest inner products.
+   * Returned rates include the item offsets but not the user offset.
+   * @param query user vector (dim values)
+   * @param num the number of items
+   * @param nprobe the number of clusters to be searched
+   * @param results output items sorted by rates
+   * @param exclude sorted item indexes to be excluded
+   */
+  void search(const float *query, size_t num, size_t nprobe,
+              ItemList &results, const std::vector<int> &exclude) const;
+
+  /**
+   * Save the index to a file.
+   * @param filename output file name
+   */
+  void save(const char *filename) const;
+
+  /**
+   * Load an index from a file.
+   * @param filename input file name
+   */
+  void load(const char *filename);
+
+  /**
+   * Get the number of clusters.
+   * @return the number of clusters
+   */
+  size_t num_lists() const {
+    return centroids_.cols();
+  }
+};
+
+} /* namespace mf */
+
+#endif  // MF_MIPS_H_
@@ -0,0 +1,550 @@
+//
+// Reduced-precision factors of matrix factorization models
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include "quantize.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace mf {
+
+/**
+ * Header of a quantized model file.
+ */
+struct QuantizedFileHeader {
+  char magic[4];       ///< QUANTIZED_FILE_MAGIC
+  uint32_t version;    ///< QUANTIZED_FILE_VERSION
+  uint32_t precision;  ///< Precision
+  uint32_t type;       ///< ModelType of the model
+  uint32_t dim;        ///< dimension of vectors
+  uint32_t nuser;      ///< the number of users
+  uint32_t nitem;      ///< the number of items
+  uint32_t ids;        ///< 1 if dictionaries of IDs follow the vectors
+  uint64_t nrated;     ///< the number of rated items
+};
+
+#if defined(__AVX2__) && defined(__F16C__) && defined(__FMA__)
+#define MF_QUANTIZE_F16C 1
+#else
+/**
+ * Table of half_to_float() for the scalar fp16 kernel.
+ */
+static struct HalfTable {
+  float values[65536];  ///< float value of each half precision bits
+  HalfTable() {
+    for (int i = 0; i < 65536; i++) {
+      values[i] = half_to_float(static_cast<uint16_t>(i));
+    }
+  }
+} half_table;
+#endif
+
+/**
+ * Convert an fp16 vector to float.
+ * @param h fp16 vector
+ * @param dim dimension
+ * @param out output float vector
+ */
+static inline void decode_fp16(const uint16_t *h, int dim, float *out) {
+  int i = 0;
+#ifdef MF_QUANTIZE_F16C
+  for (; i + 8 <= dim; i += 8) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(h + i));
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(a));
+  }
+  for (; i < dim; i++) out[i] = _cvtsh_ss(h[i]);
+#else
+  for (; i < dim; i++) out[i] = half_table.values[h[i]];
+#endif
+}
+
+/**
+ * Convert an int8 vector to float.
+ * @param q int8 vector
+ * @param scale scale of the vector
+ * @param dim dimension
+ * @param out output float vector
+ */
+static inline void decode_int8(const int8_t *q, float scale, int dim,
+                               float *out) {
+  int i = 0;
+#ifdef __AVX2__
+  __m256 s = _mm256_set1_ps(scale);
+  for (; i + 8 <= dim; i += 8) {
+    __m128i a = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(q + i));
+    __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(a));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(f, s));
+  }
+#endif
+  for (; i < dim; i++) out[i] = q[i] * scale;
+}
+
+/**
+ * Dot product of two fp16 vectors.
+ * @param u fp16 vector
+ * @param v fp16 vector
+ * @param dim dimension
+ * @return dot product
+ */
+static inline float dot_fp16(const uint16_t *u, const uint16_t *v, int dim) {
+  int i = 0;
+  float sum = 0.0;
+#ifdef MF_QUANTIZE_F16C
+  __m256 acc = _mm256_setzero_ps();
+  for (; i + 8 <= dim; i += 8) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(u + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(v + i));
+    acc = _mm256_fmadd_ps(_mm256_cvtph_ps(a), _mm256_cvtph_ps(b), acc);
+  }
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc),
+                        _mm256_extractf128_ps(acc, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  sum = _mm_cvtss_f32(s);
+  for (; i < dim; i++) sum += _cvtsh_ss(u[i]) * _cvtsh_ss(v[i]);
+#else
+  for (; i < dim; i++) {
+    sum += half_table.values[u[i]] * half_table.values[v[i]];
+  }
+#endif
+  return sum;
+}
+
+/**
+ * Dot product of two int8 vectors.
+ * @param u int8 vector
+ * @param v int8 vector
+ * @param dim dimension
+ * @return dot product
+ */
+static inline int32_t dot_int8(const int8_t *u, const int8_t *v, int dim) {
+  int i = 0;
+  int32_t sum = 0;
+#ifdef __AVX2__
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 16 <= dim; i += 16) {
+    __m256i a = _mm256_cvtepi8_epi16(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(u + i)));
+    __m256i b = _mm256_cvtepi8_epi16(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(v + i)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+  }
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                            _mm256_extracti128_si256(acc, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+  sum = _mm_cvtsi128_si32(s);
+#endif
+  for (; i < dim; i++) sum += u[i] * v[i];
+  return sum;
+}
+
+/**
+ * Quantize vectors and append them.
+ */
+void QuantizedModel::append_vectors(const Mat &mat,
+                                    std::vector<uint16_t> &out16,
+                                    std::vector<int8_t> &out8,
+                                    std::vector<float> &scales) const {
+  for (int i = 0; i < mat.rows(); i++) {
+    if (precision_ == PRECISION_FP16) {
+      for (int k = 0; k < dim_; k++) {
+        out16.push_back(float_to_half(mat(i, k)));
+      }
+    } else {
+      float scale = mat.row(i).cwiseAbs().maxCoeff() / 127;
+      if (scale == 0) scale = 1.0;
+      for (int k = 0; k < dim_; k++) {
+        float q = std::floor(mat(i, k) / scale + 0.5f);
+        out8.push_back(static_cast<int8_t>(std::max(-127.0f,
+                                                    std::min(127.0f, q))));
+      }
+      scales.push_back(scale);
+    }
+  }
+}
+
+/**
+ * Get the dot product of a user vector and an item vector.
+ */
+float QuantizedModel::dot(int user, int item) const {
+  if (precision_ == PRECISION_FP16) {
+    return dot_fp16(&users16_[static_cast<size_t>(user) * dim_],
+                    &items16_[static_cast<size_t>(item) * dim_], dim_);
+  }
+  return user_scales_[user] * item_scales_[item]
+    * dot_int8(&users8_[static_cast<size_t>(user) * dim_],
+               &items8_[static_cast<size_t>(item) * dim_], dim_);
+}
+
+/**
+ * Quantize the factors of a model.
+ */
+void QuantizedModel::build(const MatrixFactorizer &mf, int precision) {
+  precision_ = precision;
+  model_type_ = mf.model_type();
+  dim_ = mf.item_matrix().rows();
+  nuser_ = mf.num_users();
+  nitem_ = mf.num_items();
+  users16_.clear();
+  items16_.clear();
+  users8_.clear();
+  items8_.clear();
+  user_scales_.clear();
+  item_scales_.clear();
+  Mat users;
+  for (int b = 0; b < nuser_; b += QUANTIZED_USER_BLOCK) {
+    mf.user_vectors(b, std::min(QUANTIZED_USER_BLOCK, nuser_ - b), users);
+    append_vectors(users, users16_, users8_, user_scales_);
+  }
+  append_vectors(mf.item_matrix().transpose(), items16_, items8_,
+                 item_scales_);
+
+  user_offsets_.resize(nuser_);
+  item_offsets_.resize(nitem_);
+  for (int i = 0; i < nuser_; i++) user_offsets_[i] = mf.user_offset(i);
+  for (int j = 0; j < nitem_; j++) item_offsets_[j] = mf.item_offset(j);
+  rated_offsets_.assign(1, 0);
+  rated_items_.clear();
+  std::vector<int> rated;
+  for (int i = 0; i < nuser_; i++) {
+    mf.rated_items(i, rated);
+    rated_items_.insert(rated_items_.end(), rated.begin(), rated.end());
+    rated_offsets_.push_back(rated_items_.size());
+  }
+  map_ids_ = mf.maps_ids();
+  user_ids_ = mf.user_dictionary();
+  item_ids_ = mf.item_dictionary();
+}
+
+/**
+ * Get the float vector of a user or an item.
+ */
+void QuantizedModel::decode(bool user, int index, float *out) const {
+  size_t offset = static_cast<size_t>(index) * dim_;
+  if (precision_ == PRECISION_FP16) {
+    decode_fp16(user ? &users16_[offset] : &items16_[offset], dim_, out);
+  } else if (user) {
+    decode_int8(&users8_[offset], user_scales_[index], dim_, out);
+  } else {
+    decode_int8(&items8_[offset], item_scales_[index], dim_, out);
+  }
+}
+
+/**
+ * Get top n items of users by predicted rates.
+ * Quantized vectors are read from memory, and are converted to float
+ * in the cache: each block of items is converted once for a block of
+ * users, and scored with a dense matrix product.
+ */
+void QuantizedModel::top_items(const std::vector<int> &users, size_t num,
+                               std::vector<ItemList> &results) const {
+  results.assign(users.size(), ItemList());
+  if (num == 0 || users.empty()) return;
+  int nuser = users.size();
+  #pragma omp parallel num_threads(nthread_)
+  {
+    Mat queries(dim_, QUANTIZED_USER_BLOCK);
+    Mat tile(dim_, QUANTIZED_ITEM_BLOCK);
+    Mat scores;
+    std::vector<const int *> rated(QUANTIZED_USER_BLOCK);
+    std::vector<const int *> rated_end(QUANTIZED_USER_BLOCK);
+    const int *rated_items = rated_items_.empty() ? NULL : &rated_items_[0];
+    #pragma omp for schedule(dynamic, 1)
+    for (int b = 0; b < nuser; b += QUANTIZED_USER_BLOCK) {
+      int n = std::min(QUANTIZED_USER_BLOCK, nuser - b);
+      for (int u = 0; u < n; u++) {
+        int user = users[b + u];
+        rated[u] = rated_items + rated_offsets_[user];
+        rated_end[u] = rated_items + rated_offsets_[user + 1];
+        decode(true, user, queries.col(u).data());
+      }
+      for (int ib = 0; ib < nitem_; ib += QUANTIZED_ITEM_BLOCK) {
+        int nb = std::min(QUANTIZED_ITEM_BLOCK, nitem_ - ib);
+        for (int j = 0; j < nb; j++) decode(false, ib + j, tile.col(j).data());
+        scores.noalias() = tile.leftCols(nb).transpose() * queries.leftCols(n);
+        for (int u = 0; u < n; u++) {
+          ItemList &heap = results[b + u];
+          double offset = user_offsets_[users[b + u]];
+          const float *col = scores.col(u).data();
+          for (int j = (ib == 0 ? 1 : 0); j < nb; j++) {
+            int item = ib + j;
+            while (rated[u] != rated_end[u] && *rated[u] < item) ++rated[u];
+            if (rated[u] != rated_end[u] && *rated[u] == item) continue;
+            push_top_item(heap, num, std::pair<int, double>(
+              item, offset + item_offsets_[item] + col[j]));
+          }
+        }
+      }
+      for (int u = 0; u < n; u++) {
+        std::sort(results[b + u].begin(), results[b + u].end(),
+                  greater_pair<int, double>);
+      }
+    }
+  }
+}
+
+/**
+ * Read a test file (see MatrixFactorizer::read_file()).
+ */
+void QuantizedModel::read_file(const char *filename, SMat &mat) const {
+  if (map_ids_) {
+    read_known_rating_file(filename, user_ids_, item_ids_, mat);
+  } else {
+    read_rating_file(filename, mat);
+  }
+}
+
+/**
+ * Get RMSE of a test file.
+ */
+double QuantizedModel::test(const char *filename) const {
+  SMat mtest;
+  read_file(filename, mtest);
+  double sum = 0.0;
+  size_t n = 0;
+  for (int i = 0; i < mtest.outerSize() && i < nuser_; i++) {
+    for (SMat::InnerIterator it(mtest, i); it; ++it) {
+      if (it.col() >= nitem_) continue;
+      double rate = round(predict(i, it.col()));
+      double target = it.value();
+      if (model_type_ == MODEL_IMPLICIT) target = target > 0 ? 1.0 : 0.0;
+      sum += (rate - target) * (rate - target);
+      n++;
+    }
+  }
+  return n > 0 ? sqrt(sum / n) : -1;
+}
+
+/**
+ * Get recall@n of a test file.
+ */
+double QuantizedModel::recall(const char *filename, size_t num) const {
+  SMat mtest;
+  read_file(filename, mtest);
+  std::vector<int> users;
+  for (int i = 0; i < mtest.outerSize() && i < nuser_; i++) {
+    if (mtest.outerIndexPtr()[i+1] > mtest.outerIndexPtr()[i]) {
+      users.push_back(i);
+    }
+  }
+  std::vector<ItemList> results;
+  top_items(users, num, results);
+  size_t nhit = 0;
+  size_t ntest = 0;
+  for (size_t u = 0; u < users.size(); u++) {
+    const ItemList &items = results[u];
+    for (SMat::InnerIterator it(mtest, users[u]); it; ++it) {
+      for (size_t j = 0; j < items.size(); j++) {
+        if (items[j].first == it.col()) {
+          nhit++;
+          break;
+        }
+      }
+      ntest++;
+    }
+  }
+  return ntest > 0 ? static_cast<double>(nhit) / ntest : -1;
+}
+
+/**
+ * Write a vector to a file.
+ * @param fp output file
+ * @param vec vector
+ * @return true if succeeded
+ */
+template<typename T>
+static bool write_vector(FILE *fp, const std::vector<T> &vec) {
+  return vec.empty() || fwrite(&vec[0], sizeof(T), vec.size(), fp)
+    == vec.size();
+}
+
+/**
+ * Read a vector from a file.
+ * @param fp input file
+ * @param size the number of elements
+ * @param vec output vector
+ * @return true if succeeded
+ */
+template<typename T>
+static bool read_vector(FILE *fp, size_t size, std::vector<T> &vec) {
+  vec.resize(size);
+  return size == 0 || fread(&vec[0], sizeof(T), size, fp) == size;
+}
+
+/**
+ * Reserve the bytes of a vector in the rest of a file.
+ * @param count the number of elements
+ * @param size the size of an element
+ * @param avail the number of bytes left in the file
+ * @return true if the vector fits in the file
+ */
+static bool reserve_vector(uint64_t count, size_t size, uint64_t &avail) {
+  if (count > avail / size) return false;
+  avail -= count * size;
+  return true;
+}
+
+/**
+ * Check that the vectors described by a header fit in a file.
+ * @param header header of a quantized model file
+ * @param avail the number of bytes following the header
+ * @return true if the header is valid
+ */
+static bool check_header(const QuantizedFileHeader &header, uint64_t avail) {
+  if (header.dim > INT_MAX || header.nuser >= INT_MAX
+      || header.nitem > INT_MAX || header.nrated > INT_MAX) {
+    return false;
+  }
+  bool fp16 = header.precision == PRECISION_FP16;
+  uint64_t nu = static_cast<uint64_t>(header.nuser) * header.dim;
+  uint64_t ni = static_cast<uint64_t>(header.nitem) * header.dim;
+  size_t esize = fp16 ? sizeof(uint16_t) : sizeof(int8_t);
+  return reserve_vector(nu, esize, avail)
+    && reserve_vector(ni, esize, avail)
+    && reserve_vector(fp16 ? 0 : header.nuser, sizeof(float), avail)
+    && reserve_vector(fp16 ? 0 : header.nitem, sizeof(float), avail)
+    && reserve_vector(header.nuser, sizeof(float), avail)
+    && reserve_vector(header.nitem, sizeof(float), avail)
+    && reserve_vector(header.nuser + 1ULL, sizeof(int), avail)
+    && reserve_vector(header.nrated, sizeof(int), avail);
+}
+
+/**
+ * Save the model to a file.
+ */
+void QuantizedModel::save(const char *filename) const {
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  QuantizedFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, QUANTIZED_FILE_MAGIC, sizeof(header.magic));
+  header.version = QUANTIZED_FILE_VERSION;
+  header.precision = precision_;
+  header.type = model_type_;
+  header.dim = dim_;
+  header.nuser = nuser_;
+  header.nitem = nitem_;
+  header.nrated = rated_items_.size();
+  header.ids = map_ids_ ? 1 : 0;
+  if (fwrite(&header, sizeof(header), 1, fp) != 1
+      || !write_vector(fp, users16_) || !write_vector(fp, items16_)
+      || !write_vector(fp, users8_) || !write_vector(fp, items8_)
+      || !write_vector(fp, user_scales_) || !write_vector(fp, item_scales_)
+      || !write_vector(fp, user_offsets_) || !write_vector(fp, item_offsets_)
+      || !write_vector(fp, rated_offsets_) || !write_vector(fp, rated_items_)) {
+    fprintf(stderr, "[Error] cannot write %s\n", filename);
+    exit(1);
+  }
+  if (map_ids_) {
+    user_ids_.write(fp);
+    item_ids_.write(fp);
+  }
+  fclose(fp);
+}
+
+/**
+ * Load a model from a file.
+ */
+void QuantizedModel::load(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  QuantizedFileHeader header;
+  long file_size = -1;
+  if (fseek(fp, 0, SEEK_END) == 0) file_size = ftell(fp);
+  if (file_size < static_cast<long>(sizeof(header))
+      || fseek(fp, 0, SEEK_SET) != 0
+      || fread(&header, sizeof(header), 1, fp) != 1
+      || memcmp(header.magic, QUANTIZED_FILE_MAGIC, sizeof(header.magic)) != 0
+      || header.version != QUANTIZED_FILE_VERSION
+      || (header.precision != PRECISION_FP16
+          && header.precision != PRECISION_INT8)
+      || !check_header(header, file_size - sizeof(header))) {
+    fprintf(stderr, "[Error] invalid quantized model file: %s\n", filename);
+    exit(1);
+  }
+  precision_ = header.precision;
+  model_type_ = header.type;
+  dim_ = header.dim;
+  nuser_ = header.nuser;
+  nitem_ = header.nitem;
+  bool fp16 = precision_ == PRECISION_FP16;
+  size_t nu = static_cast<size_t>(nuser_) * dim_;
+  size_t ni = static_cast<size_t>(nitem_) * dim_;
+  if (!read_vector(fp, fp16 ? nu : 0, users16_)
+      || !read_vector(fp, fp16 ? ni : 0, items16_)
+      || !read_vector(fp, fp16 ? 0 : nu, users8_)
+      || !read_vector(fp, fp16 ? 0 : ni, items8_)
+      || !read_vector(fp, fp16 ? 0 : nuser_, user_scales_)
+      || !read_vector(fp, fp16 ? 0 : nitem_, item_scales_)
+      || !read_vector(fp, nuser_, user_offsets_)
+      || !read_vector(fp, nitem_, item_offsets_)
+      || !read_vector(fp, nuser_ + 1, rated_offsets_)
+      || !read_vector(fp, header.nrated, rated_items_)
+      || rated_offsets_[0] != 0
+      || static_cast<uint64_t>(rated_offsets_[nuser_]) != header.nrated) {
+    fprintf(stderr, "[Error] invalid quantized model file: %s\n", filename);
+    exit(1);
+  }
+  for (int i = 0; i < nuser_; i++) {
+    if (rated_offsets_[i] > rated_offsets_[i + 1]) {
+      fprintf(stderr, "[Error] invalid quantized model file: %s\n",
+              filename);
+      exit(1);
+    }
+  }
+  for (size_t i = 0; i < rated_items_.size(); i++) {
+    if (rated_items_[i] < 0 || rated_items_[i] >= nitem_) {
+      fprintf(stderr, "[Error] invalid quantized model file: %s\n",
+              filename);
+      exit(1);
+    }
+  }
+  map_ids_ = header.ids != 0;
+  user_ids_.clear();
+  item_ids_.clear();
+  if (map_ids_) {
+    std::vector<char> rest;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+      rest.insert(rest.end(), buf, buf + n);
+    }
+    if (rest.empty()) {
+      fprintf(stderr, "[Error] invalid quantized model file: %s\n",
+              filename);
+      exit(1);
+    }
+    const char *end = &rest[0] + rest.size();
+    item_ids_.read(user_ids_.read(&rest[0], end), end);
+  }
+  fclose(fp);
+}
+
+} /* namespace mf */
@@ -0,0 +1,1168 @@
+//
+// Rating matrix files
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include "rating.h"
+#include "util.h"
+
+namespace mf {
+
+/**
+ * Check whether a file is a binary rating file.
+ */
+bool is_binary_rating_file(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) return false;
+  char magic[4];
+  bool result = fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+    && memcmp(magic, RATING_FILE_MAGIC, sizeof(magic)) == 0;
+  fclose(fp);
+  return result;
+}
+
+/* constants */
+const size_t PARSE_CHUNK_SIZE = 4 * 1024 * 1024;  ///< bytes parsed per task
+
+/* typedef */
+typedef Eigen::Triplet<int> Triplet;
+
+/**
+ * Functor to keep the last value of duplicated ratings.
+ */
+struct LastValue {
+  int operator() (const int &, const int &b) const { return b; }
+};
+
+/**
+ * Functor to compare pairs by their first elements.
+ */
+struct FirstLess {
+  bool operator() (const std::pair<int, int> &a,
+                   const std::pair<int, int> &b) const {
+    return a.first < b.first;
+  }
+};
+
+/**
+ * Parse ratings in a newline-aligned chunk of a text file.
+ * @param p beginning of the chunk
+ * @param end end of the chunk
+ * @param triplets output (user, item, rate) triplets
+ * @param max_userid maximum user id in the chunk
+ * @param max_itemid maximum item id in the chunk
+ */
+static void parse_rating_chunk(const char *p, const char *end,
+                               std::vector<Triplet> &triplets,
+                               size_t &max_userid, size_t &max_itemid) {
+  while (p < end) {
+    const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (eol == NULL) eol = end;
+    size_t userid, itemid;
+    double rate;
+    const char *q = parse_uint(p, eol, userid);
+    if (q != p && q < eol && *q == '\t') {
+      const char *r = parse_uint(q + 1, eol, itemid);
+      if (r != q + 1 && r < eol && *r == '\t'
+          && parse_float(r + 1, eol, rate) != r + 1) {
+        triplets.push_back(Triplet(userid, itemid, static_cast<int>(rate)));
+        if (max_userid < userid) max_userid = userid;
+        if (max_itemid < itemid) max_itemid = itemid;
+      }
+    }
+    p = eol + 1;
+  }
+}
+
+/**
+ * Split a text buffer into newline-aligned chunks of about
+ * PARSE_CHUNK_SIZE bytes.
+ * @param data beginning of the buffer
+ * @param end end of the buffer
+ * @param bounds output boundaries of chunks (the number of chunks + 1)
+ */
+static void split_chunks(const char *data, const char *end,
+                         std::vector<const char *> &bounds) {
+  size_t size = end - data;
+  size_t nchunk = (size + PARSE_CHUNK_SIZE - 1) / PARSE_CHUNK_SIZE;
+  bounds.assign(nchunk + 1, end);
+  bounds[0] = data;
+  for (size_t i = 1; i < nchunk; i++) {
+    const char *p = data + i * PARSE_CHUNK_SIZE - 1;
+    if (p < bounds[i-1]) p = bounds[i-1];
+    const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+    bounds[i] = eol ? eol + 1 : end;
+  }
+}
+
+/**
+ * Map a whole text file into memory for sequential reading.
+ * @param filename input file
+ * @param size output file size
+ * @return mapped address (NULL if the file is empty)
+ */
+static void *map_text_file(const char *filename, size_t &size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "cannot open %s\n", filename);
+    exit(1);
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "[Error] cannot stat %s\n", filename);
+    exit(1);
+  }
+  size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return NULL;
+  }
+  void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "[Error] cannot mmap %s\n", filename);
+    exit(1);
+  }
+  madvise(addr, size, MADV_SEQUENTIAL);
+  return addr;
+}
+
+/**
+ * Read a rating matrix from a text file.
+ * The file is mapped into memory and newline-aligned chunks are parsed
+ * in parallel, then the matrix is built from the triplets at once.
+ */
+void read_text_rating_file(const char *filename, SMat &mat) {
+  double start = get_time();
+  size_t size;
+  void *addr = map_text_file(filename, size);
+  if (addr == NULL) {
+    mat.resize(1, 1);
+    mat.makeCompressed();
+    return;
+  }
+  const char *data = static_cast<const char *>(addr);
+  const char *end = data + size;
+
+  std::vector<const char *> bounds;
+  split_chunks(data, end, bounds);
+  size_t nchunk = bounds.size() - 1;
+
+  std::vector<std::vector<Triplet> > triplets(nchunk);
+  std::vector<size_t> max_userids(nchunk, 0);
+  std::vector<size_t> max_itemids(nchunk, 0);
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (size_t i = 0; i < nchunk; i++) {
+    triplets[i].reserve((bounds[i+1] - bounds[i]) / 8);
+    parse_rating_chunk(bounds[i], bounds[i+1], triplets[i],
+                       max_userids[i], max_itemids[i]);
+  }
+  munmap(addr, size);
+
+  size_t max_userid = 0;
+  size_t max_itemid = 0;
+  size_t nrating = 0;
+  for (size_t i = 0; i < nchunk; i++) {
+    if (max_userid < max_userids[i]) max_userid = max_userids[i];
+    if (max_itemid < max_itemids[i]) max_itemid = max_itemids[i];
+    nrating += triplets[i].size();
+  }
+  std::vector<Triplet> all;
+  all.reserve(nrating);
+  for (size_t i = 0; i < nchunk; i++) {
+    all.insert(all.end(), triplets[i].begin(), triplets[i].end());
+    std::vector<Triplet>().swap(triplets[i]);
+  }
+  mat.resize(max_userid+1, max_itemid+1);
+  mat.setFromTriplets(all.begin(), all.end(), LastValue());
+
+  double elapsed = get_time() - start;
+  fprintf(stderr, "Read %ld ratings from %s in %.3f sec (%.1f MB/s)\n",
+          static_cast<long>(mat.nonZeros()), filename, elapsed,
+          size / 1048576.0 / (elapsed > 0 ? elapsed : 1e-9));
+}
+
+/**
+ * Parse ratings of external IDs in a newline-aligned chunk of a text
+ * file. IDs are mapped to indexes of dictionaries local to the chunk.
+ * @param p beginning of the chunk
+ * @param end end of the chunk
+ * @param users output dictionary of users in the chunk
+ * @param items output dictionary of items in the chunk
+ * @param triplets output (local user, local item, rate) triplets
+ */
+static void parse_mapped_chunk(const char *p, const char *end,
+                               IdDictionary &users, IdDictionary &items,
+                               std::vector<Triplet> &triplets) {
+  while (p < end) {
+    const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (eol == NULL) eol = end;
+    const char *q = static_cast<const char *>(memchr(p, '\t', eol - p));
+    const char *r = q ? static_cast<const char *>(
+      memchr(q + 1, '\t', eol - q - 1)) : NULL;
+    double rate;
+    if (q != NULL && r != NULL && q != p && r != q + 1
+        && parse_float(r + 1, eol, rate) != r + 1) {
+      triplets.push_back(Triplet(users.add(p, q - p),
+                                 items.add(q + 1, r - q - 1),
+                                 static_cast<int>(rate)));
+    }
+    p = eol + 1;
+  }
+}
+
+/**
+ * Read a rating matrix of external IDs from a text file.
+ * Chunks are parsed in parallel with local dictionaries, which are
+ * merged into the dictionaries in the order of chunks, so indexes are
+ * given in the order of the first appearance in the file.
+ * @param filename input file
+ * @param grow_users dictionary of users to be added to (or NULL)
+ * @param grow_items dictionary of items to be added to (or NULL)
+ * @param users dictionary of users
+ * @param items dictionary of items
+ * @param mat output matrix
+ */
+static void read_mapped_text(const char *filename, IdDictionary *grow_users,
+                             IdDictionary *grow_items,
+                             const IdDictionary &users,
+                             const IdDictionary &items, SMat &mat) {
+  if (is_binary_rating_file(filename)) {
+    fprintf(stderr, "[Error] IDs of %s cannot be mapped (binary file)\n",
+            filename);
+    exit(1);
+  }
+  double start = get_time();
+  size_t size;
+  void *addr = map_text_file(filename, size);
+  std::vector<const char *> bounds(1, NULL);
+  if (addr != NULL) {
+    const char *data = static_cast<const char *>(addr);
+    split_chunks(data, data + size, bounds);
+  }
+  size_t nchunk = bounds.size() - 1;
+  std::vector<IdDictionary> chunk_users(nchunk), chunk_items(nchunk);
+  std::vector<std::vector<Triplet> > triplets(nchunk);
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (size_t i = 0; i < nchunk; i++) {
+    triplets[i].reserve((bounds[i+1] - bounds[i]) / 8);
+    parse_mapped_chunk(bounds[i], bounds[i+1], chunk_users[i],
+                       chunk_items[i], triplets[i]);
+  }
+  if (addr != NULL) munmap(addr, size);
+
+  std::vector<Triplet> all;
+  std::vector<int> user_map, item_map;
+  for (size_t i = 0; i < nchunk; i++) {
+    user_map.resize(chunk_users[i].size());
+    for (int k = 1; k < chunk_users[i].size(); k++) {
+      std::string id = chunk_users[i].id(k);
+      user_map[k] = grow_users ? grow_users->add(id.data(), id.size())
+        : users.find(id);
+    }
+    item_map.resize(chunk_items[i].size());
+    for (int k = 1; k < chunk_items[i].size(); k++) {
+      std::string id = chunk_items[i].id(k);
+      item_map[k] = grow_items ? grow_items->add(id.data(), id.size())
+        : items.find(id);
+    }
+    for (size_t j = 0; j < triplets[i].size(); j++) {
+      int user = user_map[triplets[i][j].row()];
+      int item = item_map[triplets[i][j].col()];
+      if (user < 0 || item < 0) continue;
+      all.push_back(Triplet(user, item, triplets[i][j].value()));
+    }
+    std::vector<Triplet>().swap(triplets[i]);
+    chunk_users[i].clear();
+    chunk_items[i].clear();
+  }
+  mat.resize(users.size(), items.size());
+  mat.setFromTriplets(all.begin(), all.end(), LastValue());
+
+  double elapsed = get_time() - start;
+  fprintf(stderr, "Read %ld ratings (%d users, %d items) from %s "
+          "in %.3f sec\n", static_cast<long>(mat.nonZeros()),
+          users.size() - 1, items.size() - 1, filename, elapsed);
+}
+
+/**
+ * Read a rating matrix of external IDs, adding new IDs.
+ */
+void read_mapped_rating_file(const char *filename, IdDictionary &users,
+                             IdDictionary &items, SMat &mat) {
+  read_mapped_text(filename, &users, &items, users, items, mat);
+}
+
+/**
+ * Read a rating matrix of known external IDs.
+ */
+void read_known_rating_file(const char *filename, const IdDictionary &users,
+                            const IdDictionary &items, SMat &mat) {
+  read_mapped_text(filename, NULL, NULL, users, items, mat);
+}
+
+/**
+ * Check the compressed row storage of a rating matrix.
+ */
+bool check_compressed_rows(const int32_t *outer, const int32_t *inner,
+                           int rows, int cols, int nnz) {
+  if (outer[0] != 0 || outer[rows] != nnz) return false;
+  for (int i = 0; i < rows; i++) {
+    if (outer[i+1] < outer[i] || outer[i+1] > nnz) return false;
+    for (int32_t j = outer[i]; j < outer[i+1]; j++) {
+      if (inner[j] < 0 || inner[j] >= cols) return false;
+      if (j > outer[i] && inner[j] <= inner[j-1]) return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Check the header and the compressed rows of a mapped binary rating
+ * file, so that a truncated or corrupted file is not read out of bounds.
+ * @param addr address of the mapped file
+ * @param file_size size of the file in bytes
+ * @return true if the file is valid
+ */
+static bool check_binary_rating_file(const void *addr, size_t file_size) {
+  if (file_size < sizeof(RatingFileHeader)) return false;
+  const RatingFileHeader *header =
+    static_cast<const RatingFileHeader *>(addr);
+  if (memcmp(header->magic, RATING_FILE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != RATING_FILE_VERSION
+      || header->rows > INT_MAX || header->cols > INT_MAX
+      || header->nnz > INT_MAX) {
+    return false;
+  }
+  // the counts fit in int, so the size cannot overflow
+  uint64_t size = sizeof(RatingFileHeader)
+    + sizeof(int32_t) * (header->rows + 1 + header->nnz * 2);
+  if (file_size < size) return false;
+  const int32_t *outer = reinterpret_cast<const int32_t *>(header + 1);
+  return check_compressed_rows(outer, outer + header->rows + 1,
+                               header->rows, header->cols, header->nnz);
+}
+
+/**
+ * Read a rating matrix from a binary rating file using mmap.
+ * The file is validated before it is copied into the matrix.
+ */
+void read_binary_rating_file(const char *filename, SMat &mat) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "cannot open %s\n", filename);
+    exit(1);
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0
+      || static_cast<size_t>(st.st_size) < sizeof(RatingFileHeader)) {
+    fprintf(stderr, "[Error] invalid rating file: %s\n", filename);
+    exit(1);
+  }
+  void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "[Error] cannot mmap %s\n", filename);
+    exit(1);
+  }
+  madvise(addr, st.st_size, MADV_SEQUENTIAL);
+  if (!check_binary_rating_file(addr, st.st_size)) {
+    fprintf(stderr, "[Error] invalid rating file: %s\n", filename);
+    exit(1);
+  }
+  const RatingFileHeader *header = static_cast<RatingFileHeader *>(addr);
+  const int32_t *outer = reinterpret_cast<const int32_t *>(header + 1);
+  const int32_t *inner = outer + header->rows + 1;
+  const int32_t *values = inner + header->nnz;
+  mat.resize(header->rows, header->cols);
+  mat.resizeNonZeros(header->nnz);
+  memcpy(mat.outerIndexPtr(), outer, sizeof(int32_t) * (header->rows + 1));
+  memcpy(mat.innerIndexPtr(), inner, sizeof(int32_t) * header->nnz);
+  memcpy(mat.valuePtr(), values, sizeof(int32_t) * header->nnz);
+  munmap(addr, st.st_size);
+}
+
+/**
+ * Read a rating matrix from a text file or a binary rating file.
+ */
+void read_rating_file(const char *filename, SMat &mat) {
+  if (is_binary_rating_file(filename)) {
+    read_binary_rating_file(filename, mat);
+  } else {
+    read_text_rating_file(filename, mat);
+  }
+}
+
+/**
+ * Write a rating matrix to a binary rating file.
+ */
+void write_binary_rating_file(const char *filename, const SMat &mat) {
+  SMat compressed;
+  const SMat *p = &mat;
+  if (!mat.isCompressed()) {
+    compressed = mat;
+    compressed.makeCompressed();
+    p = &compressed;
+  }
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  RatingFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RATING_FILE_MAGIC, sizeof(header.magic));
+  header.version = RATING_FILE_VERSION;
+  header.rows = p->rows();
+  header.cols = p->cols();
+  header.nnz = p->nonZeros();
+  if (fwrite(&header, sizeof(header), 1, fp) != 1
+      || fwrite(p->outerIndexPtr(), sizeof(int32_t), header.rows + 1, fp)
+         != header.rows + 1
+      || fwrite(p->innerIndexPtr(), sizeof(int32_t), header.nnz, fp)
+         != header.nnz
+      || fwrite(p->valuePtr(), sizeof(int32_t), header.nnz, fp)
+         != header.nnz) {
+    fprintf(stderr, "[Error] cannot write %s\n", filename);
+    exit(1);
+  }
+  fclose(fp);
+}
+
+/**
+ * Assign ratings to folds of cross validation at random.
+ */
+void assign_folds(size_t nrating, size_t nfold, unsigned int seed,
+                  std::vector<uint8_t> &folds) {
+  if (nfold == 0 || nfold > MAX_FOLDS) {
+    fprintf(stderr, "[Error] the number of folds must be 1 to %ld\n",
+            MAX_FOLDS);
+    exit(1);
+  }
+  folds.resize(nrating);
+  for (size_t i = 0; i < nrating; i++) {
+    folds[i] = myrand(&seed) % nfold;
+  }
+}
+
+/**
+ * Write fold indexes of ratings to a fold file.
+ */
+void write_fold_file(const char *filename, size_t nfold,
+                     const std::vector<uint8_t> &folds) {
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  FoldFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FOLD_FILE_MAGIC, sizeof(header.magic));
+  header.version = FOLD_FILE_VERSION;
+  header.nfold = nfold;
+  header.nrating = folds.size();
+  if (fwrite(&header, sizeof(header), 1, fp) != 1
+      || (!folds.empty()
+          && fwrite(&folds[0], 1, folds.size(), fp) != folds.size())) {
+    fprintf(stderr, "[Error] cannot write %s\n", filename);
+    exit(1);
+  }
+  fclose(fp);
+}
+
+/**
+ * Read fold indexes of ratings from a fold file.
+ */
+size_t read_fold_file(const char *filename, std::vector<uint8_t> &folds) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  FoldFileHeader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1
+      || memcmp(header.magic, FOLD_FILE_MAGIC, sizeof(header.magic)) != 0
+      || header.version != FOLD_FILE_VERSION) {
+    fprintf(stderr, "[Error] invalid fold file: %s\n", filename);
+    exit(1);
+  }
+  folds.resize(header.nrating);
+  if (!folds.empty()
+      && fread(&folds[0], 1, folds.size(), fp) != folds.size()) {
+    fprintf(stderr, "[Error] invalid fold file: %s\n", filename);
+    exit(1);
+  }
+  fclose(fp);
+  return header.nfold;
+}
+
+/**
+ * Split a rating matrix into the training matrix and the test matrix
+ * of a fold.
+ */
+void split_fold(const SMat &mat, const std::vector<uint8_t> &folds,
+                size_t fold, SMat &train, SMat &test) {
+  if (!mat.isCompressed()
+      || folds.size() != static_cast<size_t>(mat.nonZeros())) {
+    fprintf(stderr, "[Error] folds do not match the rating matrix\n");
+    exit(1);
+  }
+  size_t ntest = std::count(folds.begin(), folds.end(), fold);
+  train.resize(mat.rows(), mat.cols());
+  train.resizeNonZeros(folds.size() - ntest);
+  test.resize(mat.rows(), mat.cols());
+  test.resizeNonZeros(ntest);
+  const int *outer = mat.outerIndexPtr();
+  const int *inner = mat.innerIndexPtr();
+  const int *values = mat.valuePtr();
+  int *train_outer = train.outerIndexPtr();
+  int *train_inner = train.innerIndexPtr();
+  int *train_values = train.valuePtr();
+  int *test_outer = test.outerIndexPtr();
+  int *test_inner = test.innerIndexPtr();
+  int *test_values = test.valuePtr();
+  int ntrain = 0;
+  int ntested = 0;
+  train_outer[0] = 0;
+  test_outer[0] = 0;
+  for (int i = 0; i < mat.rows(); i++) {
+    for (int k = outer[i]; k < outer[i+1]; k++) {
+      if (folds[k] == fold) {
+        test_inner[ntested] = inner[k];
+        test_values[ntested++] = values[k];
+      } else {
+        train_inner[ntrain] = inner[k];
+        train_values[ntrain++] = values[k];
+      }
+    }
+    train_outer[i+1] = ntrain;
+    test_outer[i+1] = ntested;
+  }
+}
+
+/* constants */
+const size_t SPLIT_BATCH_CHUNKS = 16;         ///< chunks parsed at once
+const size_t SPLIT_BUFFER_SIZE = 256 * 1024;  ///< buffer of a shard file
+
+/**
+ * Parse a text rating file chunk by chunk in the order of the file.
+ * Batches of chunks are parsed in parallel and given to the visitor in
+ * order, and pages of parsed batches are released, so that the file
+ * is not held in memory.
+ * @param filename input file
+ * @param visitor object which has operator()(const std::vector<Triplet> &)
+ */
+template<typename Visitor>
+static void scan_text_rating_file(const char *filename, Visitor &visitor) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return;
+  }
+  void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "[Error] cannot mmap %s\n", filename);
+    exit(1);
+  }
+  madvise(addr, size, MADV_SEQUENTIAL);
+  const char *data = static_cast<const char *>(addr);
+  const char *end = data + size;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t released = 0;
+  std::vector<std::vector<Triplet> > triplets(SPLIT_BATCH_CHUNKS);
+  const char *p = data;
+  while (p < end) {
+    std::vector<const char *> bounds(1, p);
+    for (size_t i = 0; i < SPLIT_BATCH_CHUNKS && bounds.back() < end; i++) {
+      if (static_cast<size_t>(end - bounds.back()) <= PARSE_CHUNK_SIZE) {
+        bounds.push_back(end);
+        break;
+      }
+      const char *q = bounds.back() + PARSE_CHUNK_SIZE - 1;
+      const char *eol = static_cast<const char *>(memchr(q, '\n', end - q));
+      bounds.push_back(eol ? eol + 1 : end);
+    }
+    int nchunk = bounds.size() - 1;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < nchunk; i++) {
+      size_t max_userid = 0, max_itemid = 0;
+      triplets[i].clear();
+      parse_rating_chunk(bounds[i], bounds[i+1], triplets[i],
+                         max_userid, max_itemid);
+    }
+    for (int i = 0; i < nchunk; i++) visitor(triplets[i]);
+    p = bounds.back();
+    size_t done = (p - data) / page * page;
+    if (done > released) {
+      madvise(const_cast<char *>(data) + released, done - released,
+              MADV_DONTNEED);
+      released = done;
+    }
+  }
+  munmap(addr, size);
+}
+
+/**
+ * Visitor counting the ratings of each user in a text file.
+ */
+struct RatingCounter {
+  std::vector<size_t> counts;  ///< the number of ratings of each user
+  int cols;                    ///< maximum item id + 1
+
+  RatingCounter() : cols(1) { }
+
+  void operator() (const std::vector<Triplet> &triplets) {
+    for (size_t i = 0; i < triplets.size(); i++) {
+      size_t user = triplets[i].row();
+      if (user >= counts.size()) counts.resize(user + 1, 0);
+      counts[user]++;
+      if (cols <= triplets[i].col()) cols = triplets[i].col() + 1;
+    }
+  }
+};
+
+/**
+ * Visitor appending ratings of a text file to the files of shards.
+ */
+struct RatingDistributor {
+  const std::vector<int> *shard_ids;  ///< shard of each user
+  std::vector<FILE *> files;          ///< temporary file of each shard
+
+  void operator() (const std::vector<Triplet> &triplets) {
+    for (size_t i = 0; i < triplets.size(); i++) {
+      Rating rating;
+      rating.user = triplets[i].row();
+      rating.item = triplets[i].col();
+      rating.rate = triplets[i].value();
+      FILE *fp = files[(*shard_ids)[rating.user]];
+      if (fwrite(&rating, sizeof(rating), 1, fp) != 1) {
+        fprintf(stderr, "[Error] cannot write a shard\n");
+        exit(1);
+      }
+    }
+  }
+};
+
+/**
+ * Set the user ranges of shards, cutting at the first user which
+ * fills shard_ratings ratings.
+ * @param counts the number of ratings of each user
+ * @param shard_ratings the number of ratings of a shard
+ * @param dirname directory of shards
+ * @param set output shards (begin, end and filename)
+ */
+static void set_shard_bounds(const std::vector<size_t> &counts,
+                             size_t shard_ratings, const char *dirname,
+                             RatingShardSet &set) {
+  set.shards.clear();
+  size_t nrating = 0;
+  int begin = 0;
+  for (size_t i = 0; i < counts.size(); i++) {
+    nrating += counts[i];
+    if (nrating >= shard_ratings || i + 1 == counts.size()) {
+      char path[1024];
+      snprintf(path, sizeof(path), "%s/shard-%04d.bin",
+               dirname, static_cast<int>(set.shards.size()));
+      RatingShard shard;
+      shard.begin = begin;
+      shard.end = i + 1;
+      shard.nrating = 0;
+      shard.filename = path;
+      set.shards.push_back(shard);
+      begin = i + 1;
+      nrating = 0;
+    }
+  }
+}
+
+/**
+ * Write the manifest of shards.
+ * @param dirname directory of shards
+ * @param set shards
+ */
+static void write_shard_manifest(const char *dirname,
+                                 const RatingShardSet &set) {
+  std::string path = std::string(dirname) + "/shards.tsv";
+  FILE *fp = fopen(path.c_str(), "w");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", path.c_str());
+    exit(1);
+  }
+  fprintf(fp, "%d\t%d\t%lu\t%.17g\n", set.rows, set.cols,
+          static_cast<unsigned long>(set.nrating), set.sum);
+  for (size_t i = 0; i < set.shards.size(); i++) {
+    const RatingShard &shard = set.shards[i];
+    const char *name = strrchr(shard.filename.c_str(), '/');
+    fprintf(fp, "%d\t%d\t%lu\t%s\n", shard.begin, shard.end,
+            static_cast<unsigned long>(shard.nrating),
+            name ? name + 1 : shard.filename.c_str());
+  }
+  fclose(fp);
+}
+
+/**
+ * Build the matrix of a shard from its ratings in the order of the
+ * input file, and write it. A later rating of the same user and item
+ * replaces the earlier one as read_text_rating_file().
+ * @param ratings ratings of the shard
+ * @param cols the number of columns
+ * @param shard shard (nrating is set)
+ * @return sum of rates
+ */
+static double write_shard(const std::vector<Rating> &ratings, int cols,
+                          RatingShard &shard) {
+  int rows = shard.end - shard.begin;
+  std::vector<int> outer(rows + 1, 0);
+  for (size_t i = 0; i < ratings.size(); i++) {
+    outer[ratings[i].user - shard.begin + 1]++;
+  }
+  for (int i = 0; i < rows; i++) outer[i+1] += outer[i];
+  std::vector<std::pair<int, int> > sorted(ratings.size());
+  std::vector<int> next(outer.begin(), outer.end() - 1);
+  for (size_t i = 0; i < ratings.size(); i++) {
+    sorted[next[ratings[i].user - shard.begin]++] =
+      std::make_pair(static_cast<int>(ratings[i].item),
+                     static_cast<int>(ratings[i].rate));
+  }
+  SMat mat(rows, cols);
+  mat.resizeNonZeros(ratings.size());
+  int *mouter = mat.outerIndexPtr();
+  int *inner = mat.innerIndexPtr();
+  int *values = mat.valuePtr();
+  size_t nnz = 0;
+  double sum = 0.0;
+  mouter[0] = 0;
+  for (int i = 0; i < rows; i++) {
+    std::stable_sort(sorted.begin() + outer[i], sorted.begin() + outer[i+1],
+                     FirstLess());
+    for (int j = outer[i]; j < outer[i+1]; j++) {
+      if (nnz > static_cast<size_t>(mouter[i])
+          && inner[nnz-1] == sorted[j].first) {
+        sum -= values[nnz-1];
+        nnz--;
+      }
+      inner[nnz] = sorted[j].first;
+      values[nnz] = sorted[j].second;
+      sum += values[nnz++];
+    }
+    mouter[i+1] = nnz;
+  }
+  mat.resizeNonZeros(nnz);
+  write_binary_rating_file(shard.filename.c_str(), mat);
+  shard.nrating = nnz;
+  return sum;
+}
+
+/**
+ * Split a text file or a binary rating file into shards.
+ * A binary file is mapped and sliced by rows. A text file is parsed
+ * twice: the first pass counts the ratings of users to set the ranges
+ * of shards, and the second pass appends ratings to a temporary file
+ * of each shard, which is then sorted into a matrix.
+ */
+void split_rating_file(const char *filename, const char *dirname,
+                       size_t shard_ratings, RatingShardSet &set) {
+  if (shard_ratings == 0) shard_ratings = 1;
+  set.nrating = 0;
+  set.sum = 0.0;
+  if (is_binary_rating_file(filename)) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      fprintf(stderr, "[Error] cannot open %s\n", filename);
+      exit(1);
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      fprintf(stderr, "[Error] cannot mmap %s\n", filename);
+      exit(1);
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+    if (!check_binary_rating_file(addr, st.st_size)) {
+      fprintf(stderr, "[Error] invalid rating file: %s\n", filename);
+      exit(1);
+    }
+    const RatingFileHeader *header = static_cast<RatingFileHeader *>(addr);
+    const int32_t *outer = reinterpret_cast<const int32_t *>(header + 1);
+    const int32_t *inner = outer + header->rows + 1;
+    const int32_t *values = inner + header->nnz;
+    set.rows = header->rows;
+    set.cols = header->cols;
+    std::vector<size_t> counts(set.rows);
+    for (int i = 0; i < set.rows; i++) counts[i] = outer[i+1] - outer[i];
+    set_shard_bounds(counts, shard_ratings, dirname, set);
+    for (size_t s = 0; s < set.shards.size(); s++) {
+      RatingShard &shard = set.shards[s];
+      int first = outer[shard.begin];
+      shard.nrating = outer[shard.end] - first;
+      SMat mat(shard.end - shard.begin, set.cols);
+      mat.resizeNonZeros(shard.nrating);
+      for (int i = shard.begin; i <= shard.end; i++) {
+        mat.outerIndexPtr()[i - shard.begin] = outer[i] - first;
+      }
+      memcpy(mat.innerIndexPtr(), inner + first,
+             sizeof(int32_t) * shard.nrating);
+      memcpy(mat.valuePtr(), values + first, sizeof(int32_t) * shard.nrating);
+      for (size_t j = 0; j < shard.nrating; j++) set.sum += values[first+j];
+      write_binary_rating_file(shard.filename.c_str(), mat);
+      set.nrating += shard.nrating;
+    }
+    munmap(addr, st.st_size);
+  } else {
+    RatingCounter counter;
+    scan_text_rating_file(filename, counter);
+    if (counter.counts.empty()) counter.counts.resize(1, 0);
+    set.rows = counter.counts.size();
+    set.cols = counter.cols;
+    set_shard_bounds(counter.counts, shard_ratings, dirname, set);
+
+    std::vector<int> shard_ids(set.rows);
+    RatingDistributor distributor;
+    distributor.shard_ids = &shard_ids;
+    std::vector<std::string> tmpnames(set.shards.size());
+    for (size_t s = 0; s < set.shards.size(); s++) {
+      for (int i = set.shards[s].begin; i < set.shards[s].end; i++) {
+        shard_ids[i] = s;
+      }
+      tmpnames[s] = set.shards[s].filename + ".tmp";
+      FILE *fp = fopen(tmpnames[s].c_str(), "wb");
+      if (fp == NULL) {
+        fprintf(stderr, "[Error] cannot open %s\n", tmpnames[s].c_str());
+        exit(1);
+      }
+      setvbuf(fp, NULL, _IOFBF, SPLIT_BUFFER_SIZE);
+      distributor.files.push_back(fp);
+    }
+    scan_text_rating_file(filename, distributor);
+    for (size_t s = 0; s < set.shards.size(); s++) {
+      fclose(distributor.files[s]);
+    }
+
+    for (size_t s = 0; s < set.shards.size(); s++) {
+      FILE *fp = fopen(tmpnames[s].c_str(), "rb");
+      if (fp == NULL) {
+        fprintf(stderr, "[Error] cannot open %s\n", tmpnames[s].c_str());
+        exit(1);
+      }
+      fseek(fp, 0, SEEK_END);
+      std::vector<Rating> ratings(ftell(fp) / sizeof(Rating));
+      fseek(fp, 0, SEEK_SET);
+      if (!ratings.empty()
+          && fread(&ratings[0], sizeof(Rating), ratings.size(), fp)
+             != ratings.size()) {
+        fprintf(stderr, "[Error] cannot read %s\n", tmpnames[s].c_str());
+        exit(1);
+      }
+      fclose(fp);
+      unlink(tmpnames[s].c_str());
+      set.sum += write_shard(ratings, set.cols, set.shards[s]);
+      set.nrating += set.shards[s].nrating;
+    }
+  }
+  write_shard_manifest(dirname, set);
+}
+
+/**
+ * Read the manifest of shards.
+ */
+void read_rating_shards(const char *dirname, RatingShardSet &set) {
+  std::string path = std::string(dirname) + "/shards.tsv";
+  FILE *fp = fopen(path.c_str(), "r");
+  unsigned long nrating;
+  if (fp == NULL || fscanf(fp, "%d\t%d\t%lu\t%lf\n", &set.rows, &set.cols,
+                           &nrating, &set.sum) != 4) {
+    fprintf(stderr, "[Error] invalid manifest of shards: %s\n", path.c_str());
+    exit(1);
+  }
+  set.nrating = nrating;
+  set.shards.clear();
+  RatingShard shard;
+  char name[256];
+  while (fscanf(fp, "%d\t%d\t%lu\t%255s\n", &shard.begin, &shard.end,
+                &nrating, name) == 4) {
+    shard.nrating = nrating;
+    shard.filename = std::string(dirname) + "/" + name;
+    set.shards.push_back(shard);
+  }
+  fclose(fp);
+}
+
+/**
+ * Get a random number in [0, 1).
+ * @param seed seed of random numbers
+ * @return random number
+ */
+static double random_unit(unsigned int *seed) {
+  return myrand(seed) / (RAND_MAX + 1.0);
+}
+
+/**
+ * Set power-law weights 1 / k^skew to indexes 1..n in a random order.
+ * @param n the number of indexes
+ * @param skew exponent
+ * @param seed seed of random numbers
+ * @param weights output weights (weights[0] = 0)
+ */
+static void set_power_law_weights(int n, double skew, unsigned int *seed,
+                                  std::vector<double> &weights) {
+  weights.assign(n + 1, 0.0);
+  for (int k = 1; k <= n; k++) weights[k] = pow(k, -skew);
+  for (int k = n; k > 1; k--) {
+    std::swap(weights[k], weights[1 + myrand(seed) % k]);
+  }
+}
+
+/**
+ * Generate a synthetic rating matrix.
+ * Items are drawn from the cumulative item weights by binary search,
+ * and duplicated items of a user are dropped. Each user has its own
+ * seed, so users are generated in parallel.
+ */
+void generate_rating_matrix(int nuser, int nitem, double density,
+                            double skew, unsigned int seed, SMat &mat) {
+  std::vector<double> user_weights, item_weights;
+  set_power_law_weights(nuser, skew, &seed, user_weights);
+  set_power_law_weights(nitem, skew, &seed, item_weights);
+  std::vector<double> cumulative(nitem + 1, 0.0);
+  for (int j = 1; j <= nitem; j++) {
+    cumulative[j] = cumulative[j-1] + item_weights[j];
+  }
+  double user_total = 0.0;
+  for (int i = 1; i <= nuser; i++) user_total += user_weights[i];
+  double nrating = density * nuser * nitem;
+
+  // latent vectors of rank r scaled so that dot products have variance 1
+  std::vector<float> P((nuser + 1) * SYNTHETIC_RANK);
+  std::vector<float> Q((nitem + 1) * SYNTHETIC_RANK);
+  double scale = sqrt(3.0 / sqrt(static_cast<double>(SYNTHETIC_RANK)));
+  for (size_t i = 0; i < P.size(); i++) {
+    P[i] = scale * (2 * random_unit(&seed) - 1);
+  }
+  for (size_t i = 0; i < Q.size(); i++) {
+    Q[i] = scale * (2 * random_unit(&seed) - 1);
+  }
+
+  std::vector<int> outer(nuser + 2, 0);
+  for (int i = 1; i <= nuser; i++) {
+    double count = nrating * user_weights[i] / user_total;
+    outer[i+1] = std::min(nitem, std::max(1, static_cast<int>(count + 0.5)));
+  }
+  for (int i = 0; i <= nuser; i++) outer[i+1] += outer[i];
+  std::vector<int> inner(outer[nuser+1]);
+  std::vector<int> values(outer[nuser+1]);
+  std::vector<int> sizes(nuser + 1, 0);
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int i = 1; i <= nuser; i++) {
+    unsigned int user_seed = seed ^ (2654435761u * i);
+    int *items = &inner[0] + outer[i];
+    int n = outer[i+1] - outer[i];
+    for (int k = 0; k < n; k++) {
+      double r = random_unit(&user_seed) * cumulative[nitem];
+      int j = std::upper_bound(cumulative.begin() + 1, cumulative.end(), r)
+        - cumulative.begin();
+      items[k] = std::min(j, nitem);
+    }
+    std::sort(items, items + n);
+    n = std::unique(items, items + n) - items;
+    sizes[i] = n;
+    for (int k = 0; k < n; k++) {
+      const float *p = &P[0] + i * SYNTHETIC_RANK;
+      const float *q = &Q[0] + items[k] * SYNTHETIC_RANK;
+      double rate = 3.0 + random_unit(&user_seed) - 0.5;
+      for (int d = 0; d < SYNTHETIC_RANK; d++) rate += p[d] * q[d];
+      values[outer[i] + k] = std::max(1, std::min(5, static_cast<int>(
+        floor(rate + 0.5))));
+    }
+  }
+
+  mat.resize(nuser + 1, nitem + 1);
+  size_t nnz = 0;
+  for (int i = 0; i <= nuser; i++) nnz += sizes[i];
+  mat.resizeNonZeros(nnz);
+  int *mouter = mat.outerIndexPtr();
+  mouter[0] = 0;
+  for (int i = 0; i <= nuser; i++) {
+    memcpy(mat.innerIndexPtr() + mouter[i], &inner[0] + outer[i],
+           sizeof(int) * sizes[i]);
+    memcpy(mat.valuePtr() + mouter[i], &values[0] + outer[i],
+           sizeof(int) * sizes[i]);
+    mouter[i+1] = mouter[i] + sizes[i];
+  }
+}
+
+/**
+ * Merge new ratings into a rating matrix.
+ */
+void merge_rating_matrix(const SMat &base, const SMat &delta, SMat &mat) {
+  int rows = std::max(base.rows(), delta.rows());
+  int cols = std::max(base.cols(), delta.cols());
+  std::vector<int> outer(rows + 1, 0);
+  std::vector<int> inner;
+  std::vector<int> values;
+  inner.reserve(base.nonZeros() + delta.nonZeros());
+  values.reserve(base.nonZeros() + delta.nonZeros());
+  for (int i = 0; i < rows; i++) {
+    int a = 0, a_end = 0, b = 0, b_end = 0;
+    if (i < base.rows()) {
+      a = base.outerIndexPtr()[i];
+      a_end = base.outerIndexPtr()[i+1];
+    }
+    if (i < delta.rows()) {
+      b = delta.outerIndexPtr()[i];
+      b_end = delta.outerIndexPtr()[i+1];
+    }
+    while (a < a_end || b < b_end) {
+      int col_a = a < a_end ? base.innerIndexPtr()[a] : cols;
+      int col_b = b < b_end ? delta.innerIndexPtr()[b] : cols;
+      if (col_b <= col_a) {
+        inner.push_back(col_b);
+        values.push_back(delta.valuePtr()[b++]);
+        if (col_a == col_b) a++;
+      } else {
+        inner.push_back(col_a);
+        values.push_back(base.valuePtr()[a++]);
+      }
+    }
+    outer[i+1] = inner.size();
+  }
+  mat.resize(rows, cols);
+  mat.resizeNonZeros(inner.size());
+  memcpy(mat.outerIndexPtr(), &outer[0], sizeof(int) * (rows + 1));
+  if (!inner.empty()) {
+    memcpy(mat.innerIndexPtr(), &inner[0], sizeof(int) * inner.size());
+    memcpy(mat.valuePtr(), &values[0], sizeof(int) * values.size());
+  }
+}
+
+/**
+ * Build a stream from a rating matrix.
+ * Ratings are distributed into tiles with a counting sort. Rows are read
+ * in order, so the ratings of a user are contiguous in each tile.
+ */
+void RatingStream::build(const SMat &mat, int tile_users, int tile_items) {
+  size_t nrow = (mat.rows() + tile_users - 1) / tile_users;
+  size_t ncol = (mat.cols() + tile_items - 1) / tile_items;
+  size_t ntile = nrow * ncol;
+  std::vector<size_t> offsets(ntile + 1, 0);
+  for (int i = 0; i < mat.outerSize(); i++) {
+    for (SMat::InnerIterator it(mat, i); it; ++it) {
+      offsets[(i / tile_users) * ncol + it.col() / tile_items + 1]++;
+    }
+  }
+  for (size_t t = 0; t < ntile; t++) offsets[t+1] += offsets[t];
+  ratings_.resize(mat.nonZeros());
+  std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+  std::vector<int> last_users(ntile, -1);
+  std::vector<std::vector<size_t> > tile_runs(ntile);
+  for (int i = 0; i < mat.outerSize(); i++) {
+    for (SMat::InnerIterator it(mat, i); it; ++it) {
+      size_t t = (i / tile_users) * ncol + it.col() / tile_items;
+      if (last_users[t] != i) {
+        tile_runs[t].push_back(fill[t]);
+        last_users[t] = i;
+      }
+      Rating &rating = ratings_[fill[t]++];
+      rating.user = i;
+      rating.item = it.col();
+      rating.rate = it.value();
+    }
+  }
+  runs_.clear();
+  tiles_.clear();
+  for (size_t t = 0; t < ntile; t++) {
+    if (tile_runs[t].empty()) continue;
+    tiles_.push_back(runs_.size());
+    runs_.insert(runs_.end(), tile_runs[t].begin(), tile_runs[t].end());
+  }
+  tiles_.push_back(runs_.size());
+  runs_.push_back(ratings_.size());
+  tile_order_.resize(tiles_.size() - 1);
+  for (size_t t = 0; t < tile_order_.size(); t++) tile_order_[t] = t;
+  positions_.resize(tile_order_.size());
+  for (size_t t = 0; t < tile_order_.size(); t++) {
+    positions_[t] = runs_[tiles_[t]];
+  }
+}
+
+/**
+ * Shuffle the visiting order.
+ */
+void RatingStream::shuffle(unsigned int seed, size_t nthread) {
+  for (size_t t = tile_order_.size(); t > 1; t--) {
+    std::swap(tile_order_[t-1], tile_order_[myrand(&seed) % t]);
+  }
+  size_t position = 0;
+  for (size_t t = 0; t < tile_order_.size(); t++) {
+    positions_[t] = position;
+    size_t tile = tile_order_[t];
+    position += runs_[tiles_[tile+1]] - runs_[tiles_[tile]];
+  }
+  #pragma omp parallel num_threads(nthread)
+  {
+    std::vector<Rating> buffer;
+    std::vector<size_t> order;
+    std::vector<size_t> runs;
+    #pragma omp for schedule(dynamic, 1)
+    for (int t = 0; t < static_cast<int>(tiles_.size()) - 1; t++) {
+      unsigned int tile_seed = seed + t;
+      size_t first = tiles_[t];
+      size_t last = tiles_[t+1];
+      order.resize(last - first);
+      for (size_t r = 0; r < order.size(); r++) order[r] = first + r;
+      for (size_t r = order.size(); r > 1; r--) {
+        std::swap(order[r-1], order[myrand(&tile_seed) % r]);
+      }
+      buffer.clear();
+      runs.clear();
+      for (size_t r = 0; r < order.size(); r++) {
+        runs.push_back(runs_[first] + buffer.size());
+        size_t begin = buffer.size();
+        buffer.insert(buffer.end(), ratings_.begin() + runs_[order[r]],
+                      ratings_.begin() + runs_[order[r] + 1]);
+        for (size_t n = buffer.size() - begin; n > 1; n--) {
+          std::swap(buffer[begin + n - 1],
+                    buffer[begin + myrand(&tile_seed) % n]);
+        }
+      }
+      std::copy(buffer.begin(), buffer.end(), ratings_.begin() + runs_[first]);
+      std::copy(runs.begin(), runs.end(), runs_.begin() + first);
+    }
+  }
+}
+
+} /* namespace mf */
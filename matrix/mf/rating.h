@@ -0,0 +1,359 @@
+//
+// Rating matrix files
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef MF_RATING_H_
+#define MF_RATING_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <Eigen/Sparse>
+#include "dictionary.h"
+
+namespace mf {
+
+/* typedef */
+typedef Eigen::SparseMatrix<int, Eigen::RowMajor> SMat;
+typedef Eigen::SparseMatrix<int, Eigen::ColMajor> SMatCol;
+
+/* constants */
+const char RATING_FILE_MAGIC[4] = {'M', 'F', 'R', 'T'};  ///< magic number
+const uint32_t RATING_FILE_VERSION = 1;                  ///< format version
+const int SYNTHETIC_RANK = 8;  ///< rank of latent vectors of synthetic rates
+const char FOLD_FILE_MAGIC[4] = {'M', 'F', 'F', 'D'};    ///< magic number
+const uint32_t FOLD_FILE_VERSION = 1;                    ///< format version
+const size_t MAX_FOLDS = 255;  ///< the maximum number of folds
+
+/**
+ * Header of a binary rating file.
+ * The header is followed by the compressed row storage of a rating
+ * matrix: outer index (rows + 1), inner index (nnz) and values (nnz),
+ * all of which are 32 bit integers.
+ */
+struct RatingFileHeader {
+  char magic[4];     ///< RATING_FILE_MAGIC
+  uint32_t version;  ///< RATING_FILE_VERSION
+  uint64_t rows;     ///< the number of rows (users)
+  uint64_t cols;     ///< the number of columns (items)
+  uint64_t nnz;      ///< the number of ratings
+};
+
+/**
+ * Header of a fold file.
+ * The header is followed by the fold index (one byte) of each rating
+ * of a rating matrix in the order of its compressed row storage.
+ */
+struct FoldFileHeader {
+  char magic[4];     ///< FOLD_FILE_MAGIC
+  uint32_t version;  ///< FOLD_FILE_VERSION
+  uint32_t nfold;    ///< the number of folds
+  uint32_t reserved; ///< reserved (0)
+  uint64_t nrating;  ///< the number of ratings
+};
+
+/**
+ * A rating in a rating stream.
+ */
+struct Rating {
+  uint32_t user;  ///< user index
+  uint32_t item;  ///< item index
+  float rate;     ///< rate
+};
+
+/**
+ * A shard of a rating matrix: a binary rating file which holds the
+ * ratings of a range of users. Row i of the file is user begin + i.
+ */
+struct RatingShard {
+  int begin;             ///< first user
+  int end;               ///< last user + 1
+  size_t nrating;        ///< the number of ratings
+  std::string filename;  ///< binary rating file
+};
+
+/**
+ * Rating matrix split into shards by user range.
+ */
+struct RatingShardSet {
+  int rows;                         ///< the number of rows (users)
+  int cols;                         ///< the number of columns (items)
+  size_t nrating;                   ///< the number of ratings
+  double sum;                       ///< sum of rates
+  std::vector<RatingShard> shards;  ///< shards sorted by users
+};
+
+/**
+ * Stream of ratings visited in a shuffled order in each epoch.
+ * Ratings are stored as an array of Rating grouped into tiles of
+ * tile_users users x tile_items items, so that the factors visited in
+ * a tile fit in the cache. The ratings of a user in a tile are kept in
+ * a run. shuffle() changes the order of tiles, and moves the runs of
+ * each tile and the ratings of each run into a random order, so that
+ * the ratings of a tile are read sequentially.
+ */
+class RatingStream {
+ private:
+  std::vector<Rating> ratings_;     ///< ratings grouped by tiles and runs
+  std::vector<size_t> runs_;        ///< beginning of runs (+ end)
+  std::vector<size_t> tiles_;       ///< first run of tiles (+ end)
+  std::vector<size_t> tile_order_;  ///< tiles in the visiting order
+  std::vector<size_t> positions_;   ///< ratings visited before each tile
+
+ public:
+  /**
+   * Build a stream from a rating matrix.
+   * @param mat compressed rating matrix
+   * @param tile_users the number of users in a tile
+   * @param tile_items the number of items in a tile
+   */
+  void build(const SMat &mat, int tile_users, int tile_items);
+
+  /**
+   * Shuffle the visiting order. Tiles are shuffled in parallel.
+   * @param seed seed of random numbers
+   * @param nthread the number of threads
+   */
+  void shuffle(unsigned int seed, size_t nthread);
+
+  /**
+   * Get the number of ratings.
+   * @return the number of ratings
+   */
+  size_t size() const {
+    return ratings_.size();
+  }
+
+  /**
+   * Get the number of tiles.
+   * @return the number of tiles
+   */
+  size_t num_tiles() const {
+    return tile_order_.size();
+  }
+
+  /**
+   * Get the number of ratings visited before a tile.
+   * @param t position of the tile in the visiting order
+   * @return the number of ratings
+   */
+  size_t position(size_t t) const {
+    return positions_[t];
+  }
+
+  /**
+   * Get the first run of a tile.
+   * @param t position of the tile in the visiting order
+   * @return index of the run
+   */
+  size_t first_run(size_t t) const {
+    return tiles_[tile_order_[t]];
+  }
+
+  /**
+   * Get the last run of a tile + 1.
+   * @param t position of the tile in the visiting order
+   * @return index of the run
+   */
+  size_t last_run(size_t t) const {
+    return tiles_[tile_order_[t] + 1];
+  }
+
+  /**
+   * Get the first rating of a run.
+   * @param r index of the run
+   * @return pointer to the rating
+   */
+  const Rating *run_begin(size_t r) const {
+    return &ratings_[0] + runs_[r];
+  }
+
+  /**
+   * Get the last rating of a run + 1.
+   * @param r index of the run
+   * @return pointer to the end of the run
+   */
+  const Rating *run_end(size_t r) const {
+    return &ratings_[0] + runs_[r + 1];
+  }
+};
+
+/**
+ * Check the compressed row storage of a rating matrix read from a file:
+ * outer[0] is 0, outer is non-decreasing up to outer[rows] == nnz, and
+ * inner indexes increase in each row and are less than cols.
+ * @param outer outer index (rows + 1 elements)
+ * @param inner inner index (nnz elements)
+ * @param rows the number of rows
+ * @param cols the number of columns
+ * @param nnz the number of nonzeros
+ * @return true if the storage is valid
+ */
+bool check_compressed_rows(const int32_t *outer, const int32_t *inner,
+                           int rows, int cols, int nnz);
+
+/**
+ * Check whether a file is a binary rating file.
+ * @param filename input file
+ * @return return true if the file starts with the magic number
+ */
+bool is_binary_rating_file(const char *filename);
+
+/**
+ * Read a rating matrix from a text file.
+ * Each line of the file is "user_id \t item_id \t rate".
+ * @param filename input file
+ * @param mat output matrix
+ */
+void read_text_rating_file(const char *filename, SMat &mat);
+
+/**
+ * Read a rating matrix from a text file of external IDs, whose lines
+ * are "user_id \t item_id \t rate" with any IDs. New IDs are added to
+ * the dictionaries, and rows and columns are the indexes of IDs.
+ * @param filename input file
+ * @param users dictionary of users
+ * @param items dictionary of items
+ * @param mat output matrix
+ */
+void read_mapped_rating_file(const char *filename, IdDictionary &users,
+                             IdDictionary &items, SMat &mat);
+
+/**
+ * Read a rating matrix from a text file of external IDs as
+ * read_mapped_rating_file(), skipping ratings of unknown IDs.
+ * @param filename input file
+ * @param users dictionary of users
+ * @param items dictionary of items
+ * @param mat output matrix
+ */
+void read_known_rating_file(const char *filename, const IdDictionary &users,
+                            const IdDictionary &items, SMat &mat);
+
+/**
+ * Read a rating matrix from a binary rating file using mmap.
+ * The sizes and the indexes of the file are checked before they are
+ * copied, and an invalid file is an error.
+ * @param filename input file
+ * @param mat output matrix
+ */
+void read_binary_rating_file(const char *filename, SMat &mat);
+
+/**
+ * Read a rating matrix from a text file or a binary rating file.
+ * @param filename input file
+ * @param mat output matrix
+ */
+void read_rating_file(const char *filename, SMat &mat);
+
+/**
+ * Write a rating matrix to a binary rating file.
+ * @param filename output file
+ * @param mat rating matrix
+ */
+void write_binary_rating_file(const char *filename, const SMat &mat);
+
+/**
+ * Assign ratings to folds of cross validation at random.
+ * @param nrating the number of ratings
+ * @param nfold the number of folds (up to MAX_FOLDS)
+ * @param seed seed of random numbers
+ * @param folds output fold index of each rating
+ */
+void assign_folds(size_t nrating, size_t nfold, unsigned int seed,
+                  std::vector<uint8_t> &folds);
+
+/**
+ * Write fold indexes of ratings to a fold file.
+ * @param filename output file
+ * @param nfold the number of folds
+ * @param folds fold index of each rating
+ */
+void write_fold_file(const char *filename, size_t nfold,
+                     const std::vector<uint8_t> &folds);
+
+/**
+ * Read fold indexes of ratings from a fold file.
+ * @param filename input file
+ * @param folds output fold index of each rating
+ * @return the number of folds
+ */
+size_t read_fold_file(const char *filename, std::vector<uint8_t> &folds);
+
+/**
+ * Split a rating matrix into the training matrix and the test matrix
+ * of a fold. Both have the size of the rating matrix.
+ * @param mat compressed rating matrix
+ * @param folds fold index of each rating of mat
+ * @param fold fold index of test ratings
+ * @param train output training matrix (ratings of the other folds)
+ * @param test output test matrix
+ */
+void split_fold(const SMat &mat, const std::vector<uint8_t> &folds,
+                size_t fold, SMat &train, SMat &test);
+
+/**
+ * Split a text file or a binary rating file into shards of about
+ * shard_ratings ratings, and write them with a manifest (shards.tsv)
+ * into a directory. Only the ratings of one shard are held in memory.
+ * @param filename input file
+ * @param dirname output directory
+ * @param shard_ratings the number of ratings of a shard
+ * @param set output shards
+ */
+void split_rating_file(const char *filename, const char *dirname,
+                       size_t shard_ratings, RatingShardSet &set);
+
+/**
+ * Read the manifest of shards written by split_rating_file().
+ * @param dirname directory of shards
+ * @param set output shards
+ */
+void read_rating_shards(const char *dirname, RatingShardSet &set);
+
+/**
+ * Generate a synthetic rating matrix.
+ * Users and items (from index 1) have power-law weights in a random
+ * order: the k-th heaviest has weight 1 / k^skew. Each user rates
+ * items drawn by item weights, as many as its share of density x
+ * nuser x nitem ratings. Rates from 1 to 5 follow latent vectors of
+ * rank SYNTHETIC_RANK with noise, so that factorizers can learn them.
+ * The result depends only on the arguments (not on threads).
+ * @param nuser the number of users
+ * @param nitem the number of items
+ * @param density the fraction of rated pairs
+ * @param skew exponent of power-law weights (0 for uniform)
+ * @param seed seed of random numbers
+ * @param mat output matrix ((nuser + 1) x (nitem + 1))
+ */
+void generate_rating_matrix(int nuser, int nitem, double density,
+                            double skew, unsigned int seed, SMat &mat);
+
+/**
+ * Merge new ratings into a rating matrix.
+ * The result is large enough to hold both matrices, and a rating in
+ * delta replaces the rating of the same user and item in base.
+ * @param base compressed rating matrix
+ * @param delta compressed matrix of new ratings
+ * @param mat output matrix
+ */
+void merge_rating_matrix(const SMat &base, const SMat &delta, SMat &mat);
+
+} /* namespace mf */
+
+#endif  // MF_RATING_H_
@@ -0,0 +1,514 @@
+//
+// Recommendation server of matrix factorization models
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "server.h"
+
+namespace mf {
+
+/* request types */
+enum {
+  REQUEST_PREDICT = 1,  ///< predict a rate
+  REQUEST_TOP     = 2   ///< top n items of a user
+};
+
+/**
+ * Accepted connection passed to a connection thread.
+ */
+struct Connection {
+  RecommendServer *server;  ///< server
+  int fd;                   ///< connected socket
+};
+
+/**
+ * Open a socket of an address.
+ * @param address socket path or TCP port of localhost
+ * @param server true to listen on the address, false to connect to it
+ * @return file descriptor
+ */
+static int open_socket(const char *address, bool server) {
+  int fd;
+  int ret;
+  if (strchr(address, '/')) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      fprintf(stderr, "[Error] cannot create socket: %s\n", strerror(errno));
+      exit(1);
+    }
+    if (server) {
+      unlink(address);
+      ret = bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    } else {
+      ret = connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                    sizeof(addr));
+    }
+  } else {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(address));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      fprintf(stderr, "[Error] cannot create socket: %s\n", strerror(errno));
+      exit(1);
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (server) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      ret = bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    } else {
+      ret = connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                    sizeof(addr));
+    }
+  }
+  if (ret < 0) {
+    fprintf(stderr, "[Error] cannot %s %s: %s\n",
+            server ? "bind" : "connect to", address, strerror(errno));
+    exit(1);
+  }
+  if (server && listen(fd, SOMAXCONN) < 0) {
+    fprintf(stderr, "[Error] cannot listen on %s: %s\n",
+            address, strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+/**
+ * Write data to a socket.
+ * @param fd file descriptor
+ * @param str data
+ * @return false if the connection is closed
+ */
+static bool write_string(int fd, const std::string &str) {
+  const char *p = str.data();
+  size_t size = str.size();
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+/**
+ * Read complete lines from a socket.
+ * @param fd file descriptor
+ * @param buf buffer of incomplete lines (updated)
+ * @param lines output lines without newlines
+ * @return false if the connection is closed
+ */
+static bool read_lines(int fd, std::string &buf,
+                       std::vector<std::string> &lines) {
+  lines.clear();
+  char chunk[4096];
+  while (true) {
+    size_t begin = 0;
+    size_t end;
+    while ((end = buf.find('\n', begin)) != std::string::npos) {
+      lines.push_back(buf.substr(begin, end - begin));
+      begin = end + 1;
+    }
+    buf.erase(0, begin);
+    if (!lines.empty()) return true;
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    buf.append(chunk, n);
+  }
+}
+
+/**
+ * Constructor.
+ */
+RecommendServer::RecommendServer(const MatrixFactorizer &mf, size_t nthread)
+  : mf_(mf), nthread_(nthread > 0 ? nthread : 1), nbatch_(0), nrequest_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&queue_cond_, NULL);
+}
+
+/**
+ * Destructor.
+ */
+RecommendServer::~RecommendServer() {
+  pthread_cond_destroy(&queue_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+/**
+ * Entry point of worker threads.
+ */
+void *RecommendServer::worker_main(void *arg) {
+  static_cast<RecommendServer *>(arg)->run_worker();
+  return NULL;
+}
+
+/**
+ * Entry point of connection threads.
+ */
+void *RecommendServer::connection_main(void *arg) {
+  Connection *conn = static_cast<Connection *>(arg);
+  conn->server->serve_connection(conn->fd);
+  close(conn->fd);
+  delete conn;
+  return NULL;
+}
+
+/**
+ * Main loop of a worker thread.
+ */
+void RecommendServer::run_worker() {
+  std::vector<Request *> batch;
+  while (true) {
+    pthread_mutex_lock(&mutex_);
+    while (queue_.empty()) pthread_cond_wait(&queue_cond_, &mutex_);
+    size_t size = std::min(queue_.size(), SERVER_MAX_BATCH);
+    batch.assign(queue_.begin(), queue_.begin() + size);
+    queue_.erase(queue_.begin(), queue_.begin() + size);
+    pthread_mutex_unlock(&mutex_);
+
+    process_batch(batch);
+
+    pthread_mutex_lock(&mutex_);
+    for (size_t i = 0; i < batch.size(); i++) {
+      batch[i]->done = true;
+      pthread_cond_signal(&batch[i]->cond);
+    }
+    nbatch_++;
+    nrequest_ += batch.size();
+    pthread_mutex_unlock(&mutex_);
+  }
+}
+
+/**
+ * Answer requests of a client until it disconnects.
+ * All complete lines received at once are queued together, so that
+ * pipelined requests of a client are also batched.
+ */
+void RecommendServer::serve_connection(int fd) {
+  std::string buf;
+  std::vector<std::string> lines;
+  std::vector<Request> requests;
+  std::string response;
+  while (read_lines(fd, buf, lines)) {
+    requests.resize(lines.size());
+    pthread_mutex_lock(&mutex_);
+    for (size_t i = 0; i < lines.size(); i++) {
+      Request &req = requests[i];
+      pthread_cond_init(&req.cond, NULL);
+      req.done = !parse_request(lines[i], req);
+      if (!req.done) queue_.push_back(&req);
+    }
+    pthread_cond_broadcast(&queue_cond_);
+    response.clear();
+    for (size_t i = 0; i < requests.size(); i++) {
+      Request &req = requests[i];
+      while (!req.done) pthread_cond_wait(&req.cond, &mutex_);
+      response += req.response;
+      pthread_cond_destroy(&req.cond);
+    }
+    pthread_mutex_unlock(&mutex_);
+    if (!write_string(fd, response)) break;
+  }
+}
+
+/**
+ * Parse a request line.
+ */
+bool RecommendServer::parse_request(const std::string &line,
+                                    Request &req) const {
+  char command[16];
+  char user_id[256];
+  char arg_id[256];
+  req.response.clear();
+  int n = sscanf(line.c_str(), "%15s %255s %255s", command, user_id, arg_id);
+  if (n >= 1 && !strcmp(command, "info")) {
+    char str[64];
+    sprintf(str, "%d %d\n", mf_.num_users(), mf_.num_items());
+    req.response = str;
+    return false;
+  }
+  if (n >= 1 && !strcmp(command, "stats")) {
+    char str[64];
+    sprintf(str, "%ld %ld\n", nrequest_, nbatch_);
+    req.response = str;
+    return false;
+  }
+  if (n == 2 && !strcmp(command, "user")) {
+    int user = atoi(user_id);
+    if (user > 0 && user < mf_.num_users()) {
+      req.response = mf_.user_id(user) + "\n";
+      return false;
+    }
+  } else if (n == 3 && !strcmp(command, "predict")) {
+    int user = mf_.user_index(user_id);
+    int arg = mf_.item_index(arg_id);
+    if (user > 0 && arg > 0) {
+      req.type = REQUEST_PREDICT;
+      req.user = user;
+      req.arg = arg;
+      return true;
+    }
+  } else if (n == 3 && !strcmp(command, "top")) {
+    int user = mf_.user_index(user_id);
+    int arg = atoi(arg_id);
+    if (user > 0 && arg > 0 && arg <= static_cast<int>(SERVER_MAX_TOPN)) {
+      req.type = REQUEST_TOP;
+      req.user = user;
+      req.arg = arg;
+      return true;
+    }
+  }
+  req.response = "error\n";
+  return false;
+}
+
+/**
+ * Answer a batch of requests.
+ * Top-N queries of a batch are scored with one product of the item
+ * matrix and the stacked user vectors.
+ */
+void RecommendServer::process_batch(std::vector<Request *> &batch) {
+  std::vector<int> users;
+  size_t num = 0;
+  char str[64];
+  for (size_t i = 0; i < batch.size(); i++) {
+    Request *req = batch[i];
+    if (req->type == REQUEST_TOP) {
+      users.push_back(req->user);
+      num = std::max(num, static_cast<size_t>(req->arg));
+    } else {
+      sprintf(str, "%.4f\n", mf_.predict(req->user, req->arg));
+      req->response = str;
+    }
+  }
+  if (users.empty()) return;
+  std::vector<ItemList> results;
+  mf_.top_items(users, num, results);
+  size_t k = 0;
+  for (size_t i = 0; i < batch.size(); i++) {
+    Request *req = batch[i];
+    if (req->type != REQUEST_TOP) continue;
+    const ItemList &items = results[k++];
+    size_t n = std::min(items.size(), static_cast<size_t>(req->arg));
+    for (size_t j = 0; j < n; j++) {
+      if (j > 0) req->response += ' ';
+      req->response += mf_.item_id(items[j].first);
+      sprintf(str, ":%.4f", items[j].second);
+      req->response += str;
+    }
+    req->response += '\n';
+  }
+}
+
+/**
+ * Listen on an address and answer requests.
+ */
+void RecommendServer::serve(const char *address) {
+  signal(SIGPIPE, SIG_IGN);
+  int fd = open_socket(address, true);
+  for (size_t i = 0; i < nthread_; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker_main, this)) {
+      fprintf(stderr, "[Error] cannot create thread\n");
+      exit(1);
+    }
+    pthread_detach(thread);
+  }
+  fprintf(stderr, "Listening on %s (%d users, %d items, %ld threads)\n",
+          address, mf_.num_users(), mf_.num_items(), nthread_);
+  while (true) {
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      fprintf(stderr, "[Error] cannot accept: %s\n", strerror(errno));
+      exit(1);
+    }
+    int on = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    Connection *conn = new Connection;
+    conn->server = this;
+    conn->fd = client;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, connection_main, conn)) {
+      fprintf(stderr, "[Error] cannot create thread\n");
+      close(client);
+      delete conn;
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+/**
+ * Client of a load test.
+ */
+struct LoadClient {
+  const char *address;           ///< server address
+  const std::vector<std::string> *users;  ///< IDs of sampled users
+  size_t nrequest;               ///< the number of requests
+  size_t num;                    ///< the number of items of each query
+  unsigned int seed;             ///< seed of random users
+  size_t nerror;                 ///< output the number of errors
+  std::vector<double> latencies; ///< output latencies of answers (sec)
+};
+
+/**
+ * Send a request and receive a response line.
+ * @param fd connected socket
+ * @param request request line
+ * @param buf buffer of incomplete lines (updated)
+ * @param response output response line
+ */
+static void send_request(int fd, const std::string &request, std::string &buf,
+                         std::string &response) {
+  std::vector<std::string> lines;
+  if (!write_string(fd, request) || !read_lines(fd, buf, lines)) {
+    fprintf(stderr, "[Error] connection closed by server\n");
+    exit(1);
+  }
+  response = lines[0];
+}
+
+/**
+ * Entry point of load test threads.
+ * @param arg client
+ */
+static void *load_client_main(void *arg) {
+  LoadClient *client = static_cast<LoadClient *>(arg);
+  int fd = open_socket(client->address, false);
+  std::string buf;
+  std::string response;
+  char num[32];
+  sprintf(num, " %ld\n", client->num);
+  const std::vector<std::string> &users = *client->users;
+  client->nerror = 0;
+  client->latencies.clear();
+  client->latencies.reserve(client->nrequest);
+  for (size_t i = 0; i < client->nrequest; i++) {
+    const std::string &user = users[myrand(&client->seed) % users.size()];
+    double start = get_time();
+    send_request(fd, "top " + user + num, buf, response);
+    if (response == "error") {
+      client->nerror++;
+    } else {
+      client->latencies.push_back(get_time() - start);
+    }
+  }
+  close(fd);
+  return NULL;
+}
+
+/**
+ * Send top-N queries of random users to a server.
+ */
+void generate_load(const char *address, size_t nconnection, size_t nrequest,
+                   size_t num, LoadResult &result) {
+  signal(SIGPIPE, SIG_IGN);
+  int fd = open_socket(address, false);
+  std::string buf;
+  std::string response;
+  send_request(fd, "info\n", buf, response);
+  int nuser = atoi(response.c_str());
+  if (nuser < 2) {
+    fprintf(stderr, "[Error] no users in the model\n");
+    exit(1);
+  }
+  std::vector<std::string> users;
+  unsigned int seed = 1;
+  size_t nsample = std::min(static_cast<size_t>(nuser - 1),
+                            LOAD_SAMPLE_USERS);
+  for (size_t i = 0; i < nsample; i++) {
+    int user = nsample == static_cast<size_t>(nuser - 1) ?
+      static_cast<int>(i) + 1 : 1 + myrand(&seed) % (nuser - 1);
+    char request[32];
+    sprintf(request, "user %d\n", user);
+    send_request(fd, request, buf, response);
+    if (response != "error") users.push_back(response);
+  }
+  if (users.empty()) {
+    fprintf(stderr, "[Error] no user IDs given by the server\n");
+    exit(1);
+  }
+
+  size_t nrequest_begin = 0, nbatch_begin = 0;
+  send_request(fd, "stats\n", buf, response);
+  sscanf(response.c_str(), "%ld %ld", &nrequest_begin, &nbatch_begin);
+
+  std::vector<LoadClient> clients(nconnection);
+  std::vector<pthread_t> threads(nconnection);
+  double start = get_time();
+  for (size_t i = 0; i < nconnection; i++) {
+    clients[i].address = address;
+    clients[i].users = &users;
+    clients[i].nrequest = nrequest;
+    clients[i].num = num;
+    clients[i].seed = i + 1;
+    if (pthread_create(&threads[i], NULL, load_client_main, &clients[i])) {
+      fprintf(stderr, "[Error] cannot create thread\n");
+      exit(1);
+    }
+  }
+  std::vector<double> latencies;
+  result.nerror = 0;
+  for (size_t i = 0; i < nconnection; i++) {
+    pthread_join(threads[i], NULL);
+    result.nerror += clients[i].nerror;
+    latencies.insert(latencies.end(), clients[i].latencies.begin(),
+                     clients[i].latencies.end());
+  }
+  result.elapsed = get_time() - start;
+  size_t nrequest_end = 0, nbatch_end = 0;
+  send_request(fd, "stats\n", buf, response);
+  sscanf(response.c_str(), "%ld %ld", &nrequest_end, &nbatch_end);
+  close(fd);
+  result.batch = nbatch_end > nbatch_begin ?
+    static_cast<double>(nrequest_end - nrequest_begin) /
+    (nbatch_end - nbatch_begin) : 0.0;
+  result.nrequest = latencies.size();
+  result.qps = result.nrequest / result.elapsed;
+  result.p50 = result.p99 = 0.0;
+  if (latencies.empty()) return;
+  std::sort(latencies.begin(), latencies.end());
+  size_t n = latencies.size();
+  result.p50 = latencies[n / 2] * 1000;
+  result.p99 = latencies[std::min(n - 1, n * 99 / 100)] * 1000;
+}
+
+} /* namespace mf */
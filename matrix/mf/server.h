@@ -0,0 +1,159 @@
+//
+// Recommendation server of matrix factorization models
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef MF_SERVER_H_
+#define MF_SERVER_H_
+
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "factorizer.h"
+
+namespace mf {
+
+/* constants */
+const size_t SERVER_MAX_BATCH = 256;   ///< max requests in a batch
+const size_t SERVER_MAX_TOPN  = 1000;  ///< max items of a top-N query
+const size_t LOAD_SAMPLE_USERS = 4096;  ///< users queried in a load test
+
+/**
+ * Server answering queries of a factorized model.
+ * It listens on a Unix domain socket (an address containing '/') or on
+ * a TCP port of localhost (a numeric address). Each request is a line:
+ *   predict user item   ->  rate
+ *   top user num        ->  item:rate item:rate ...
+ *   info                ->  num_users num_items
+ *   user index          ->  user
+ *   stats               ->  processed_requests processed_batches
+ * Users and items are external IDs if the model maps IDs, and "user"
+ * gives the ID of a user index (1 <= index < num_users).
+ * Connection threads parse requests and put them on a queue, and worker
+ * threads take all the queued requests at once, so that concurrent
+ * top-N queries are scored together with one matrix product.
+ */
+class RecommendServer {
+ private:
+  /**
+   * Request queued by a connection thread.
+   */
+  struct Request {
+    int type;              ///< request type
+    int user;              ///< user index
+    int arg;               ///< item index or the number of items
+    bool done;             ///< true when response is ready
+    std::string response;  ///< response line
+    pthread_cond_t cond;   ///< signaled when done
+  };
+
+  const MatrixFactorizer &mf_;      ///< factorized model
+  size_t nthread_;                  ///< the number of worker threads
+  std::deque<Request *> queue_;     ///< queued requests
+  pthread_mutex_t mutex_;           ///< lock of queue and requests
+  pthread_cond_t queue_cond_;       ///< signaled when requests are queued
+  size_t nbatch_;                   ///< the number of processed batches
+  size_t nrequest_;                 ///< the number of processed requests
+
+  /**
+   * Entry point of worker threads.
+   * @param arg server
+   */
+  static void *worker_main(void *arg);
+
+  /**
+   * Entry point of connection threads.
+   * @param arg connection
+   */
+  static void *connection_main(void *arg);
+
+  /**
+   * Main loop of a worker thread.
+   */
+  void run_worker();
+
+  /**
+   * Answer requests of a client until it disconnects.
+   * @param fd connected socket
+   */
+  void serve_connection(int fd);
+
+  /**
+   * Parse a request line. Invalid requests get an error response.
+   * Called with the lock held.
+   * @param line request line
+   * @param req output request
+   * @return true if the request should be queued
+   */
+  bool parse_request(const std::string &line, Request &req) const;
+
+  /**
+   * Answer a batch of requests.
+   * @param batch requests
+   */
+  void process_batch(std::vector<Request *> &batch);
+
+ public:
+  /**
+   * Constructor.
+   * @param mf factorized model
+   * @param nthread the number of worker threads
+   */
+  RecommendServer(const MatrixFactorizer &mf, size_t nthread);
+
+  /**
+   * Destructor.
+   */
+  ~RecommendServer();
+
+  /**
+   * Listen on an address and answer requests. This never returns.
+   * @param address socket path or TCP port of localhost
+   */
+  void serve(const char *address);
+};
+
+/**
+ * Result of a load test.
+ */
+struct LoadResult {
+  size_t nrequest;  ///< the number of answered requests
+  size_t nerror;    ///< the number of requests answered with an error
+  double elapsed;   ///< elapsed time (sec)
+  double qps;       ///< requests per second
+  double p50;       ///< median latency (msec)
+  double p99;       ///< 99th percentile latency (msec)
+  double batch;     ///< average requests in a batch of the server
+};
+
+/**
+ * Send top-N queries of random users to a server from concurrent
+ * connections and measure latencies. The IDs of up to LOAD_SAMPLE_USERS
+ * random users are queried from the server before the test.
+ * @param address socket path or TCP port of localhost
+ * @param nconnection the number of connections
+ * @param nrequest the number of requests of each connection
+ * @param num the number of items of each query
+ * @param result output result
+ */
+void generate_load(const char *address, size_t nconnection, size_t nrequest,
+                   size_t num, LoadResult &result);
+
+} /* namespace mf */
+
+#endif  // MF_SERVER_H_
@@ -0,0 +1,71 @@
+//
+// Fixed-rank kernels of stochastic gradient descent
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef MF_SGD_KERNEL_H_
+#define MF_SGD_KERNEL_H_
+
+#include <cstddef>
+#include <Eigen/Core>
+
+namespace mf {
+
+/**
+ * Predict a rate and update a user vector and an item vector with it.
+ * The rank is known at compile time, so the dot product and the updates
+ * are unrolled into SIMD instructions of the target (AVX2 or AVX-512
+ * when the library is built with --native).
+ * @param u contiguous user vector (K floats)
+ * @param v contiguous item vector (K floats)
+ * @param offset value added to the predicted rate (biases)
+ * @param rate rate
+ * @param eta_user learning rate of the user
+ * @param eta_item learning rate of the item
+ * @param lambda a tuning parameter
+ * @param grads output squared norms of the gradients of the user and
+ *              the item (NULL if not needed)
+ * @return error of the predicted rate
+ */
+template<int K>
+inline double sgd_step(float *u, float *v, double offset, double rate,
+                       double eta_user, double eta_item, double lambda,
+                       double *grads = NULL) {
+  Eigen::Map<Eigen::Matrix<float, K, 1> > uvec(u);
+  Eigen::Map<Eigen::Matrix<float, K, 1> > vvec(v);
+  double val = rate - offset - uvec.dot(vvec);
+  float eu = eta_user;
+  float ev = eta_item;
+  float l = lambda;
+  float d = val;
+  if (grads == NULL) {
+    uvec += eu * (d * vvec - l * uvec);
+    vvec += ev * (d * uvec - l * vvec);
+    return val;
+  }
+  Eigen::Matrix<float, K, 1> grad = d * vvec - l * uvec;
+  grads[0] = grad.squaredNorm();
+  uvec += eu * grad;
+  grad = d * uvec - l * vvec;
+  grads[1] = grad.squaredNorm();
+  vvec += ev * grad;
+  return val;
+}
+
+} /* namespace mf */
+
+#endif  // MF_SGD_KERNEL_H_
@@ -0,0 +1,206 @@
+//
+// Out-of-core matrix factorization over shards of a rating matrix
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <pthread.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "shard.h"
+
+namespace mf {
+
+/**
+ * Shard read by a prefetch thread.
+ */
+struct ShardLoader {
+  const RatingShard *shard;  ///< shard to be read
+  SMat mat;                  ///< ratings of the shard
+  pthread_t thread;          ///< prefetch thread
+  bool running;              ///< true while the thread is running
+};
+
+/**
+ * Entry point of prefetch threads.
+ * @param arg ShardLoader
+ */
+static void *load_shard_main(void *arg) {
+  ShardLoader *loader = static_cast<ShardLoader *>(arg);
+  read_binary_rating_file(loader->shard->filename.c_str(), loader->mat);
+  return NULL;
+}
+
+/**
+ * Start reading a shard in a prefetch thread.
+ * @param loader loader
+ * @param shard shard
+ */
+static void start_loading(ShardLoader &loader, const RatingShard &shard) {
+  loader.shard = &shard;
+  int ret = pthread_create(&loader.thread, NULL, load_shard_main, &loader);
+  if (ret != 0) {
+    fprintf(stderr, "[Error] cannot create a thread: %s\n", strerror(ret));
+    exit(1);
+  }
+  loader.running = true;
+}
+
+/**
+ * Wait for the prefetch thread of a loader.
+ * @param loader loader
+ */
+static void finish_loading(ShardLoader &loader) {
+  if (!loader.running) return;
+  pthread_join(loader.thread, NULL);
+  loader.running = false;
+}
+
+/**
+ * Train the ratings of a shard.
+ * Rows of the shard are distributed over threads as run_sgd().
+ */
+template<typename Updater>
+double MatrixFactorizerSharded::train_shard(Updater &updater,
+                                            const RatingShard &shard,
+                                            const SMat &mat, size_t count,
+                                            double eta, double lambda) {
+  size_t N = shards_.nrating;
+  const int *outer = mat.outerIndexPtr();
+  double error = 0.0;
+  #pragma omp parallel num_threads(nthread_) reduction(+:error)
+  {
+    typename Updater::UserState state;
+    #pragma omp for schedule(dynamic, 16)
+    for (int j = 0; j < mat.outerSize(); j++) {
+      if (outer[j] == outer[j+1]) continue;
+      int user = shard.begin + j;
+      size_t position = count + outer[j];
+      updater.begin_user(user, state);
+      for (SMat::InnerIterator it(mat, j); it; ++it) {
+        position++;
+        double eta_2 = eta / (1 + static_cast<double>(position) / N);
+        double val = update_rating(updater, user, it.col(), it.value(),
+                                   eta, eta_2, lambda, state);
+        error += val * val;
+      }
+      updater.end_user(user, state);
+    }
+  }
+  return error;
+}
+
+/**
+ * Run stochastic gradient descent over the shards.
+ * Two loaders are used in turn: the next shard (the first shard of
+ * the next epoch after the last one) is read while a shard is trained.
+ * A single shard is read only once.
+ */
+template<typename Updater>
+void MatrixFactorizerSharded::run_shards(Updater &updater, size_t niter,
+                                         double eta, double lambda) {
+  const std::vector<RatingShard> &shards = shards_.shards;
+  size_t nshard = shards.size();
+  if (nshard == 0 || niter == 0) return;
+  ShardLoader loaders[2];
+  loaders[0].running = loaders[1].running = false;
+  start_loading(loaders[0], shards[0]);
+  size_t current = 0;
+  begin_training();
+  for (size_t i = 0; i < niter; i++) {
+    double start = get_time();
+    double wait = 0.0;
+    double error = 0.0;
+    size_t count = i * shards_.nrating;
+    for (size_t s = 0; s < nshard; s++) {
+      double wait_start = get_time();
+      finish_loading(loaders[current]);
+      wait += get_time() - wait_start;
+      if (nshard > 1 && (s + 1 < nshard || i + 1 < niter)) {
+        start_loading(loaders[1 - current], shards[(s + 1) % nshard]);
+      }
+      error += train_shard(updater, shards[s], loaders[current].mat,
+                           count, eta, lambda);
+      count += loaders[current].mat.nonZeros();
+      if (nshard > 1) current = 1 - current;
+    }
+    double elapsed = get_time() - start;
+    fprintf(stderr, "Epoch %ld: %.3f sec (%.3f sec waiting for shards), "
+            "%.0f ratings/sec, RMSE=%.4f\n", i + 1, elapsed, wait,
+            shards_.nrating / elapsed,
+            sqrt(error / std::max(static_cast<size_t>(1), shards_.nrating)));
+  }
+}
+
+/**
+ * Run stochastic gradient descent over the shards with the fixed-rank
+ * kernel of rank K.
+ */
+template<int K>
+void MatrixFactorizerSharded::run_fixed_rank_shards(size_t niter, double eta,
+                                                    double lambda) {
+  Mat Ut = U_.transpose();
+  FixedRankUpdater<K> updater(&U_, Ut.data(), V_.data(), &average_rate_,
+                              &user_biases_[0], &item_biases_[0]);
+  run_shards(updater, niter, eta, lambda);
+  U_ = Ut.transpose();
+}
+
+/**
+ * Read the manifest of shards.
+ * The dimensions and the average rate are set from the manifest.
+ */
+void MatrixFactorizerSharded::train_shards(const char *dirname) {
+  read_rating_shards(dirname, shards_);
+  average_rate_ = shards_.nrating > 0 ? shards_.sum / shards_.nrating : 0.0;
+}
+
+/**
+ * Factorize the shards.
+ */
+void MatrixFactorizerSharded::factorize(size_t ncluster, size_t niter,
+                                        double eta, double lambda) {
+  U_.resize(shards_.rows, ncluster);
+  V_.resize(ncluster, shards_.cols);
+  set_matrix_random(U_);
+  set_matrix_random(V_);
+  set_biases_random();
+  switch (ncluster) {
+    case 8:
+      run_fixed_rank_shards<8>(niter, eta, lambda);
+      break;
+    case 16:
+      run_fixed_rank_shards<16>(niter, eta, lambda);
+      break;
+    case 32:
+      run_fixed_rank_shards<32>(niter, eta, lambda);
+      break;
+    case 64:
+      run_fixed_rank_shards<64>(niter, eta, lambda);
+      break;
+    case 128:
+      run_fixed_rank_shards<128>(niter, eta, lambda);
+      break;
+    default:
+      run_shards(*this, niter, eta, lambda);
+      break;
+  }
+}
+
+} /* namespace mf */
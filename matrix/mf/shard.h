@@ -0,0 +1,126 @@
+//
+// Out-of-core matrix factorization over shards of a rating matrix
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef MF_SHARD_H_
+#define MF_SHARD_H_
+
+#include "factorizer.h"
+#include "rating.h"
+
+namespace mf {
+
+/**
+ * Matrix factorization using stochastic gradient descent with biases
+ * over shards written by split_rating_file(), for rating matrices
+ * larger than memory. Only the factors and two shards are held in
+ * memory: shards are read in order by a prefetch thread while the
+ * previous shard is trained. Users of a shard are trained in the same
+ * order and with the same learning rates as MatrixFactorizerSgdBias.
+ * The training matrix is not kept, so a saved model (a model of
+ * MatrixFactorizerSgdBias) has no rated items to be excluded from
+ * top-N items.
+ */
+class MatrixFactorizerSharded : public MatrixFactorizerSgdBias {
+ private:
+  RatingShardSet shards_;  ///< shards of the training matrix
+
+  /**
+   * Run stochastic gradient descent over the shards.
+   * @param updater object which has begin_user(user, state),
+   *                update_factors(user, item, rate, eta_user, eta_item,
+   *                               lambda, state, grads)
+   *                and end_user(user, state)
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  template<typename Updater>
+  void run_shards(Updater &updater, size_t niter, double eta, double lambda);
+
+  /**
+   * Run stochastic gradient descent over the shards with the
+   * fixed-rank kernel of rank K.
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  template<int K>
+  void run_fixed_rank_shards(size_t niter, double eta, double lambda);
+
+  /**
+   * Train the ratings of a shard.
+   * @param updater updater
+   * @param shard shard
+   * @param mat ratings of the shard
+   * @param count the number of ratings visited before the shard
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   * @return sum of squared errors
+   */
+  template<typename Updater>
+  double train_shard(Updater &updater, const RatingShard &shard,
+                     const SMat &mat, size_t count, double eta,
+                     double lambda);
+
+ public:
+  /**
+   * Constructor.
+   */
+  MatrixFactorizerSharded() { }
+
+  /**
+   * Destructor.
+   */
+  ~MatrixFactorizerSharded() { }
+
+  /**
+   * Read the manifest of shards.
+   * @param dirname directory of shards
+   */
+  void train_shards(const char *dirname);
+
+  /**
+   * Get the number of ratings in the shards.
+   * @return the number of ratings
+   */
+  size_t num_ratings() const {
+    return shards_.nrating;
+  }
+
+  /**
+   * Get the number of shards.
+   * @return the number of shards
+   */
+  size_t num_shards() const {
+    return shards_.shards.size();
+  }
+
+  /**
+   * Factorize the shards.
+   * @param ncluster the number of clusters
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  void factorize(size_t ncluster, size_t niter, double eta, double lambda);
+};
+
+} /* namespace mf */
+
+#endif  // MF_SHARD_H_
@@ -0,0 +1,407 @@
+//
+// Hyperparameter search of matrix factorization
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include "tune.h"
+
+namespace mf {
+
+/* reports sent from workers to the tuner */
+enum {
+  REPORT_EPOCH  = 1,  ///< validation RMSE of an epoch (answered by the tuner)
+  REPORT_FOLD   = 2,  ///< validation RMSE of a finished fold
+  REPORT_FINISH = 3   ///< the worker exits
+};
+
+/**
+ * Report message.
+ */
+struct Report {
+  int type;     ///< report type
+  int fold;     ///< fold index
+  int epoch;    ///< the number of epochs run
+  double rmse;  ///< validation RMSE
+};
+
+/**
+ * Observer of epochs in a worker, which sends each epoch to the tuner
+ * and waits for the decision to continue.
+ */
+class WorkerObserver : public EpochObserver {
+ private:
+  int fd_;        ///< socket connected to the tuner
+  int fold_;      ///< current fold index
+  double rmse_;   ///< validation RMSE of the last epoch
+  bool stopped_;  ///< true if the tuner stopped the trial
+
+ public:
+  /**
+   * Constructor.
+   * @param fd socket connected to the tuner
+   */
+  explicit WorkerObserver(int fd)
+    : fd_(fd), fold_(0), rmse_(-1), stopped_(false) { }
+
+  /**
+   * Start a fold.
+   * @param fold fold index
+   */
+  void begin_fold(int fold) {
+    fold_ = fold;
+    rmse_ = -1;
+  }
+
+  /**
+   * Send the RMSE of an epoch to the tuner.
+   */
+  bool end_epoch(size_t epoch, double train_rmse, double valid_rmse) {
+    Report report = { REPORT_EPOCH, fold_, static_cast<int>(epoch),
+                      valid_rmse };
+    write_all(fd_, &report, sizeof(report));
+    int go;
+    read_all(fd_, &go, sizeof(go));
+    rmse_ = valid_rmse;
+    stopped_ = !go;
+    return go != 0;
+  }
+
+  /**
+   * Get the validation RMSE of the last epoch.
+   * @return RMSE (-1 if no epochs were reported)
+   */
+  double rmse() const {
+    return rmse_;
+  }
+
+  /**
+   * Check whether the tuner stopped the trial.
+   * @return true if stopped
+   */
+  bool stopped() const {
+    return stopped_;
+  }
+};
+
+/**
+ * Running worker process.
+ */
+struct Worker {
+  int fd;        ///< socket connected to the worker
+  size_t trial;  ///< trial index
+  pid_t pid;     ///< process ID
+  double start;  ///< start time of the trial
+};
+
+/**
+ * Read a report from a worker. Unlike read_all(), this does not exit,
+ * since a worker may die (e.g. killed for memory) during a trial.
+ * @param fd socket connected to the worker
+ * @param report output report
+ * @return false if the worker closed the socket
+ */
+static bool read_report(int fd, Report &report) {
+  char *p = reinterpret_cast<char *>(&report);
+  size_t size = sizeof(report);
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+/**
+ * Send the decision of an epoch to a worker. A failure is ignored:
+ * the worker has died, and the next read of its socket fails.
+ * @param fd socket connected to the worker
+ * @param go nonzero to continue the trial
+ */
+static void send_decision(int fd, int go) {
+  ssize_t n;
+  do {
+    n = write(fd, &go, sizeof(go));
+  } while (n < 0 && errno == EINTR);
+}
+
+/**
+ * Check whether a value is finite (neither NaN nor infinite).
+ * @param value value
+ * @return true if finite
+ */
+static bool is_finite(double value) {
+  return value - value == 0;
+}
+
+/**
+ * Compare results: diverged trials (non-finite RMSE) last, finished
+ * trials first, then lower RMSE.
+ */
+static bool better_result(const TuneResult &left, const TuneResult &right) {
+  if (is_finite(left.rmse) != is_finite(right.rmse)) {
+    return is_finite(left.rmse);
+  }
+  if ((left.stopped == 0) != (right.stopped == 0)) return left.stopped == 0;
+  return is_finite(left.rmse) && left.rmse < right.rmse;
+}
+
+/**
+ * Draw a random value log-uniformly (uniformly if lower <= 0).
+ * @param lower the minimum value
+ * @param upper the maximum value
+ * @param seed pointer of seed
+ * @return random value
+ */
+static double random_value(double lower, double upper, unsigned int *seed) {
+  double u = myrand(seed) / (RAND_MAX + 1.0);
+  if (lower <= 0 || upper <= lower) return lower + (upper - lower) * u;
+  return lower * std::pow(upper / lower, u);
+}
+
+/**
+ * Make trials of all combinations of hyperparameters.
+ */
+void grid_configs(const std::vector<size_t> &nclusters,
+                  const std::vector<double> &etas,
+                  const std::vector<double> &lambdas,
+                  std::vector<TuneConfig> &configs) {
+  configs.clear();
+  for (size_t i = 0; i < nclusters.size(); i++) {
+    for (size_t j = 0; j < etas.size(); j++) {
+      for (size_t k = 0; k < lambdas.size(); k++) {
+        TuneConfig config = { nclusters[i], etas[j], lambdas[k] };
+        configs.push_back(config);
+      }
+    }
+  }
+}
+
+/**
+ * Make trials of random hyperparameters.
+ */
+void random_configs(const std::vector<size_t> &nclusters,
+                    const std::vector<double> &etas,
+                    const std::vector<double> &lambdas,
+                    size_t ntrial, unsigned int seed,
+                    std::vector<TuneConfig> &configs) {
+  configs.clear();
+  if (nclusters.empty() || etas.empty() || lambdas.empty()) return;
+  size_t nc_min = *std::min_element(nclusters.begin(), nclusters.end());
+  size_t nc_max = *std::max_element(nclusters.begin(), nclusters.end());
+  double eta_min = *std::min_element(etas.begin(), etas.end());
+  double eta_max = *std::max_element(etas.begin(), etas.end());
+  double lambda_min = *std::min_element(lambdas.begin(), lambdas.end());
+  double lambda_max = *std::max_element(lambdas.begin(), lambdas.end());
+  for (size_t i = 0; i < ntrial; i++) {
+    TuneConfig config;
+    config.ncluster = static_cast<size_t>(
+      round(random_value(nc_min, nc_max, &seed)));
+    config.eta = random_value(eta_min, eta_max, &seed);
+    config.lambda = random_value(lambda_min, lambda_max, &seed);
+    configs.push_back(config);
+  }
+}
+
+/**
+ * Functor to keep ratings of users and items in a training matrix.
+ */
+struct InFold {
+  Eigen::Index rows;  ///< the number of users
+  Eigen::Index cols;  ///< the number of items
+  InFold(Eigen::Index r, Eigen::Index c) : rows(r), cols(c) { }
+  bool operator() (const Eigen::Index &row, const Eigen::Index &col,
+                   const int &) const {
+    return row < rows && col < cols;
+  }
+};
+
+/**
+ * Add a fold.
+ */
+void HyperparameterTuner::add_fold(SMat &train, SMat &test) {
+  trains_.push_back(SMat());
+  tests_.push_back(SMat());
+  trains_.back().swap(train);
+  tests_.back().swap(test);
+  tests_.back().prune(InFold(trains_.back().rows(), trains_.back().cols()));
+}
+
+/**
+ * Record the validation RMSE of an epoch.
+ * A trial whose RMSE is not finite has diverged and stops at once.
+ */
+bool HyperparameterTuner::record_epoch(size_t fold, size_t epoch,
+                                       double rmse) {
+  if (!is_finite(rmse)) return true;
+  std::vector<std::vector<double> > &epochs = history_[fold];
+  if (epochs.size() < epoch) epochs.resize(epoch);
+  std::vector<double> &rmses = epochs[epoch-1];
+  bool stop = false;
+  if (epoch > TUNE_GRACE_EPOCHS && rmses.size() >= TUNE_MIN_TRIALS) {
+    std::vector<double> sorted(rmses);
+    size_t half = sorted.size() / 2;
+    std::nth_element(sorted.begin(), sorted.begin() + half, sorted.end());
+    stop = rmse > sorted[half];
+  }
+  rmses.push_back(rmse);
+  return stop;
+}
+
+/**
+ * Main loop of a worker process.
+ * The training matrix of each fold is swapped into the factorizer, so
+ * that its pages stay shared with the tuner.
+ */
+void HyperparameterTuner::run_worker(const TuneConfig &config, size_t niter,
+                                     int fd) {
+  MatrixFactorizer *mf = create_factorizer(model_type_);
+  if (mf == NULL) {
+    fprintf(stderr, "[Error] unknown model type: %d\n", model_type_);
+    exit(1);
+  }
+  WorkerObserver observer(fd);
+  for (size_t f = 0; f < trains_.size(); f++) {
+    observer.begin_fold(f);
+    mf->train_matrix(trains_[f]);
+    mf->set_validation(tests_[f], 0);
+    mf->set_epoch_observer(&observer);
+    mf->factorize(config.ncluster, niter, config.eta, config.lambda);
+    if (observer.stopped()) break;
+    Report report = { REPORT_FOLD, static_cast<int>(f),
+                      static_cast<int>(mf->num_epochs()), observer.rmse() };
+    write_all(fd, &report, sizeof(report));
+  }
+  Report report = { REPORT_FINISH, 0, 0, 0.0 };
+  write_all(fd, &report, sizeof(report));
+  delete mf;
+}
+
+/**
+ * Run trials.
+ */
+void HyperparameterTuner::run(const std::vector<TuneConfig> &configs,
+                              size_t niter,
+                              std::vector<TuneResult> &results) {
+  results.resize(configs.size());
+  for (size_t i = 0; i < configs.size(); i++) {
+    TuneResult &result = results[i];
+    result.config = configs[i];
+    result.rmse = 0.0;
+    result.nfold = 0;
+    result.nepoch = 0;
+    result.stopped = 0;
+    result.elapsed = 0.0;
+    result.failed = false;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  history_.assign(trains_.size(), std::vector<std::vector<double> >());
+
+  std::vector<Worker> workers;
+  std::vector<struct pollfd> fds;
+  size_t next = 0;
+  while (next < configs.size() || !workers.empty()) {
+    while (workers.size() < nworker_ && next < configs.size()) {
+      int sv[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        fprintf(stderr, "[Error] cannot create socket: %s\n",
+                strerror(errno));
+        exit(1);
+      }
+      pid_t pid = fork();
+      if (pid < 0) {
+        fprintf(stderr, "[Error] cannot fork: %s\n", strerror(errno));
+        exit(1);
+      } else if (pid == 0) {
+        close(sv[0]);
+        for (size_t i = 0; i < workers.size(); i++) close(workers[i].fd);
+        run_worker(configs[next], niter, sv[1]);
+        close(sv[1]);
+        _exit(0);
+      }
+      close(sv[1]);
+      Worker worker = { sv[0], next++, pid, get_time() };
+      workers.push_back(worker);
+    }
+
+    fds.resize(workers.size());
+    for (size_t i = 0; i < workers.size(); i++) {
+      fds[i].fd = workers[i].fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if (poll(&fds[0], fds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "[Error] cannot poll workers: %s\n", strerror(errno));
+      exit(1);
+    }
+    for (size_t i = fds.size(); i-- > 0; ) {
+      if (fds[i].revents == 0) continue;
+      Worker &worker = workers[i];
+      TuneResult &result = results[worker.trial];
+      Report report;
+      if (!read_report(worker.fd, report)) {
+        fprintf(stderr, "[Error] worker of trial (ncluster=%ld eta=%g "
+                "lambda=%g) exited\n", result.config.ncluster,
+                result.config.eta, result.config.lambda);
+        result.rmse = std::numeric_limits<double>::quiet_NaN();
+        result.failed = true;
+        report.type = REPORT_FINISH;
+      }
+      if (report.type == REPORT_EPOCH) {
+        result.nepoch++;
+        bool stop = record_epoch(report.fold, report.epoch, report.rmse);
+        if (stop) {
+          result.rmse += report.rmse;
+          result.nfold++;
+          result.stopped = report.epoch;
+        }
+        send_decision(worker.fd, !stop);
+      } else if (report.type == REPORT_FOLD) {
+        result.rmse += report.rmse;
+        result.nfold++;
+      } else {
+        result.elapsed = get_time() - worker.start;
+        close(worker.fd);
+        int status;
+        waitpid(worker.pid, &status, 0);
+        workers[i] = workers.back();
+        workers.pop_back();
+      }
+    }
+  }
+
+  for (size_t i = 0; i < results.size(); i++) {
+    if (results[i].nfold > 0) results[i].rmse /= results[i].nfold;
+  }
+  std::stable_sort(results.begin(), results.end(), better_result);
+}
+
+} /* namespace mf */
@@ -0,0 +1,168 @@
+//
+// Hyperparameter search of matrix factorization
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef MF_TUNE_H_
+#define MF_TUNE_H_
+
+#include <vector>
+#include "factorizer.h"
+
+namespace mf {
+
+/* constants */
+const size_t TUNE_MIN_TRIALS = 3;    ///< RMSEs of an epoch needed to stop
+const size_t TUNE_GRACE_EPOCHS = 2;  ///< epochs which are never stopped
+
+/**
+ * Hyperparameters of a trial.
+ */
+struct TuneConfig {
+  size_t ncluster;  ///< the number of clusters
+  double eta;       ///< learning rate
+  double lambda;    ///< regularization parameter
+};
+
+/**
+ * Result of a trial.
+ */
+struct TuneResult {
+  TuneConfig config;  ///< hyperparameters
+  double rmse;        ///< mean validation RMSE of the evaluated folds
+  size_t nfold;       ///< the number of evaluated folds
+  size_t nepoch;      ///< the number of epochs run in all folds
+  size_t stopped;     ///< the epoch at which the trial stopped (0 if not)
+  double elapsed;     ///< time of the trial in seconds
+  bool failed;        ///< true if the worker exited without results (NaN)
+};
+
+/**
+ * Make trials of all combinations of hyperparameters.
+ * @param nclusters candidates of the number of clusters
+ * @param etas candidates of learning rates
+ * @param lambdas candidates of regularization parameters
+ * @param configs output trials
+ */
+void grid_configs(const std::vector<size_t> &nclusters,
+                  const std::vector<double> &etas,
+                  const std::vector<double> &lambdas,
+                  std::vector<TuneConfig> &configs);
+
+/**
+ * Make trials of random hyperparameters, each of which is drawn
+ * log-uniformly between the minimum and the maximum of its candidates.
+ * @param nclusters candidates of the number of clusters
+ * @param etas candidates of learning rates
+ * @param lambdas candidates of regularization parameters
+ * @param ntrial the number of trials
+ * @param seed seed of random numbers
+ * @param configs output trials
+ */
+void random_configs(const std::vector<size_t> &nclusters,
+                    const std::vector<double> &etas,
+                    const std::vector<double> &lambdas,
+                    size_t ntrial, unsigned int seed,
+                    std::vector<TuneConfig> &configs);
+
+/**
+ * Search of hyperparameters by cross validation.
+ * The folds are read once, and each trial runs in a worker process
+ * forked from the tuner, so that the workers share the folds as
+ * copy-on-write pages. Workers report the validation RMSE of every
+ * epoch, and a trial stops when its RMSE is worse than the median
+ * RMSE of other trials at the same fold and epoch (median stopping).
+ */
+class HyperparameterTuner {
+ private:
+  int model_type_;               ///< ModelType of trials
+  size_t nworker_;               ///< the number of worker processes
+  std::vector<SMat> trains_;     ///< training matrices of folds
+  std::vector<SMat> tests_;      ///< validation matrices of folds
+  /** validation RMSEs reported at each fold and epoch */
+  std::vector<std::vector<std::vector<double> > > history_;
+
+  /**
+   * Record the validation RMSE of an epoch and decide whether the
+   * trial should stop (always if the RMSE is not finite).
+   * @param fold fold index
+   * @param epoch the number of epochs run
+   * @param rmse validation RMSE
+   * @return true if the trial should stop
+   */
+  bool record_epoch(size_t fold, size_t epoch, double rmse);
+
+  /**
+   * Main loop of a worker process.
+   * @param config hyperparameters
+   * @param niter the number of iterations
+   * @param fd socket connected to the tuner
+   */
+  void run_worker(const TuneConfig &config, size_t niter, int fd);
+
+ public:
+  /**
+   * Constructor.
+   * @param model_type ModelType of trials
+   */
+  explicit HyperparameterTuner(int model_type)
+    : model_type_(model_type), nworker_(1) { }
+
+  /**
+   * Destructor.
+   */
+  ~HyperparameterTuner() { }
+
+  /**
+   * Set the number of worker processes.
+   * @param nworker the number of worker processes
+   */
+  void set_num_workers(size_t nworker) {
+    nworker_ = nworker > 0 ? nworker : 1;
+  }
+
+  /**
+   * Add a fold. The matrices are swapped rather than copied, and
+   * validation ratings out of the training matrix are removed.
+   * @param train training matrix
+   * @param test validation matrix
+   */
+  void add_fold(SMat &train, SMat &test);
+
+  /**
+   * Get the number of folds.
+   * @return the number of folds
+   */
+  size_t num_folds() const {
+    return trains_.size();
+  }
+
+  /**
+   * Run trials.
+   * @param configs hyperparameters of trials
+   * @param niter the number of iterations
+   * @param results output results sorted by RMSE (finished trials
+   *                first, then stopped trials, then diverged or failed
+   *                trials)
+   */
+  void run(const std::vector<TuneConfig> &configs, size_t niter,
+           std::vector<TuneResult> &results);
+};
+
+} /* namespace mf */
+
+#endif  // MF_TUNE_H_
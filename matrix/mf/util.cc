@@ -17,12 +17,26 @@
 // Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 //
 
+#include <sys/time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include "util.h"
 
 namespace mf {
 
+/**
+ * Get the current time.
+ */
+double get_time() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
 /**
  * Set seed for random number generator.
  */
@@ -45,6 +59,62 @@ int myrand(unsigned int *seed) {
 #endif
 }
 
+/**
+ * Convert a float to IEEE 754 half precision.
+ */
+uint16_t float_to_half(float value) {
+  uint32_t x;
+  memcpy(&x, &value, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  int exp = static_cast<int>((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+  if (((x >> 23) & 0xff) == 0xff) {  // inf or nan
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  }
+  if (exp >= 31) return sign | 0x7c00;  // overflow
+  int shift = 13;
+  uint32_t h = (exp << 10) | (mant >> 13);
+  if (exp <= 0) {  // subnormal
+    if (exp < -10) return sign;
+    mant |= 0x800000;
+    shift = 14 - exp;
+    h = mant >> shift;
+  }
+  uint32_t rem = mant & ((1u << shift) - 1);
+  uint32_t half = 1u << (shift - 1);
+  if (rem > half || (rem == half && (h & 1))) h++;  // may carry to exp
+  return sign | h;
+}
+
+/**
+ * Convert IEEE 754 half precision to a float.
+ */
+float half_to_float(uint16_t bits) {
+  uint32_t sign = static_cast<uint32_t>(bits & 0x8000) << 16;
+  int exp = (bits >> 10) & 0x1f;
+  uint32_t mant = bits & 0x3ff;
+  uint32_t x;
+  if (exp == 0) {
+    if (mant == 0) {
+      x = sign;
+    } else {  // subnormal
+      exp = 1;
+      while (!(mant & 0x400)) {
+        mant <<= 1;
+        exp--;
+      }
+      x = sign | ((exp + 127 - 15) << 23) | ((mant & 0x3ff) << 13);
+    }
+  } else if (exp == 31) {
+    x = sign | 0x7f800000 | (mant << 13);
+  } else {
+    x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+  }
+  float value;
+  memcpy(&value, &x, sizeof(value));
+  return value;
+}
+
 /**
  * Split a string by a delimiter string.
  */
@@ -78,4 +148,38 @@ std::string join_strings(const std::vector<std::string> &splited,
   return ss.str();
 }
 
+/**
+ * Write data to a socket.
+ */
+void write_all(int fd, const void *buf, size_t size) {
+  const char *p = static_cast<const char *>(buf);
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      fprintf(stderr, "[Error] cannot write to socket: %s\n", strerror(errno));
+      exit(1);
+    }
+    p += n;
+    size -= n;
+  }
+}
+
+/**
+ * Read data from a socket.
+ */
+void read_all(int fd, void *buf, size_t size) {
+  char *p = static_cast<char *>(buf);
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      fprintf(stderr, "[Error] cannot read from socket\n");
+      exit(1);
+    }
+    p += n;
+    size -= n;
+  }
+}
+
 } /* namespace mf */
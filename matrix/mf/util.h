@@ -20,6 +20,8 @@
 #ifndef MF_UTIL_H_
 #define MF_UTIL_H_
 
+#include <stdint.h>
+#include <cmath>
 #include <string>
 #include <vector>
 
@@ -47,6 +49,67 @@ bool greater_pair(const std::pair<KeyType, ValueType> &left,
   }
 }
 
+/**
+ * Parse an unsigned integer without allocation.
+ * @param p pointer to the first character
+ * @param end end of the buffer
+ * @param value output value
+ * @return pointer to the character after the number (p if no digits)
+ */
+inline const char *parse_uint(const char *p, const char *end, size_t &value) {
+  size_t v = 0;
+  const char *q = p;
+  for (; q < end && *q >= '0' && *q <= '9'; ++q) {
+    v = v * 10 + (*q - '0');
+  }
+  value = v;
+  return q;
+}
+
+/**
+ * Parse a floating point number without allocation.
+ * "[+-]digits[.digits][(e|E)[+-]digits]" is accepted.
+ * @param p pointer to the first character
+ * @param end end of the buffer
+ * @param value output value
+ * @return pointer to the character after the number (p if no digits)
+ */
+inline const char *parse_float(const char *p, const char *end, double &value) {
+  const char *q = p;
+  bool negative = false;
+  if (q < end && (*q == '-' || *q == '+')) negative = (*q++ == '-');
+  double v = 0.0;
+  const char *digits = q;
+  for (; q < end && *q >= '0' && *q <= '9'; ++q) {
+    v = v * 10 + (*q - '0');
+  }
+  if (q < end && *q == '.') {
+    double scale = 0.1;
+    for (++q; q < end && *q >= '0' && *q <= '9'; ++q) {
+      v += (*q - '0') * scale;
+      scale *= 0.1;
+    }
+  }
+  if (q == digits || (q == digits + 1 && *digits == '.')) {
+    value = 0.0;
+    return p;
+  }
+  if (q < end && (*q == 'e' || *q == 'E')) {
+    const char *r = q + 1;
+    bool negative_exp = false;
+    if (r < end && (*r == '-' || *r == '+')) negative_exp = (*r++ == '-');
+    size_t exp;
+    const char *s = parse_uint(r, end, exp);
+    if (s != r) {
+      v *= std::pow(10.0, negative_exp ? -static_cast<double>(exp)
+                                       : static_cast<double>(exp));
+      q = s;
+    }
+  }
+  value = negative ? -v : v;
+  return q;
+}
+
 /**
  * Split a string by a delimiter string.
  * @param s input string to be splited
@@ -65,6 +128,12 @@ void split_string(const std::string &s, const std::string &delimiter,
 std::string join_strings(const std::vector<std::string> &splited,
                          const std::string &delimiter);
 
+/**
+ * Get the current time.
+ * @return seconds since the epoch
+ */
+double get_time();
+
 /**
  * Set seed for random number generator.
  * @param seed seed
@@ -78,6 +147,36 @@ void mysrand(unsigned int seed);
  */
 int myrand(unsigned int *seed);
 
+/**
+ * Write data to a socket (exit on errors).
+ * @param fd file descriptor
+ * @param buf data
+ * @param size data size
+ */
+void write_all(int fd, const void *buf, size_t size);
+
+/**
+ * Read data from a socket (exit on errors and end of file).
+ * @param fd file descriptor
+ * @param buf output buffer
+ * @param size data size
+ */
+void read_all(int fd, void *buf, size_t size);
+
+/**
+ * Convert a float to IEEE 754 half precision (round to nearest even).
+ * @param value float value
+ * @return half precision bits
+ */
+uint16_t float_to_half(float value);
+
+/**
+ * Convert IEEE 754 half precision to a float.
+ * @param bits half precision bits
+ * @return float value
+ */
+float half_to_float(uint16_t bits);
+
 } /* namespace mf */
 
 #endif  // MF_UTIL_H_
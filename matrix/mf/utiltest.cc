@@ -17,9 +17,81 @@
 // Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 //
 
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
 #include <gtest/gtest.h>
+#include "dictionary.h"
+#include "factorizer.h"
+#include "quantize.h"
+#include "rating.h"
 #include "util.h"
 
+/**
+ * Make a temporary file name.
+ * @return file name (the file is created empty)
+ */
+static std::string temp_filename() {
+  char filename[] = "/tmp/utiltest.XXXXXX";
+  int fd = mkstemp(filename);
+  if (fd >= 0) close(fd);
+  return filename;
+}
+
+/**
+ * Make a rating matrix of random rates (about a third of the pairs
+ * of users and items except index 0).
+ * @param rows the number of rows
+ * @param cols the number of columns
+ * @param mat output matrix
+ */
+static void random_matrix(int rows, int cols, mf::SMat &mat) {
+  std::vector<Eigen::Triplet<int> > triplets;
+  unsigned int seed = 1;
+  for (int i = 1; i < rows; i++) {
+    for (int j = 1; j < cols; j++) {
+      if (mf::myrand(&seed) % 3 != 0) continue;
+      triplets.push_back(Eigen::Triplet<int>(i, j,
+                                             1 + mf::myrand(&seed) % 5));
+    }
+  }
+  mat.resize(rows, cols);
+  mat.setFromTriplets(triplets.begin(), triplets.end());
+}
+
+/**
+ * Train a model, save it and check that the loaded model predicts the
+ * same rates and that a truncated file is rejected.
+ * @param mat training matrix
+ */
+template<typename Factorizer>
+static void check_model_file(const mf::SMat &mat) {
+  Factorizer trained;
+  mf::SMat train(mat);
+  trained.train_matrix(train);
+  trained.factorize(8, 3, 0.01, 0.02);
+  std::string filename = temp_filename();
+  trained.save_model(filename.c_str());
+  Factorizer loaded;
+  loaded.load_model(filename.c_str());
+
+  // a truncated file is rejected before its matrices are allocated
+  EXPECT_EQ(0, truncate(filename.c_str(), 64));
+  Factorizer broken;
+  EXPECT_EXIT(broken.load_model(filename.c_str()),
+              ::testing::ExitedWithCode(1), "broken model file");
+  unlink(filename.c_str());
+  ASSERT_EQ(trained.num_users(), loaded.num_users());
+  ASSERT_EQ(trained.num_items(), loaded.num_items());
+  for (int i = 1; i < trained.num_users(); i++) {
+    for (int j = 1; j < trained.num_items(); j++) {
+      EXPECT_DOUBLE_EQ(trained.predict(i, j), loaded.predict(i, j));
+    }
+  }
+}
+
 /* split_string */
 TEST(UtilTest, SplitStringTest) {
   std::string input;
@@ -74,6 +146,206 @@ TEST(UtilTest, JoinStringsTest) {
   EXPECT_EQ("a\tbc\tdef\tgh", joined);
 }
 
+/* parse_uint */
+TEST(UtilTest, ParseUintTest) {
+  std::string input = "123\t45";
+  const char *end = input.c_str() + input.size();
+  size_t value;
+  const char *p = mf::parse_uint(input.c_str(), end, value);
+  EXPECT_EQ(123, value);
+  EXPECT_EQ('\t', *p);
+  p = mf::parse_uint(p + 1, end, value);
+  EXPECT_EQ(45, value);
+  EXPECT_EQ(end, p);
+
+  // no digits
+  input = "abc";
+  p = mf::parse_uint(input.c_str(), input.c_str() + input.size(), value);
+  EXPECT_EQ(input.c_str(), p);
+}
+
+/* parse_float */
+TEST(UtilTest, ParseFloatTest) {
+  std::string input = "3.5\t-2\t1e2\t.25\tx";
+  const char *end = input.c_str() + input.size();
+  double value;
+  const char *p = mf::parse_float(input.c_str(), end, value);
+  EXPECT_DOUBLE_EQ(3.5, value);
+  EXPECT_EQ('\t', *p);
+  p = mf::parse_float(p + 1, end, value);
+  EXPECT_DOUBLE_EQ(-2.0, value);
+  p = mf::parse_float(p + 1, end, value);
+  EXPECT_DOUBLE_EQ(100.0, value);
+  p = mf::parse_float(p + 1, end, value);
+  EXPECT_DOUBLE_EQ(0.25, value);
+  EXPECT_EQ('\t', *p);
+  const char *q = mf::parse_float(p + 1, end, value);
+  EXPECT_EQ(p + 1, q);
+}
+
+/* float_to_half, half_to_float */
+TEST(UtilTest, HalfFloatTest) {
+  EXPECT_EQ(0x3c00, mf::float_to_half(1.0f));
+  EXPECT_EQ(0xc000, mf::float_to_half(-2.0f));
+  EXPECT_EQ(0x7bff, mf::float_to_half(65504.0f));
+  EXPECT_EQ(0x7c00, mf::float_to_half(1e6f));
+  EXPECT_EQ(0x0001, mf::float_to_half(5.9604645e-8f));
+  EXPECT_EQ(0x0000, mf::float_to_half(1e-9f));
+  EXPECT_EQ(0x3c00, mf::float_to_half(1.0f + 1.0f / 4096));  // to even
+  EXPECT_EQ(0x3c01, mf::float_to_half(1.0f + 3.0f / 4096));
+  EXPECT_FLOAT_EQ(1.0f, mf::half_to_float(0x3c00));
+  EXPECT_FLOAT_EQ(-2.0f, mf::half_to_float(0xc000));
+  EXPECT_FLOAT_EQ(5.9604645e-8f, mf::half_to_float(0x0001));
+  for (int i = 0; i < 0x7c00; i++) {
+    uint16_t bits = static_cast<uint16_t>(i);
+    EXPECT_EQ(bits, mf::float_to_half(mf::half_to_float(bits)));
+  }
+}
+
+/* IdDictionary */
+TEST(UtilTest, IdDictionaryTest) {
+  mf::IdDictionary dict;
+  EXPECT_EQ(1, dict.size());
+  EXPECT_EQ(1, dict.add("18446744073709551615", 20));
+  EXPECT_EQ(2, dict.add("user", 4));
+  EXPECT_EQ(1, dict.add("18446744073709551615", 20));
+  EXPECT_EQ(2, dict.find(std::string("user")));
+  EXPECT_EQ(-1, dict.find(std::string("use")));
+  EXPECT_EQ(-1, dict.find(std::string("")));
+  char id[16];
+  for (int i = 0; i < 1000; i++) {
+    sprintf(id, "%d", i);
+    EXPECT_EQ(i + 3, dict.add(id, strlen(id)));
+  }
+  EXPECT_EQ(1003, dict.size());
+  EXPECT_EQ(std::string("user"), dict.id(2));
+  EXPECT_EQ(std::string("999"), dict.id(1002));
+  EXPECT_EQ(502, dict.find(std::string("499")));
+}
+
+/* IdDictionary::write, IdDictionary::read */
+TEST(UtilTest, IdDictionaryFileTest) {
+  mf::IdDictionary dict;
+  dict.add("user", 4);
+  dict.add("item", 4);
+  std::string filename = temp_filename();
+  FILE *fp = fopen(filename.c_str(), "wb");
+  ASSERT_TRUE(fp != NULL);
+  dict.write(fp);
+  fclose(fp);
+  std::string data;
+  char buf[256];
+  fp = fopen(filename.c_str(), "rb");
+  ASSERT_TRUE(fp != NULL);
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) data.append(buf, n);
+  fclose(fp);
+  unlink(filename.c_str());
+
+  mf::IdDictionary loaded;
+  const char *end = data.data() + data.size();
+  EXPECT_EQ(end, loaded.read(data.data(), end));
+  EXPECT_EQ(3, loaded.size());
+  EXPECT_EQ(2, loaded.find(std::string("item")));
+  EXPECT_EQ(std::string("user"), loaded.id(1));
+
+  // an offset beyond the IDs is rejected
+  uint64_t offset = 100;
+  memcpy(&data[sizeof(uint64_t) * 4], &offset, sizeof(offset));
+  mf::IdDictionary broken;
+  EXPECT_EXIT(broken.read(data.data(), data.data() + data.size()),
+              ::testing::ExitedWithCode(1), "broken model file");
+}
+
+/* write_binary_rating_file, read_binary_rating_file */
+TEST(UtilTest, BinaryRatingFileTest) {
+  mf::SMat mat;
+  random_matrix(30, 20, mat);
+  std::string filename = temp_filename();
+  mf::write_binary_rating_file(filename.c_str(), mat);
+  EXPECT_TRUE(mf::is_binary_rating_file(filename.c_str()));
+  mf::SMat loaded;
+  mf::read_binary_rating_file(filename.c_str(), loaded);
+  ASSERT_EQ(mat.rows(), loaded.rows());
+  ASSERT_EQ(mat.cols(), loaded.cols());
+  ASSERT_EQ(mat.nonZeros(), loaded.nonZeros());
+  EXPECT_EQ(0, memcmp(mat.outerIndexPtr(), loaded.outerIndexPtr(),
+                      sizeof(int) * (mat.rows() + 1)));
+  EXPECT_EQ(0, memcmp(mat.innerIndexPtr(), loaded.innerIndexPtr(),
+                      sizeof(int) * mat.nonZeros()));
+  EXPECT_EQ(0, memcmp(mat.valuePtr(), loaded.valuePtr(),
+                      sizeof(int) * mat.nonZeros()));
+
+  // a truncated file is rejected
+  EXPECT_EQ(0, truncate(filename.c_str(), sizeof(mf::RatingFileHeader)
+                        + sizeof(int32_t) * (mat.rows() + 1)));
+  EXPECT_EXIT(mf::read_binary_rating_file(filename.c_str(), loaded),
+              ::testing::ExitedWithCode(1), "invalid rating file");
+  unlink(filename.c_str());
+}
+
+/* assign_folds, write_fold_file, read_fold_file */
+TEST(UtilTest, FoldFileTest) {
+  std::vector<uint8_t> folds;
+  mf::assign_folds(1000, 5, 1, folds);
+  ASSERT_EQ(1000, folds.size());
+  for (size_t i = 0; i < folds.size(); i++) EXPECT_GT(5, folds[i]);
+  std::string filename = temp_filename();
+  mf::write_fold_file(filename.c_str(), 5, folds);
+  std::vector<uint8_t> loaded;
+  EXPECT_EQ(5, mf::read_fold_file(filename.c_str(), loaded));
+  EXPECT_TRUE(folds == loaded);
+  unlink(filename.c_str());
+}
+
+/* save_model, load_model */
+TEST(UtilTest, ModelFileTest) {
+  mf::SMat mat;
+  random_matrix(30, 20, mat);
+  check_model_file<mf::MatrixFactorizerSgdBias>(mat);
+  check_model_file<mf::MatrixFactorizerSvdpp>(mat);
+}
+
+/* QuantizedModel::save, QuantizedModel::load */
+TEST(UtilTest, QuantizedModelFileTest) {
+  mf::SMat mat;
+  random_matrix(30, 20, mat);
+  mf::MatrixFactorizerSgdBias trained;
+  trained.train_matrix(mat);
+  trained.factorize(8, 3, 0.01, 0.02);
+  int precisions[] = { mf::PRECISION_FP16, mf::PRECISION_INT8 };
+  for (size_t p = 0; p < 2; p++) {
+    mf::QuantizedModel model;
+    model.build(trained, precisions[p]);
+    std::string filename = temp_filename();
+    model.save(filename.c_str());
+    mf::QuantizedModel loaded;
+    loaded.load(filename.c_str());
+    // rated items must be IDs of items in the model
+    FILE *fp = fopen(filename.c_str(), "r+b");
+    ASSERT_TRUE(fp != NULL);
+    int item = -1;
+    EXPECT_EQ(0, fseek(fp, -static_cast<long>(sizeof(int)), SEEK_END));
+    EXPECT_EQ(1u, fwrite(&item, sizeof(item), 1, fp));
+    fclose(fp);
+    mf::QuantizedModel broken;
+    EXPECT_EXIT(broken.load(filename.c_str()),
+                ::testing::ExitedWithCode(1), "invalid quantized model file");
+    // a truncated file is rejected before its vectors are allocated
+    EXPECT_EQ(0, truncate(filename.c_str(), 64));
+    EXPECT_EXIT(broken.load(filename.c_str()),
+                ::testing::ExitedWithCode(1), "invalid quantized model file");
+    unlink(filename.c_str());
+    ASSERT_EQ(model.num_users(), loaded.num_users());
+    ASSERT_EQ(model.num_items(), loaded.num_items());
+    for (int i = 1; i < model.num_users(); i++) {
+      for (int j = 1; j < model.num_items(); j++) {
+        EXPECT_DOUBLE_EQ(model.predict(i, j), loaded.predict(i, j));
+      }
+    }
+  }
+}
+
 int main(int argc, char **argv) {
   srand((unsigned int)time(NULL));
   testing::InitGoogleTest(&argc, argv);